@@ -7,8 +7,17 @@
 
 #include <madoka/common.h>
 #include <madoka/concurrent/critical_section.h>
+#include <madoka/concurrent/mutex.h>
 #include <madoka/concurrent/read_write_lock.h>
 
+#include <chrono>
+
+#ifndef _WIN32
+#include <atomic>
+
+struct timespec;
+#endif  // _WIN32
+
 namespace madoka {
 namespace concurrent {
 
@@ -16,20 +25,67 @@ struct VariableImpl;
 
 class ConditionVariable {
  public:
+  // Deadlines are measured on the monotonic clock, so adjustments to the
+  // system time neither shorten nor extend a wait.
+  typedef std::chrono::steady_clock Clock;
+
   ConditionVariable();
   virtual ~ConditionVariable();
 
   bool Sleep(CriticalSection* lock);
+  bool Sleep(Mutex* lock);
   bool Sleep(ReadWriteLock* lock, bool exclusive);
   bool Sleep(ReadWriteLock* lock) {
     return Sleep(lock, false);
   }
 
+  // Like Sleep, but return false once |deadline| has passed without a wake.
+  bool SleepUntil(CriticalSection* lock, const Clock::time_point& deadline);
+  bool SleepUntil(Mutex* lock, const Clock::time_point& deadline);
+  bool SleepUntil(ReadWriteLock* lock, bool exclusive,
+                  const Clock::time_point& deadline);
+  bool SleepUntil(ReadWriteLock* lock, const Clock::time_point& deadline) {
+    return SleepUntil(lock, false, deadline);
+  }
+
+  template<class Lock, class Rep, class Period>
+  bool SleepFor(Lock* lock, const std::chrono::duration<Rep, Period>& timeout) {
+    return SleepUntil(lock, Clock::now() + ToClockDuration(timeout));
+  }
+
+  template<class Rep, class Period>
+  bool SleepFor(ReadWriteLock* lock, bool exclusive,
+                const std::chrono::duration<Rep, Period>& timeout) {
+    return SleepUntil(lock, exclusive, Clock::now() + ToClockDuration(timeout));
+  }
+
   void Wake();
   void WakeAll();
 
  private:
+  // Rounds up, so a wait never ends before the requested timeout.
+  template<class Rep, class Period>
+  static Clock::duration ToClockDuration(
+      const std::chrono::duration<Rep, Period>& timeout) {
+    auto duration = std::chrono::duration_cast<Clock::duration>(timeout);
+    if (duration < timeout)
+      ++duration;
+
+    return duration;
+  }
+
+#ifdef _WIN32
+  bool Wait(ReadWriteLock* lock, bool exclusive, uint32_t timeout);
+
   VariableImpl* variable_;
+#else   // _WIN32
+  bool Wait(Lockable* lock, const timespec* deadline);
+  bool Wait(CriticalSection* lock, const timespec* deadline);
+  bool Wait(ReadWriteLock* lock, bool exclusive, const timespec* deadline);
+
+  std::atomic<uint32_t> sequence_;
+  std::atomic<uint32_t> waiters_;
+#endif  // _WIN32
 
   MADOKA_DISALLOW_COPY_AND_ASSIGN(ConditionVariable);
 };
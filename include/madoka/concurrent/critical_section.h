@@ -3,28 +3,60 @@
 #ifndef MADOKA_CONCURRENT_CRITICAL_SECTION_H_
 #define MADOKA_CONCURRENT_CRITICAL_SECTION_H_
 
+#include <stdint.h>
+
 #include <madoka/common.h>
 #include <madoka/concurrent/lockable.h>
 
+#ifndef _WIN32
+#include <madoka/concurrent/mutex.h>
+
+#include <atomic>
+#endif  // _WIN32
+
 namespace madoka {
 namespace concurrent {
 
+class LockStats;
 struct MutexImpl;
 
+// A recursive exclusive lock. Contended threads spin for up to |spin_count|
+// iterations before they block; on POSIX the lock is a Mutex plus an owner
+// and a recursion count, all stored inline.
 class CriticalSection : public Lockable {
  public:
   CriticalSection();
+  explicit CriticalSection(uint32_t spin_count);
   virtual ~CriticalSection();
 
   void Lock() MADOKA_OVERRIDE;
   bool TryLock();
   void Unlock() MADOKA_OVERRIDE;
 
+  // Collects the statistics of this lock under |name| when built with
+  // MADOKA_LOCK_STATS; see LockStats.
+#ifdef MADOKA_LOCK_STATS
+  void SetName(const char* name);
+#else   // MADOKA_LOCK_STATS
+  void SetName(const char* /*name*/) {}
+#endif  // MADOKA_LOCK_STATS
+
  private:
   friend class ConditionVariable;
 
+#ifdef _WIN32
   MutexImpl* mutex_;
 
+#ifdef MADOKA_LOCK_STATS
+  LockStats* stats_ = nullptr;
+  uint64_t acquired_at_ = 0;
+#endif  // MADOKA_LOCK_STATS
+#else   // _WIN32
+  Mutex mutex_;
+  std::atomic<uintptr_t> owner_;
+  uint32_t recursion_;
+#endif  // _WIN32
+
   MADOKA_DISALLOW_COPY_AND_ASSIGN(CriticalSection);
 };
 
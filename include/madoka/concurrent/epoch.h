@@ -0,0 +1,70 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_EPOCH_H_
+#define MADOKA_CONCURRENT_EPOCH_H_
+
+#include <madoka/common.h>
+
+namespace madoka {
+namespace concurrent {
+
+// Epoch-based reclamation for lock-free structures. A thread reads shared
+// nodes only between Enter and Exit (or inside an EpochGuard). A node that
+// has been unlinked is handed to Retire instead of being deleted, and is
+// freed once every thread that was inside at the time has left. Threads only
+// ever publish which epoch they entered in, so Enter and Exit cost a store
+// and a fence and never wait.
+//
+// Retired nodes are collected in per-thread batches tagged with the epoch
+// they were retired in; a batch is freed as a whole once the global epoch
+// has advanced twice past its tag. A thread that stays inside holds back
+// every batch retired since, so sections should be short and must not
+// block.
+class Epoch {
+ public:
+  // May be nested; only the outermost pair takes effect.
+  static void Enter();
+  static void Exit();
+
+  // Calls |deleter| with |object| once no thread can still be reading it.
+  // |object| must already be unreachable for threads entering from now on.
+  static void Retire(void* object, void (*deleter)(void*));
+
+  template<class T>
+  static void Retire(T* object) {
+    Retire(object, &Delete<T>);
+  }
+
+  // Hands the objects the calling thread retired so far over for
+  // reclamation, and frees whatever has become safe to. Retire does this on
+  // its own every few dozen objects; threads that retire rarely can call it
+  // to keep memory from lingering.
+  static void Collect();
+
+ private:
+  template<class T>
+  static void Delete(void* object) {
+    delete static_cast<T*>(object);
+  }
+
+  Epoch() MADOKA_DELETED;
+};
+
+class EpochGuard {
+ public:
+  EpochGuard() {
+    Epoch::Enter();
+  }
+
+  ~EpochGuard() {
+    Epoch::Exit();
+  }
+
+ private:
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(EpochGuard);
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_EPOCH_H_
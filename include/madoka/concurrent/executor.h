@@ -0,0 +1,27 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_EXECUTOR_H_
+#define MADOKA_CONCURRENT_EXECUTOR_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#else   // _WIN32
+#include <madoka/concurrent/thread_pool.h>
+#endif  // _WIN32
+
+namespace madoka {
+namespace concurrent {
+
+// Where an object runs its asynchronous callbacks: a callback environment of
+// the Win32 thread pool on Windows, a ThreadPool elsewhere. Objects bound to
+// nullptr use the default of their class.
+#ifdef _WIN32
+typedef PTP_CALLBACK_ENVIRON Executor;
+#else   // _WIN32
+typedef ThreadPool* Executor;
+#endif  // _WIN32
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_EXECUTOR_H_
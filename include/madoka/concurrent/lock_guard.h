@@ -13,19 +13,30 @@ class ReadWriteLock;
 
 class LockGuard {
  public:
-  explicit LockGuard(Lockable* lock);
-  LockGuard(ReadWriteLock* rw_lock, bool exclusive);
-
-  ~LockGuard();
-
- private:
   enum Mode {
     Invalid,
     Generic,
     Shared,
+    Upgradable,
     Exclusive,
   };
 
+  explicit LockGuard(Lockable* lock);
+  LockGuard(ReadWriteLock* rw_lock, bool exclusive);
+
+  // Takes |rw_lock| in |mode|, which is one of Shared, Upgradable and
+  // Exclusive.
+  LockGuard(ReadWriteLock* rw_lock, Mode mode);
+
+  ~LockGuard();
+
+  // Turns an Upgradable guard into an Exclusive one.
+  void Upgrade();
+
+  // Turns an Exclusive guard into a Shared one.
+  void Downgrade();
+
+ private:
   Lockable* const lock_;
   ReadWriteLock* const rw_lock_;
   Mode mode_;
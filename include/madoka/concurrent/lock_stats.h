@@ -0,0 +1,86 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_LOCK_STATS_H_
+#define MADOKA_CONCURRENT_LOCK_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <madoka/common.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace madoka {
+namespace concurrent {
+
+// Contention statistics shared by all locks given the same name with
+// SetName. Locks only collect them if MADOKA_LOCK_STATS is defined, which
+// changes their layout, so the library and everything that includes its
+// headers must agree on it (configure --enable-lock-stats). Without it the
+// locks have no extra state, SetName compiles to nothing and GetSnapshot
+// returns nothing.
+class LockStats {
+ public:
+  // Bucket 0 of a histogram counts durations of 0 ns, bucket i durations
+  // from 2^(i-1) ns up to 2^i ns, and the last one everything longer.
+  static const size_t kHistogramSize = 32;
+
+  struct Snapshot {
+    std::string name;
+
+    // Successful Lock, TryLock and Acquire*Lock calls. Recursive entries of
+    // a CriticalSection are not counted.
+    uint64_t acquisitions;
+
+    // Acquisitions that could not get the lock immediately.
+    uint64_t contentions;
+
+    // How long contended acquisitions waited.
+    uint64_t wait_time[kHistogramSize];
+
+    // How long the lock was held exclusively. Shared holds of a ReadWriteLock
+    // are not tracked. On Windows, time spent in ConditionVariable::Sleep
+    // counts as held.
+    uint64_t hold_time[kHistogramSize];
+  };
+
+  // Returns the statistics for |name|, creating them on first use. They are
+  // never destroyed.
+  static LockStats* Get(const char* name);
+
+  // Returns the statistics of every name in use.
+  static std::vector<Snapshot> GetSnapshot();
+
+  // Current time in nanoseconds on the monotonic clock.
+  static uint64_t Now();
+
+  // Records an acquisition and returns the time it completed. |start| is
+  // when a contended acquisition began waiting; it is 0 for one that did not
+  // wait.
+  uint64_t Acquired(uint64_t start);
+
+  // Records the end of an exclusive hold that began at |acquired_at|.
+  void Released(uint64_t acquired_at);
+
+ private:
+  explicit LockStats(const char* name);
+
+  static void Add(std::atomic<uint64_t>* histogram, uint64_t duration);
+
+  const std::string name_;
+  LockStats* next_;
+
+  std::atomic<uint64_t> acquisitions_;
+  std::atomic<uint64_t> contentions_;
+  std::atomic<uint64_t> wait_time_[kHistogramSize];
+  std::atomic<uint64_t> hold_time_[kHistogramSize];
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(LockStats);
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_LOCK_STATS_H_
@@ -0,0 +1,114 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_MPSC_QUEUE_H_
+#define MADOKA_CONCURRENT_MPSC_QUEUE_H_
+
+#include <madoka/common.h>
+
+#include <atomic>
+#include <thread>
+
+namespace madoka {
+namespace concurrent {
+
+// Base of the objects linked into an MpscQueue.
+struct MpscQueueEntry {
+  MpscQueueEntry() : next(nullptr) {
+  }
+
+  std::atomic<MpscQueueEntry*> next;
+};
+
+// An intrusive, unbounded FIFO queue that any number of threads may push to
+// without locking, while a single consumer at a time pops from it. The queue
+// does not own its entries.
+//
+// Push reports the transition from empty and Pop reports whether anything is
+// left, so exactly one side ends up responsible for scheduling the consumer.
+template<class T>
+class MpscQueue {
+ public:
+  MpscQueue() : head_(&stub_), tail_(&stub_), size_(0) {
+  }
+
+  // Returns true if the queue was empty before |entry| was added.
+  bool Push(T* entry) {
+    Link(entry);
+    return size_.fetch_add(1, std::memory_order_acq_rel) == 0;
+  }
+
+  // Removes the oldest entry, or returns nullptr if there is none. Calls must
+  // be serialized by the caller. If |more| is not null, it receives whether
+  // entries remain; when it is false, the next Push returns true.
+  T* Pop(bool* more) {
+    if (size_.load(std::memory_order_acquire) == 0) {
+      if (more != nullptr)
+        *more = false;
+
+      return nullptr;
+    }
+
+    // The entry is counted, but its producer may still be about to link it;
+    // that window is a few instructions wide, so just wait it out.
+    MpscQueueEntry* head = head_;
+    MpscQueueEntry* next = WaitForNext(head, head == &stub_);
+
+    if (head == &stub_) {
+      head_ = head = next;
+      next = head->next.load(std::memory_order_acquire);
+    }
+
+    if (next == nullptr) {
+      if (tail_.load(std::memory_order_acquire) == head)
+        Link(&stub_);
+
+      next = WaitForNext(head, true);
+    }
+
+    head_ = next;
+
+    bool remaining = size_.fetch_sub(1, std::memory_order_acq_rel) > 1;
+    if (more != nullptr)
+      *more = remaining;
+
+    return static_cast<T*>(head);
+  }
+
+  bool empty() const {
+    return size_.load(std::memory_order_acquire) == 0;
+  }
+
+  size_t size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void Link(MpscQueueEntry* entry) {
+    entry->next.store(nullptr, std::memory_order_relaxed);
+    MpscQueueEntry* previous =
+        tail_.exchange(entry, std::memory_order_acq_rel);
+    previous->next.store(entry, std::memory_order_release);
+  }
+
+  static MpscQueueEntry* WaitForNext(MpscQueueEntry* entry, bool wait) {
+    MpscQueueEntry* next = entry->next.load(std::memory_order_acquire);
+    while (next == nullptr && wait) {
+      std::this_thread::yield();
+      next = entry->next.load(std::memory_order_acquire);
+    }
+
+    return next;
+  }
+
+  MpscQueueEntry* head_;
+  MpscQueueEntry stub_;
+  std::atomic<MpscQueueEntry*> tail_;
+  std::atomic<size_t> size_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(MpscQueue);
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_MPSC_QUEUE_H_
@@ -0,0 +1,71 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_MUTEX_H_
+#define MADOKA_CONCURRENT_MUTEX_H_
+
+#include <stdint.h>
+
+#include <madoka/common.h>
+#include <madoka/concurrent/lockable.h>
+
+#ifndef _WIN32
+#include <atomic>
+#endif  // _WIN32
+
+namespace madoka {
+namespace concurrent {
+
+class LockStats;
+
+// A non-recursive exclusive lock that lives entirely inside the object. On
+// Windows it is a slim reader/writer lock; elsewhere it is a futex word that
+// a contended thread polls for up to |spin_count| iterations before parking.
+// The polling adapts to how long the lock has recently been held, so a lock
+// that is always released quickly is acquired without a system call while
+// one that is held for long is not spun on in vain.
+//
+// Locking a Mutex already owned by the calling thread deadlocks; use
+// CriticalSection where recursion is needed.
+class Mutex : public Lockable {
+ public:
+  Mutex();
+  explicit Mutex(uint32_t spin_count);
+  virtual ~Mutex();
+
+  void Lock() MADOKA_OVERRIDE;
+  bool TryLock();
+  void Unlock() MADOKA_OVERRIDE;
+
+  // Collects the statistics of this lock under |name| when built with
+  // MADOKA_LOCK_STATS; see LockStats.
+#ifdef MADOKA_LOCK_STATS
+  void SetName(const char* name);
+#else   // MADOKA_LOCK_STATS
+  void SetName(const char* /*name*/) {}
+#endif  // MADOKA_LOCK_STATS
+
+ private:
+  friend class ConditionVariable;
+
+#ifdef _WIN32
+  void* lock_;
+#else   // _WIN32
+  void LockSlow();
+
+  std::atomic<uint32_t> state_;
+  std::atomic<uint32_t> spins_;
+  const uint32_t spin_count_;
+#endif  // _WIN32
+
+#ifdef MADOKA_LOCK_STATS
+  LockStats* stats_ = nullptr;
+  uint64_t acquired_at_ = 0;
+#endif  // MADOKA_LOCK_STATS
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(Mutex);
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_MUTEX_H_
@@ -3,17 +3,56 @@
 #ifndef MADOKA_CONCURRENT_READ_WRITE_LOCK_H_
 #define MADOKA_CONCURRENT_READ_WRITE_LOCK_H_
 
+#include <stdint.h>
+
 #include <madoka/common.h>
 #include <madoka/concurrent/lockable.h>
 
+#ifndef _WIN32
+#include <madoka/concurrent/mutex.h>
+
+#include <atomic>
+#endif  // _WIN32
+
 namespace madoka {
 namespace concurrent {
 
+class LockStats;
 struct LockImpl;
 
 class ReadWriteLock : public Lockable {
  public:
+  // Decides who goes first when readers and writers are both waiting.
+  enum Policy {
+    // Readers enter whenever no writer holds the lock; a steady stream of
+    // them can starve writers. This is what the lock has always done.
+    PreferReaders,
+
+    // Readers queue behind any waiting writer; writers can starve readers.
+    PreferWriters,
+
+    // Reader and writer phases alternate: readers that arrive while a writer
+    // waits or holds the lock all enter together when it leaves, and the
+    // next writer enters as soon as they have left. Both sides wait for at
+    // most one phase of the other.
+    PhaseFair,
+  };
+
   ReadWriteLock();
+
+  // A reader-biased lock lets readers announce themselves in a slot owned by
+  // their thread instead of updating the shared lock word, so uncontended
+  // read acquisitions do not bounce a cache line between cores. The first
+  // writer to arrive turns the bias off and waits for those readers to
+  // leave; the bias stays off for a multiple of that wait before readers
+  // restore it, which bounds the cost for locks that are written often.
+  // Suits data that is read far more often than it is written. Only
+  // implemented on POSIX; on Windows |reader_biased| is ignored.
+  explicit ReadWriteLock(bool reader_biased);
+
+  // Only implemented on POSIX; slim reader/writer locks on Windows already
+  // queue readers behind waiting writers, and |policy| is ignored there.
+  explicit ReadWriteLock(Policy policy, bool reader_biased = false);
   ~ReadWriteLock();
 
   void AcquireReadLock();
@@ -32,10 +71,84 @@ class ReadWriteLock : public Lockable {
   bool TryAcquireWriteLock();
   void ReleaseWriteLock();
 
+  // The upgrade lock is a read lock that can later be turned into the write
+  // lock without any other writer getting in between, for code that only
+  // sometimes has to modify what it reads. One thread at a time holds it,
+  // alongside any number of readers. It is released with ReleaseUpgradeLock,
+  // or with ReleaseWriteLock once upgraded.
+  void AcquireUpgradeLock();
+  bool TryAcquireUpgradeLock();
+  void ReleaseUpgradeLock();
+
+  // Waits for the readers to leave and turns the upgrade lock into the write
+  // lock. New readers queue behind a pending upgrade whatever the policy, as
+  // it already keeps every writer out. Deadlocks if the calling thread also
+  // holds a read lock.
+  void UpgradeToWriteLock();
+
+  // Turns the write lock into a read lock without letting any writer in.
+  void DowngradeToReadLock();
+
+  // Collects the statistics of this lock under |name| when built with
+  // MADOKA_LOCK_STATS; see LockStats.
+#ifdef MADOKA_LOCK_STATS
+  void SetName(const char* name);
+#else   // MADOKA_LOCK_STATS
+  void SetName(const char* /*name*/) {}
+#endif  // MADOKA_LOCK_STATS
+
  private:
   friend class ConditionVariable;
 
+#ifdef _WIN32
   LockImpl* lock_;
+#else   // _WIN32
+  bool MayEnterShared(uint32_t state) const;
+  bool MayEnterUpgrade(uint32_t state) const;
+  bool HasWaiters() const;
+
+  bool TryAcquireShared();
+  bool EnterShared();
+  void AcquireSharedSlow();
+  bool TryAcquireUpgrade();
+  bool EnterUpgrade();
+  void AcquireUpgradeSlow();
+  void UpgradeSlow();
+  void AcquireExclusiveSlow();
+  void ReleaseExclusive();
+  void WakeWaiters(bool writer_left);
+
+  bool TryAcquireBiased();
+  bool ReleaseBiased();
+  void RevokeBias();
+
+  // Reader count, whether a writer or the upgrader holds the lock, and
+  // whether any thread waits in the slow path; the fast paths only ever touch
+  // this word.
+  std::atomic<uint32_t> state_;
+
+  // Guards the waiting counts and serializes the slow paths.
+  Mutex wait_lock_;
+  uint32_t waiting_readers_;
+  uint32_t waiting_writers_;
+  uint32_t waiting_upgraders_;
+  bool upgrade_pending_;
+
+  // Futex words the waiting readers, writers and upgraders sleep on.
+  std::atomic<uint32_t> reader_sequence_;
+  std::atomic<uint32_t> writer_sequence_;
+  std::atomic<uint32_t> upgrade_sequence_;
+
+  const Policy policy_;
+  const bool reader_biased_;
+  std::atomic<bool> biased_;
+  std::atomic<uint64_t> inhibit_until_;
+#endif  // _WIN32
+
+#ifdef MADOKA_LOCK_STATS
+  LockStats* stats_ = nullptr;
+  uint64_t acquired_at_ = 0;
+#endif  // MADOKA_LOCK_STATS
 
   MADOKA_DISALLOW_COPY_AND_ASSIGN(ReadWriteLock);
 };
@@ -76,6 +189,24 @@ class WriteLock : public Lockable {
   MADOKA_DISALLOW_COPY_AND_ASSIGN(WriteLock);
 };
 
+class UpgradeLock : public Lockable {
+ public:
+  explicit UpgradeLock(ReadWriteLock* lock) : lock_(lock) {}
+
+  void Lock() MADOKA_OVERRIDE {
+    lock_->AcquireUpgradeLock();
+  }
+
+  void Unlock() MADOKA_OVERRIDE {
+    lock_->ReleaseUpgradeLock();
+  }
+
+ private:
+  ReadWriteLock* const lock_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(UpgradeLock);
+};
+
 }  // namespace concurrent
 }  // namespace madoka
 
@@ -0,0 +1,131 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_SEQ_LOCK_H_
+#define MADOKA_CONCURRENT_SEQ_LOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <madoka/common.h>
+#include <madoka/concurrent/lock_guard.h>
+#include <madoka/concurrent/mutex.h>
+
+#include <atomic>
+#include <thread>
+#include <type_traits>
+
+namespace madoka {
+namespace concurrent {
+
+// Holds a small value that is read far more often than it is written.
+// Readers take a copy without locking and without storing to shared memory,
+// so they never contend with each other; if a write overlapped the copy they
+// simply take it again. Writers are serialized by a Mutex and never wait for
+// readers, so a steady stream of writes can keep a reader retrying.
+//
+// The value is copied word by word with atomic accesses, which makes a torn
+// copy harmless until it is discarded; on x86 they are plain moves. T must
+// therefore be trivially copyable, and should be small: every read copies all
+// of it.
+template<class T>
+class SeqLock {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "SeqLock requires a trivially copyable type");
+
+ public:
+  SeqLock() : sequence_(0) {
+    Write(T());
+  }
+
+  explicit SeqLock(const T& value) : sequence_(0) {
+    Write(value);
+  }
+
+  // Returns a consistent copy of the value.
+  T Load() const {
+    Words copy;
+
+    for (;;) {
+      uint32_t sequence = sequence_.load(std::memory_order_acquire);
+      if ((sequence & 1) != 0) {
+        // The writer may have been preempted; let it finish.
+        std::this_thread::yield();
+        continue;
+      }
+
+      copy = Copy();
+      if (sequence_.load(std::memory_order_relaxed) == sequence)
+        break;
+    }
+
+    T value;
+    memcpy(&value, copy.words, sizeof(value));
+    return value;
+  }
+
+  void Store(const T& value) {
+    LockGuard guard(&write_lock_);
+    Write(value);
+  }
+
+  // Calls |update| with a pointer to a copy of the current value and stores
+  // the result, with other writers held off in between.
+  template<class Function>
+  void Update(Function update) {
+    LockGuard guard(&write_lock_);
+
+    // Writers see each other's stores without retrying.
+    T value;
+    memcpy(&value, Copy().words, sizeof(value));
+    update(&value);
+    Write(value);
+  }
+
+ private:
+  typedef uintptr_t Word;
+
+  static const size_t kWordCount =
+      (sizeof(T) + sizeof(Word) - 1) / sizeof(Word);
+
+  struct Words {
+    Word words[kWordCount];
+  };
+
+  // Acquiring each word keeps the sequence from being checked again before
+  // the copy is complete, and a word stored by a later write makes that
+  // check see the write.
+  Words Copy() const {
+    Words copy;
+    for (size_t i = 0; i < kWordCount; ++i)
+      copy.words[i] = words_[i].load(std::memory_order_acquire);
+
+    return copy;
+  }
+
+  // An odd sequence tells readers a write is in progress. Each word is
+  // released, so a reader that sees it also sees the odd sequence.
+  void Write(const T& value) {
+    Words copy = Words();
+    memcpy(copy.words, &value, sizeof(value));
+
+    uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+
+    for (size_t i = 0; i < kWordCount; ++i)
+      words_[i].store(copy.words[i], std::memory_order_release);
+
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  std::atomic<uint32_t> sequence_;
+  std::atomic<Word> words_[kWordCount];
+  Mutex write_lock_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(SeqLock);
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_SEQ_LOCK_H_
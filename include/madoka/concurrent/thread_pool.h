@@ -0,0 +1,75 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_THREAD_POOL_H_
+#define MADOKA_CONCURRENT_THREAD_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <madoka/common.h>
+#include <madoka/concurrent/mpsc_queue.h>
+
+#include <atomic>
+#include <vector>
+
+namespace madoka {
+namespace concurrent {
+
+struct ThreadPoolWorker;
+
+// A fixed set of worker threads without a queue shared by all of them. Each
+// worker owns a deque: tasks it submits itself go to the bottom and it takes
+// them back from there, newest first while they are still in its cache, and
+// idle workers steal the oldest task from the top. Tasks submitted from other
+// threads are dealt out to the workers in turn through per-worker inboxes,
+// which idle workers steal from as well. A worker that finds nothing parks
+// until a submission wakes it.
+//
+// Tasks are intrusive and not owned by the pool. A task must not be submitted
+// again before it has started running.
+class ThreadPool {
+ public:
+  struct Task : MpscQueueEntry {
+    void (*run)(Task* task);
+  };
+
+  explicit ThreadPool(int threads);
+
+  // Runs the tasks still queued, then stops the workers. Must not be called
+  // from one of them.
+  ~ThreadPool();
+
+  // The pool used where no other one is given, with a worker per core but at
+  // least two. Never destroyed.
+  static ThreadPool* GetDefault();
+
+  void Submit(Task* task);
+
+  int GetThreadCount() const {
+    return static_cast<int>(workers_.size());
+  }
+
+  // Returns the number of tasks waiting for each worker, including the ones
+  // others may steal.
+  std::vector<size_t> GetQueueDepths() const;
+
+ private:
+  void Run(ThreadPoolWorker* self);
+  Task* FindTask(ThreadPoolWorker* self);
+  bool HasTasks() const;
+  void Park(ThreadPoolWorker* self);
+  void WakeOne(ThreadPoolWorker* preferred);
+  void Notify(ThreadPoolWorker* worker);
+
+  std::vector<ThreadPoolWorker*> workers_;
+  std::atomic<uint32_t> next_;
+  std::atomic<int> sleepers_;
+  std::atomic<bool> stopping_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_THREAD_POOL_H_
@@ -0,0 +1,109 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_CONCURRENT_TIMER_WHEEL_H_
+#define MADOKA_CONCURRENT_TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+#include <madoka/common.h>
+#include <madoka/concurrent/condition_variable.h>
+#include <madoka/concurrent/mutex.h>
+
+#include <chrono>
+#include <thread>
+
+namespace madoka {
+namespace concurrent {
+
+// A hierarchical timing wheel driven by a thread of its own. Timers are
+// intrusive, so arming and cancelling one never allocates, and both take
+// constant time however many timers are armed: a timer is hashed into a slot
+// of the first of four wheels of 256 slots each whose range covers it, and
+// moves down a wheel each time the one below wraps around. The thread sleeps
+// until the next occupied slot of the lowest wheel, or until that wheel
+// wraps, rather than waking on every tick.
+//
+// Callbacks run on the thread of the wheel one after another and should only
+// hand the expiry over to whoever owns the timer.
+class TimerWheel {
+ public:
+  typedef ConditionVariable::Clock Clock;
+
+  // Embedded in the object to time out and owned by it.
+  struct Timer {
+    Timer() : callback(nullptr), next_(nullptr), link_(nullptr), expiry_(0),
+              slot_(0) {
+    }
+
+    void (*callback)(Timer* timer);
+
+   private:
+    friend class TimerWheel;
+
+    Timer* next_;
+    Timer** link_;
+    uint64_t expiry_;
+    uint32_t slot_;
+  };
+
+  // Timeouts are rounded up to a multiple of |resolution|. Timeouts longer
+  // than 2^32 ticks are cut to that.
+  explicit TimerWheel(Clock::duration resolution);
+
+  // Timers still armed never fire.
+  ~TimerWheel();
+
+  // A wheel with millisecond ticks. Never destroyed.
+  static TimerWheel* GetDefault();
+
+  // Calls the callback of |timer| once |timeout| has passed. |timer| must not
+  // be armed already, but may be from its own callback.
+  void Start(Timer* timer, Clock::duration timeout);
+
+  // Disarms |timer|, and returns whether it was still armed. Once this
+  // returns the callback is not running and will not run, unless this is
+  // called from the callback itself.
+  bool Cancel(Timer* timer);
+
+ private:
+  static const int kLevels = 4;
+  static const int kSlotBits = 8;
+  static const uint32_t kSlots = 1U << kSlotBits;
+  static const uint32_t kSlotMask = kSlots - 1;
+
+  uint64_t GetTick(const Clock::time_point& time) const;
+  void Insert(Timer* timer);
+  void Link(Timer* timer, Timer** head);
+  void Unlink(Timer* timer);
+  void Cascade(int level);
+  void Tick();
+  uint64_t GetNextTick() const;
+  void Run();
+
+  const Clock::duration resolution_;
+  const Clock::time_point origin_;
+
+  Mutex lock_;
+  ConditionVariable changed_;
+  ConditionVariable idle_;
+  bool stopping_;
+
+  // The last tick processed, and the one the thread sleeps until.
+  uint64_t current_;
+  uint64_t wake_;
+  uint32_t count_;
+
+  Timer* slots_[kLevels][kSlots];
+  uint64_t occupied_[kSlots / 64];
+  Timer* expired_;
+  Timer* running_;
+
+  std::thread thread_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // MADOKA_CONCURRENT_TIMER_WHEEL_H_
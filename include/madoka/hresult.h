@@ -0,0 +1,45 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_HRESULT_H_
+#define MADOKA_HRESULT_H_
+
+#ifdef _WIN32
+
+#include <winerror.h>
+
+#else   // _WIN32
+
+#include <errno.h>
+#include <stdint.h>
+
+typedef int32_t HRESULT;
+
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)    (((HRESULT)(hr)) < 0)
+
+#define HRESULT_CODE(hr)      ((hr) & 0xFFFF)
+#define HRESULT_FACILITY(hr)  (((hr) >> 16) & 0x1FFF)
+
+// errno values are carried the same way Win32 error codes are on Windows.
+#define FACILITY_ERRNO 7
+
+#define HRESULT_FROM_ERRNO(error)                                      \
+  ((HRESULT)(error) <= 0 ? (HRESULT)(error) :                          \
+   (HRESULT)((((uint32_t)(error)) & 0x0000FFFF) |                      \
+             (FACILITY_ERRNO << 16) | 0x80000000))
+
+#define S_OK                  ((HRESULT)0x00000000L)
+#define S_FALSE               ((HRESULT)0x00000001L)
+#define E_NOTIMPL             ((HRESULT)0x80004001L)
+#define E_POINTER             ((HRESULT)0x80004003L)
+#define E_ABORT               ((HRESULT)0x80004004L)
+#define E_FAIL                ((HRESULT)0x80004005L)
+#define E_PENDING             ((HRESULT)0x8000000AL)
+#define E_ILLEGAL_METHOD_CALL ((HRESULT)0x8000000EL)
+#define E_HANDLE              ((HRESULT)0x80070006L)
+#define E_OUTOFMEMORY         ((HRESULT)0x8007000EL)
+#define E_INVALIDARG          ((HRESULT)0x80070057L)
+
+#endif  // _WIN32
+
+#endif  // MADOKA_HRESULT_H_
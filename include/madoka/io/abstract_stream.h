@@ -3,48 +3,140 @@
 #ifndef MADOKA_IO_ABSTRACT_STREAM_H_
 #define MADOKA_IO_ABSTRACT_STREAM_H_
 
+#ifdef _WIN32
 #include <windows.h>
+#endif  // _WIN32
+
+#include <stddef.h>
 
 #include <madoka/common.h>
 #include <madoka/concurrent/condition_variable.h>
 #include <madoka/concurrent/critical_section.h>
+#include <madoka/concurrent/executor.h>
+#include <madoka/concurrent/mpsc_queue.h>
+#include <madoka/concurrent/timer_wheel.h>
+#include <madoka/io/operation.h>
 #include <madoka/io/stream.h>
 
-#include <list>
+#include <chrono>
 #include <memory>
 
 namespace madoka {
 namespace io {
 
+#ifndef _WIN32
+class CompletionPort;
+struct CompletionPacket;
+#endif  // _WIN32
+
 class AbstractStream : public Stream {
  public:
+  // Room for the context of one request, for callers that keep it with them,
+  // such as in the frame of a coroutine, rather than have the stream allocate
+  // one. It must stay put until the listener of the request is called; the
+  // stream lets go of it before then.
+  struct ContextStorage {
+    alignas(max_align_t) unsigned char data[512];
+  };
+
   virtual ~AbstractStream();
 
+  // Cancel every pending read, or every pending write, leaving the stream
+  // open, and return how many there were. Those with a listener complete
+  // with kOperationCancelled.
+  size_t CancelReads();
+  size_t CancelWrites();
+
  protected:
-  enum GeneralRequest;
+  enum GeneralRequest : int;
   struct AsyncContext;
 
   AbstractStream();
+  explicit AbstractStream(madoka::concurrent::Executor executor);
 
   virtual void Reset();
 
   template<class T>
   std::unique_ptr<T> CreateContext(int type, void* buffer, uint64_t length,
                                    Listener* listener);
+  // Constructs the context in |storage| unless it is null. Such a context is
+  // never deleted, so it must be dispatched or released.
+  template<class T>
+  std::unique_ptr<T> CreateContext(int type, void* buffer, uint64_t length,
+                                   Listener* listener,
+                                   ContextStorage* storage);
 
   HRESULT DispatchRequest(std::unique_ptr<AsyncContext>&& context);  // NOLINT
+  // Like the above, but cancels the request once |timeout| has passed, which
+  // then completes with a timeout error instead of kOperationCancelled.
+  HRESULT DispatchRequest(std::unique_ptr<AsyncContext>&& context,  // NOLINT
+                          std::chrono::milliseconds timeout);
+  // Frees |context|, unless it lives in a ContextStorage.
   void EndRequest(AsyncContext* context);
+  // Ends |context| before its listener is called, so that the listener may
+  // reuse the storage of the context. Reset still waits for the listener,
+  // which is over once EndCallback is called.
+  void EndRequestBeforeCallback(AsyncContext* context);
+  void EndCallback();
   bool IsValidRequest(AsyncContext* context);
-
+  // Stops |context| alone, as CancelReads does with every read. Returns false
+  // if it is not a request of the stream, or was cancelled already.
+  bool Cancel(AsyncContext* context);
+
+  // Whether requests of |type| count as reads or writes to cancel.
+  virtual bool IsRead(int type) const;
+  virtual bool IsWrite(int type) const;
+  // Called with |lock_| held to stop |context| if it has been started.
+  // Subclasses start reads and writes with |lock_| held, after checking
+  // whether the request has been cancelled already.
+  virtual void CancelRequest(AsyncContext* context);
+
+  // Marks a request started with Begin* as done and wakes up the thread
+  // waiting for it in End*, without a kernel event.
+  void SetCompleted(AsyncContext* context);
+  void WaitForCompletion(AsyncContext* context);
+
+#ifndef _WIN32
+  // Asks the completion port to cancel every request still in flight.
+  void CancelRequests();
+  // Calls |notify| with |context| on the executor of the stream.
+  void Notify(AsyncContext* context, void (*notify)(AsyncContext* context));
+
+  CompletionPort* const port_;
+#endif  // _WIN32
+
+  // Runs the callbacks of the stream. Without one they run on the default
+  // Win32 thread pool, or on ThreadPool::GetDefault(); never on the thread
+  // reaping the completion port, which End* may have to wait for.
+  madoka::concurrent::Executor const executor_;
   madoka::concurrent::CriticalSection lock_;
 
  private:
+#ifdef _WIN32
   static void CALLBACK OnRequested(PTP_CALLBACK_INSTANCE callback,
                                    void* request);
+#else   // _WIN32
+  static void OnNotified(madoka::concurrent::ThreadPool::Task* task);
+#endif  // _WIN32
   virtual void OnRequested(AsyncContext* context) = 0;
 
-  std::list<std::unique_ptr<AsyncContext>> requests_;
+  static void OnTimedOut(madoka::concurrent::TimerWheel::Timer* timer);
+  void OnTimedOut(AsyncContext* context);
+
+  size_t CancelAll(bool reads);
+  void Collect();
+  void EndRequest(AsyncContext* context, bool callback);
+
+  // Requests are queued here without locking and moved to |requests_| by
+  // whoever holds |lock_| next.
+  madoka::concurrent::MpscQueue<AsyncContext> dispatched_;
+  AsyncContext* requests_;
+  // Listeners still running for requests ended by EndRequestBeforeCallback.
+  int callbacks_;
   madoka::concurrent::ConditionVariable empty_;
+#ifdef _WIN32
+  madoka::concurrent::ConditionVariable completed_;
+#endif  // _WIN32
 
   MADOKA_DISALLOW_COPY_AND_ASSIGN(AbstractStream);
 };
@@ -0,0 +1,176 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_IO_AWAITABLE_H_
+#define MADOKA_IO_AWAITABLE_H_
+
+#ifndef __cpp_impl_coroutine
+#  error The awaitables require C++20 coroutines.
+#endif  // __cpp_impl_coroutine
+
+#include <madoka/common.h>
+#include <madoka/io/stream.h>
+
+#ifdef _WIN32
+#include <madoka/io/pipe_stream.h>
+#endif  // _WIN32
+
+#include <coroutine>
+
+namespace madoka {
+namespace io {
+
+// The part common to the awaiters of madoka. An awaiter is the listener of
+// the operation it starts, so it lives in the frame of the awaiting coroutine
+// and no listener object of its own is needed. Where the stream takes a
+// ContextStorage, the awaiter holds the context of the operation as well, so
+// that the frame doubles as it and nothing is allocated. The coroutine is
+// resumed on the thread that runs the completion callback, before the
+// callback returns; what it may do there is what the callback may do.
+class BasicAwaiter {
+ public:
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  HRESULT await_resume() const noexcept {
+    return result_;
+  }
+
+ protected:
+  BasicAwaiter() : result_(E_PENDING) {}
+
+  // The awaiter may be gone once this returns.
+  void Resume(HRESULT result) {
+    result_ = result;
+    handle_.resume();
+  }
+
+  std::coroutine_handle<> handle_;
+  HRESULT result_;
+
+ private:
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(BasicAwaiter);
+};
+
+class StreamAwaiter : public BasicAwaiter, public Stream::Listener {
+ public:
+  enum Request { Read, Write };
+
+  StreamAwaiter(Request request, Stream* stream, void* buffer,
+                uint64_t* length)
+      : request_(request), stream_(stream), buffer_(buffer), length_(length) {
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+
+    if (request_ == Read)
+      stream_->ReadAsync(buffer_, *length_, this);
+    else
+      stream_->WriteAsync(buffer_, *length_, this);
+  }
+
+ private:
+  void OnRead(Stream* /*stream*/, HRESULT result, void* /*buffer*/,
+              uint64_t length) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  void OnWritten(Stream* /*stream*/, HRESULT result, void* /*buffer*/,
+                 uint64_t length) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  const Request request_;
+  Stream* const stream_;
+  void* const buffer_;
+  uint64_t* const length_;
+};
+
+// Like Stream::Read and Stream::Write, |length| gives the size of |buffer|
+// and receives how much has been transferred.
+inline StreamAwaiter AwaitRead(Stream* stream, void* buffer,
+                               uint64_t* length) {
+  return StreamAwaiter(StreamAwaiter::Read, stream, buffer, length);
+}
+
+inline StreamAwaiter AwaitWrite(Stream* stream, const void* buffer,
+                                uint64_t* length) {
+  return StreamAwaiter(StreamAwaiter::Write, stream,
+                       const_cast<void*>(buffer), length);
+}
+
+#ifdef _WIN32
+class PipeAwaiter : public BasicAwaiter, public PipeStream::Listener {
+ public:
+  enum Request { WaitForConnection, TransactData };
+
+  PipeAwaiter(Request request, PipeStream* stream, void* write_buffer,
+              DWORD write_length, void* read_buffer, DWORD* read_length)
+      : request_(request),
+        stream_(stream),
+        write_buffer_(write_buffer),
+        write_length_(write_length),
+        read_buffer_(read_buffer),
+        read_length_(read_length) {
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+
+    if (request_ == WaitForConnection)
+      stream_->WaitForConnectionAsync(this, &context_);
+    else
+      stream_->TransactDataAsync(write_buffer_, write_length_, read_buffer_,
+                                 *read_length_, this, &context_);
+  }
+
+ private:
+  void OnRead(Stream* /*stream*/, HRESULT /*result*/, void* /*buffer*/,
+              uint64_t /*length*/) override {
+  }
+
+  void OnWritten(Stream* /*stream*/, HRESULT /*result*/, void* /*buffer*/,
+                 uint64_t /*length*/) override {
+  }
+
+  void OnConnected(PipeStream* /*stream*/, HRESULT result) override {
+    Resume(result);
+  }
+
+  void OnTransacted(PipeStream* /*stream*/, HRESULT result,
+                    uint64_t length) override {
+    *read_length_ = static_cast<DWORD>(length);
+    Resume(result);
+  }
+
+  const Request request_;
+  PipeStream* const stream_;
+  void* const write_buffer_;
+  const DWORD write_length_;
+  void* const read_buffer_;
+  DWORD* const read_length_;
+  PipeStream::ContextStorage context_;
+};
+
+inline PipeAwaiter AwaitConnection(PipeStream* stream) {
+  return PipeAwaiter(PipeAwaiter::WaitForConnection, stream, nullptr, 0,
+                     nullptr, nullptr);
+}
+
+// |read_length| gives the size of |read_buffer| and receives the length of
+// the reply, like PipeStream::TransactData.
+inline PipeAwaiter AwaitTransact(PipeStream* stream, void* write_buffer,
+                                 DWORD write_length, void* read_buffer,
+                                 DWORD* read_length) {
+  return PipeAwaiter(PipeAwaiter::TransactData, stream, write_buffer,
+                     write_length, read_buffer, read_length);
+}
+#endif  // _WIN32
+
+}  // namespace io
+}  // namespace madoka
+
+#endif  // MADOKA_IO_AWAITABLE_H_
@@ -20,15 +20,24 @@ class HandleStream : public AbstractStream {
 
   HRESULT Read(void* buffer, uint64_t* length) override;
   void ReadAsync(void* buffer, uint64_t length, Listener* listener) override;
-  AsyncContext* BeginRead(void* buffer, DWORD length, HANDLE event);
+  // Without |event|, End* waits for the request by itself.
+  AsyncContext* BeginRead(void* buffer, DWORD length, HANDLE event = NULL);
   HRESULT EndRead(AsyncContext* context, DWORD* length);
 
   HRESULT Write(const void* buffer, uint64_t* length) override;
   void WriteAsync(const void* buffer, uint64_t length,
                   Listener* listener) override;
-  AsyncContext* BeginWrite(const void* buffer, DWORD length, HANDLE event);
+  AsyncContext* BeginWrite(const void* buffer, DWORD length,
+                           HANDLE event = NULL);
   HRESULT EndWrite(AsyncContext* context, DWORD* length);
 
+  // Cancels the request started by a Begin*, which then completes with
+  // kOperationCancelled, and leaves the stream and its other requests alone.
+  // Returns false once the request has completed; one that is just
+  // completing may still report its own result. |context| must not have been
+  // passed to End* yet.
+  bool Cancel(AsyncContext* context);
+
   bool IsValid() const {
     return handle_ != INVALID_HANDLE_VALUE;
   }
@@ -39,12 +48,14 @@ class HandleStream : public AbstractStream {
 
  protected:
   HandleStream();
+  explicit HandleStream(madoka::concurrent::Executor executor);
 
   void Reset() override;
 
   HRESULT EndRequest(AsyncContext* context, DWORD* length);
 
   void OnRequested(AbstractStream::AsyncContext* async_context) override;
+  void CancelRequest(AbstractStream::AsyncContext* async_context) override;
   virtual HRESULT OnCustomRequested(AsyncContext* context) = 0;
 
   virtual void OnCustomCompleted(AsyncContext* context, HRESULT result,
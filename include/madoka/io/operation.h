@@ -0,0 +1,37 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_IO_OPERATION_H_
+#define MADOKA_IO_OPERATION_H_
+
+#ifdef _WIN32
+#include <windows.h>
+#endif  // _WIN32
+
+#include <stdint.h>
+
+#include <madoka/hresult.h>
+
+namespace madoka {
+namespace io {
+
+// Identifies a pending asynchronous operation to cancel it by. A handle stays
+// unique within the object that started the operation; once the operation
+// has completed, cancelling it does nothing.
+typedef uint64_t Operation;
+
+// Returned for an operation that failed to start, whose listener has been
+// called already.
+const Operation kNoOperation = 0;
+
+// What cancelled operations complete with, as opposed to the result of
+// closing the object that started them or of a timeout.
+#ifdef _WIN32
+const HRESULT kOperationCancelled = __HRESULT_FROM_WIN32(ERROR_CANCELLED);
+#else   // _WIN32
+const HRESULT kOperationCancelled = HRESULT_FROM_ERRNO(ECANCELED);
+#endif  // _WIN32
+
+}  // namespace io
+}  // namespace madoka
+
+#endif  // MADOKA_IO_OPERATION_H_
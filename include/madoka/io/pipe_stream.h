@@ -24,6 +24,8 @@ class PipeStream : public HandleStream {
   };
 
   PipeStream();
+  // Runs the callbacks of the stream on |executor|.
+  explicit PipeStream(madoka::concurrent::Executor executor);
   virtual ~PipeStream();
 
   void Close() override;
@@ -42,10 +44,16 @@ class PipeStream : public HandleStream {
   }
 
   void WaitForConnectionAsync(Listener* listener);
-  AsyncContext* BeginWaitForConnection(HANDLE event);
+  // Like the above, but gives up once |timeout| has passed without a client,
+  // completing with a timeout error.
+  void WaitForConnectionAsync(Listener* listener,
+                              std::chrono::milliseconds timeout);
+  // Like the above, but the context of the request is made in |storage|
+  // instead of being allocated.
+  void WaitForConnectionAsync(Listener* listener, ContextStorage* storage);
+  // Without |event|, EndWaitForConnection waits for the request by itself.
+  AsyncContext* BeginWaitForConnection(HANDLE event = NULL);
   HRESULT EndWaitForConnection(AsyncContext* context);
-  // It's an inefficient pseudo synchronous function.
-  // It creates an event object each time it is called.
   HRESULT WaitForConnection();
 
   HRESULT Disconnect();
@@ -92,16 +100,28 @@ class PipeStream : public HandleStream {
   void TransactDataAsync(void* write_buffer, DWORD write_length,
                          void* read_buffer, DWORD read_length,
                          Listener* listener);
+  void TransactDataAsync(void* write_buffer, DWORD write_length,
+                         void* read_buffer, DWORD read_length,
+                         Listener* listener, ContextStorage* storage);
   AsyncContext* BeginTransactData(void* write_buffer, DWORD write_length,
                                   void* read_buffer, DWORD read_length,
-                                  HANDLE event);
+                                  HANDLE event = NULL);
   HRESULT EndTransactData(AsyncContext* context, DWORD* read_length);
-  // It's an inefficient pseudo synchronous function.
-  // It creates an event object each time it is called.
   HRESULT TransactData(void* write_buffer, DWORD write_length,
                        void* read_buffer, DWORD* read_length);
 
+  // Like HandleStream::Cancel, for the requests above.
+  bool Cancel(AsyncContext* context);
+
+  bool Cancel(HandleStream::AsyncContext* context) {
+    return HandleStream::Cancel(context);
+  }
+
  private:
+  void WaitForConnectionAsync(Listener* listener,
+                              std::chrono::milliseconds timeout,
+                              ContextStorage* storage);
+
   HRESULT OnCustomRequested(
       HandleStream::AsyncContext* handle_context) override;
   void OnCustomCompleted(HandleStream::AsyncContext* async_context,
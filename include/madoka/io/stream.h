@@ -5,7 +5,7 @@
 
 #include <stdint.h>
 
-#include <winerror.h>  // for HRESULT
+#include <madoka/hresult.h>
 
 namespace madoka {
 namespace io {
@@ -65,12 +65,12 @@ class AbstractSocket {
 
   bool GetLocalEndPoint(void* address, int* length) {
     return getsockname(descriptor_, static_cast<sockaddr*>(address),
-                       length) == 0;
+                       reinterpret_cast<socklen_t*>(length)) == 0;
   }
 
   bool GetOption(int level, int option, void* value, int* length) {
     return getsockopt(descriptor_, level, option, static_cast<char*>(value),
-                      length) == 0;
+                      reinterpret_cast<socklen_t*>(length)) == 0;
   }
 
   template<typename T>
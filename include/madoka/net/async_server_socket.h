@@ -5,23 +5,37 @@
 
 #include <madoka/net/common.h>
 
-#ifndef _WIN32
-#  error The AsyncSocket supports Windows platforms only.
-#endif  // _WIN32
-
-#if _WIN32_WINNT < 0x0600
+#if defined(_WIN32) && _WIN32_WINNT < 0x0600
 #  error The AsyncSocket requires the thread pool API.
-#endif  // _WIN32_WINNT < 0x0600
+#endif  // defined(_WIN32) && _WIN32_WINNT < 0x0600
 
 #include <madoka/concurrent/critical_section.h>
+#include <madoka/concurrent/executor.h>
+#include <madoka/concurrent/mpsc_queue.h>
+#include <madoka/concurrent/timer_wheel.h>
+#include <madoka/io/operation.h>
 #include <madoka/net/server_socket.h>
 
+#include <chrono>
 #include <list>
 #include <memory>
+#include <utility>
 
 namespace madoka {
+
+namespace io {
+template<class T>
+class OperationTable;
+}  // namespace io
+
 namespace net {
 
+#ifndef _WIN32
+class Reactor;
+struct ReactorIo;
+struct ReactorWork;
+#endif  // _WIN32
+
 class AsyncServerSocket final : public ServerSocket {
  public:
   struct Context;
@@ -37,23 +51,58 @@ class AsyncServerSocket final : public ServerSocket {
   AsyncServerSocket();
   AsyncServerSocket(int family, int type, int protocol);
 
+  // Runs the callbacks of the socket on |executor| instead of the default
+  // set with SetCallbackEnvironment or SetThreadPool.
+  explicit AsyncServerSocket(madoka::concurrent::Executor executor);
+  AsyncServerSocket(int family, int type, int protocol,
+                    madoka::concurrent::Executor executor);
+
   ~AsyncServerSocket();
 
   void Close() override;
 
+  // Returns a handle to cancel the accept with, or kNoOperation if it failed
+  // to start.
+  madoka::io::Operation AcceptAsync(Listener* listener);
+
+  // Like the above, but gives up if no connection arrives within |timeout|
+  // and completes with a timeout error.
+  madoka::io::Operation AcceptAsync(Listener* listener,
+                                    std::chrono::milliseconds timeout);
+
+  // Cancels a pending accept, which completes with kOperationCancelled while
+  // the socket keeps listening. Returns false if it has completed already;
+  // one that is just completing may still report its own result.
+  bool Cancel(madoka::io::Operation operation);
+
+  // Cancels every pending accept and returns how many there were.
+  size_t CancelAccepts();
+
+#ifdef _WIN32
   static PTP_CALLBACK_ENVIRON GetCallbackEnvironment();
   static void SetCallbackEnvironment(PTP_CALLBACK_ENVIRON environment);
+#else   // _WIN32
+  // The pool that runs the callbacks of sockets created from now on without
+  // an executor of their own; nullptr selects ThreadPool::GetDefault().
+  static madoka::concurrent::ThreadPool* GetThreadPool();
+  static void SetThreadPool(madoka::concurrent::ThreadPool* pool);
+#endif  // _WIN32
 
-  void AcceptAsync(Listener* listener);
+#ifdef _WIN32
   Context* BeginAccept(HANDLE event);
+#endif  // _WIN32
 
-  template<class Impl>
-  std::unique_ptr<Impl> EndAccept(Context* context, HRESULT* result) {
+  // Any further arguments are passed on to the constructor of Impl, such as
+  // the executor an accepted AsyncSocket or SocketStream is to be bound to.
+  template<class Impl, class... Args>
+  std::unique_ptr<Impl> EndAccept(Context* context, HRESULT* result,
+                                  Args&&... args) {
     struct Wrapper : Impl {
-      explicit Wrapper(SOCKET descriptor) {
-        descriptor_ = descriptor;
-        bound_ = true;
-        connected_ = true;
+      explicit Wrapper(SOCKET descriptor, Args&&... args)
+          : Impl(std::forward<Args>(args)...) {
+        this->descriptor_ = descriptor;
+        this->bound_ = true;
+        this->connected_ = true;
       }
     };
 
@@ -64,16 +113,25 @@ class AsyncServerSocket final : public ServerSocket {
     if (descriptor == INVALID_SOCKET)
       return nullptr;
 
-    auto accepted = std::make_unique<Wrapper>(descriptor);
+    auto accepted =
+        std::make_unique<Wrapper>(descriptor, std::forward<Args>(args)...);
     if (accepted == nullptr)
       closesocket(descriptor);
 
-    return std::move(accepted);
+    return accepted;
   }
 
  private:
   SOCKET RawEndAccept(Context* pointer, HRESULT* result);
 
+  static void OnTimedOut(madoka::concurrent::TimerWheel::Timer* timer);
+  void OnTimedOut(Context* context);
+
+  void Abort(Context* context, HRESULT result);
+
+  std::unique_ptr<madoka::io::OperationTable<Context>> operations_;
+
+#ifdef _WIN32
   static void CALLBACK OnRequested(PTP_CALLBACK_INSTANCE callback,
                                    void* instance, PTP_WORK work);
   void OnRequested(PTP_WORK work);
@@ -83,13 +141,34 @@ class AsyncServerSocket final : public ServerSocket {
                                    ULONG error, ULONG_PTR length, PTP_IO io);
   void OnCompleted(std::unique_ptr<Context>&& context, HRESULT result);
 
-  static PTP_CALLBACK_ENVIRON environment_;
+  static PTP_CALLBACK_ENVIRON default_environment_;
 
+  PTP_CALLBACK_ENVIRON const environment_;
   madoka::concurrent::CriticalSection lock_;
   PTP_WORK work_;
-  std::list<std::unique_ptr<Context>> requests_;
+  madoka::concurrent::MpscQueue<Context> requests_;
   WSAPROTOCOL_INFO protocol_;
   PTP_IO io_;
+#else   // _WIN32
+  static void OnRequested(void* instance, ReactorWork* work);
+  void OnRequested(ReactorWork* work);
+
+  static void OnReady(void* instance, uint32_t events);
+  void OnReady(uint32_t events);
+
+  bool Attach();
+  HRESULT Perform(Context* context);
+  void OnCompleted(std::unique_ptr<Context>&& context, HRESULT result);
+
+  static madoka::concurrent::ThreadPool* default_pool_;
+
+  Reactor* const reactor_;
+  madoka::concurrent::CriticalSection lock_;
+  ReactorWork* work_;
+  madoka::concurrent::MpscQueue<Context> requests_;
+  std::list<std::unique_ptr<Context>> accepts_;
+  ReactorIo* io_;
+#endif  // _WIN32
 
   MADOKA_DISALLOW_COPY_AND_ASSIGN(AsyncServerSocket);
 };
@@ -5,27 +5,65 @@
 
 #include <madoka/net/common.h>
 
-#ifndef _WIN32
-#  error The AsyncSocket supports Windows platforms only.
-#endif  // _WIN32
-
-#if _WIN32_WINNT < 0x0600
+#if defined(_WIN32) && _WIN32_WINNT < 0x0600
 #  error The AsyncSocket requires the thread pool API.
-#endif  // _WIN32_WINNT < 0x0600
+#endif  // defined(_WIN32) && _WIN32_WINNT < 0x0600
 
 #include <madoka/concurrent/critical_section.h>
+#include <madoka/concurrent/executor.h>
+#include <madoka/concurrent/mpsc_queue.h>
+#include <madoka/concurrent/timer_wheel.h>
+#include <madoka/io/operation.h>
 #include <madoka/net/socket.h>
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif  // _WIN32
+
+#include <chrono>
 #include <list>
 #include <memory>
 
 namespace madoka {
+
+namespace io {
+template<class T>
+class OperationTable;
+}  // namespace io
+
 namespace net {
 
+#ifndef _WIN32
+class Reactor;
+struct ReactorIo;
+struct ReactorWork;
+#endif  // _WIN32
+
 class AsyncSocket : public Socket {
  public:
   struct Context;
 
+  // A piece of the memory a vectored receive or send works on.
+#ifdef _WIN32
+  typedef WSABUF Buffer;
+#else   // _WIN32
+  typedef iovec Buffer;
+#endif  // _WIN32
+
+  // A receive or send as passed to Listener::OnBatchCompleted, with the
+  // arguments the matching method of Listener would have been called with.
+  struct Completion {
+    enum Type { Received, ReceivedFrom, Sent, SentTo };
+
+    Type type;
+    HRESULT result;
+    void* buffer;
+    int length;
+    int flags;
+    const sockaddr* address;
+    int address_length;
+  };
+
   class Listener {
    public:
     virtual ~Listener() {}
@@ -43,37 +81,190 @@ class AsyncSocket : public Socket {
     virtual void OnSentTo(AsyncSocket* socket, HRESULT result, void* buffer,
                           int length, const sockaddr* address,
                           int address_length) = 0;
+
+    // Called with the receives and sends of this listener that completed
+    // together, in the order they completed, where the socket can tell; on
+    // Windows each completes by itself. The default passes each on to the
+    // methods above. The addresses are valid only during the call.
+    virtual void OnBatchCompleted(AsyncSocket* socket,
+                                  const Completion* completions,
+                                  size_t count) {
+      for (size_t i = 0; i < count; ++i) {
+        const Completion& completion = completions[i];
+
+        switch (completion.type) {
+          case Completion::Received:
+            OnReceived(socket, completion.result, completion.buffer,
+                       completion.length, completion.flags);
+            break;
+
+          case Completion::ReceivedFrom:
+            OnReceivedFrom(socket, completion.result, completion.buffer,
+                           completion.length, completion.flags,
+                           completion.address, completion.address_length);
+            break;
+
+          case Completion::Sent:
+            OnSent(socket, completion.result, completion.buffer,
+                   completion.length);
+            break;
+
+          case Completion::SentTo:
+            OnSentTo(socket, completion.result, completion.buffer,
+                     completion.length, completion.address,
+                     completion.address_length);
+            break;
+        }
+      }
+    }
+
+#ifndef _WIN32
+    // Called when ReceiveFromBatchAsync or SendToBatchAsync completes, with
+    // how many of |datagrams| were received or sent. The defaults pass each
+    // of them on to OnReceivedFrom or OnSentTo, or the failure with the first.
+    virtual void OnReceivedBatch(AsyncSocket* socket, HRESULT result,
+                                 Datagram* datagrams, int count) {
+      if (FAILED(result))
+        OnReceivedFrom(socket, result,
+                       datagrams != nullptr ? datagrams->buffer : nullptr, 0,
+                       0, nullptr, 0);
+
+      for (int i = 0; i < count; ++i)
+        OnReceivedFrom(socket, result, datagrams[i].buffer,
+                       datagrams[i].length, datagrams[i].flags,
+                       static_cast<sockaddr*>(datagrams[i].address),
+                       datagrams[i].address_length);
+    }
+
+    virtual void OnSentBatch(AsyncSocket* socket, HRESULT result,
+                             Datagram* datagrams, int count) {
+      if (FAILED(result))
+        OnSentTo(socket, result,
+                 datagrams != nullptr ? datagrams->buffer : nullptr, 0,
+                 nullptr, 0);
+
+      for (int i = 0; i < count; ++i)
+        OnSentTo(socket, result, datagrams[i].buffer, datagrams[i].length,
+                 static_cast<sockaddr*>(datagrams[i].address),
+                 datagrams[i].address_length);
+    }
+#endif  // _WIN32
   };
 
   AsyncSocket();
   AsyncSocket(int family, int type, int protocol);
 
+  // Runs the callbacks of the socket on |executor| instead of the default
+  // set with SetCallbackEnvironment or SetThreadPool.
+  explicit AsyncSocket(madoka::concurrent::Executor executor);
+  AsyncSocket(int family, int type, int protocol,
+              madoka::concurrent::Executor executor);
+
   ~AsyncSocket();
 
   void Close() override;
 
+  // Each returns a handle to cancel the operation with, or kNoOperation if
+  // it failed to start.
+  madoka::io::Operation ConnectAsync(const addrinfo* end_point,
+                                     Listener* listener);
+  madoka::io::Operation ReceiveAsync(void* buffer, int length, int flags,
+                                     Listener* listener);
+  madoka::io::Operation ReceiveFromAsync(void* buffer, int length, int flags,
+                                         Listener* listener);
+  madoka::io::Operation SendAsync(const void* buffer, int length, int flags,
+                                  Listener* listener);
+  madoka::io::Operation SendToAsync(const void* buffer, int length, int flags,
+                                    const void* address, int address_length,
+                                    Listener* listener);
+
+  // Like ReceiveAsync and SendAsync, but fill or send the |count| pieces of
+  // |buffers| in order as one operation, such as a header and its payload.
+  // The array is copied while the memory it points to is not, and the
+  // listener is passed |buffers| as the buffer.
+  madoka::io::Operation ReceiveVectorAsync(const Buffer* buffers, int count,
+                                           int flags, Listener* listener);
+  madoka::io::Operation SendVectorAsync(const Buffer* buffers, int count,
+                                        int flags, Listener* listener);
+
+  // Like the above, but an operation still pending after |timeout| is given
+  // up and completes with a timeout error. A socket whose connect timed out
+  // should be closed.
+  madoka::io::Operation ConnectAsync(const addrinfo* end_point,
+                                     Listener* listener,
+                                     std::chrono::milliseconds timeout);
+  madoka::io::Operation ReceiveAsync(void* buffer, int length, int flags,
+                                     Listener* listener,
+                                     std::chrono::milliseconds timeout);
+  madoka::io::Operation ReceiveFromAsync(void* buffer, int length, int flags,
+                                         Listener* listener,
+                                         std::chrono::milliseconds timeout);
+
+  // Cancels a pending operation, which completes with kOperationCancelled,
+  // and leaves the socket and its other operations alone. Returns false if
+  // the operation has completed already; one that is just completing may
+  // still report its own result. A send that had partly gone out, or timed
+  // out, reports the length sent along with the error, which is where the
+  // stream picks up again. A socket whose connect was cancelled should be
+  // closed.
+  bool Cancel(madoka::io::Operation operation);
+
+  // Cancel every pending receive, including ReceiveFromAsync, or every
+  // pending send, including SendToAsync, and return how many there were.
+  size_t CancelReceives();
+  size_t CancelSends();
+
+#ifndef _WIN32
+  // Receive up to |count| datagrams, completing with those that have arrived
+  // once there is one, or send all |count| of them, with a system call for
+  // many at a time. |datagrams| is updated like Socket::ReceiveFromBatch does
+  // and passed to OnReceivedBatch or OnSentBatch.
+  madoka::io::Operation ReceiveFromBatchAsync(Datagram* datagrams, int count,
+                                              int flags, Listener* listener);
+  madoka::io::Operation SendToBatchAsync(Datagram* datagrams, int count,
+                                         int flags, Listener* listener);
+
+  // Sends started from now on with at least |threshold| bytes to go lend the
+  // kernel the memory of the buffer instead of copying it, where the socket
+  // supports it, and complete only once the kernel has let go of it; the
+  // buffer must be left alone until then. Zero, the default, turns this off,
+  // and so does a socket that turns out unable to avoid the copy. Closing the
+  // socket only shuts it down until the kernel has let go of the buffers.
+  // Connecting or destroying the socket before then stops waiting: the sends
+  // still holding buffers complete with HRESULT_FROM_ERRNO(EBUSY), and those
+  // buffers stay in use for as long as the connection takes to wind down.
+  void SetZeroCopyThreshold(size_t threshold);
+#endif  // _WIN32
+
+#ifdef _WIN32
   static PTP_CALLBACK_ENVIRON GetCallbackEnvironment();
   static void SetCallbackEnvironment(PTP_CALLBACK_ENVIRON environment);
+#else   // _WIN32
+  // The pool that runs the callbacks of sockets created from now on without
+  // an executor of their own; nullptr selects ThreadPool::GetDefault().
+  static madoka::concurrent::ThreadPool* GetThreadPool();
+  static void SetThreadPool(madoka::concurrent::ThreadPool* pool);
+#endif  // _WIN32
 
-  void ConnectAsync(const addrinfo* end_point, Listener* listener);
+#ifdef _WIN32
   Context* BeginConnect(const addrinfo* end_point, HANDLE event);
   HRESULT EndConnect(Context* context);
 
-  void ReceiveAsync(void* buffer, int length, int flags, Listener* listener);
   Context* BeginReceive(void* buffer, int length, int flags, HANDLE event);
+  Context* BeginReceiveVector(const Buffer* buffers, int count, int flags,
+                              HANDLE event);
   int EndReceive(Context* context, HRESULT* result);
   int EndReceive(Context* context) {
     HRESULT result;
     return EndReceive(context, &result);
   }
 
-  void ReceiveFromAsync(void* buffer, int length, int flags,
-                        Listener* listener);
   Context* BeginReceiveFrom(void* buffer, int length, int flags, HANDLE event);
   int EndReceiveFrom(Context* context, void* address, int* length);
 
-  void SendAsync(const void* buffer, int length, int flags, Listener* listener);
   Context* BeginSend(const void* buffer, int length, int flags, HANDLE event);
+  Context* BeginSendVector(const Buffer* buffers, int count, int flags,
+                           HANDLE event);
   int EndSend(Context* context, HRESULT* result);
 
   int EndSend(Context* context) {
@@ -81,8 +272,6 @@ class AsyncSocket : public Socket {
     return EndSend(context, &result);
   }
 
-  void SendToAsync(const void* buffer, int length, int flags,
-                   const void* address, int address_length, Listener* listener);
   Context* BeginSendTo(const void* buffer, int length, int flags,
                        const void* address, int address_length, HANDLE event);
   int EndSendTo(Context* context, HRESULT* result);
@@ -91,13 +280,24 @@ class AsyncSocket : public Socket {
     HRESULT result;
     return EndSendTo(context, &result);
   }
+#endif  // _WIN32
 
  private:
+  static void OnTimedOut(madoka::concurrent::TimerWheel::Timer* timer);
+  void OnTimedOut(Context* context);
+
+  size_t CancelAll(bool receives);
+  void Abort(Context* context, HRESULT result);
+
+  std::unique_ptr<madoka::io::OperationTable<Context>> operations_;
+
+#ifdef _WIN32
   static std::unique_ptr<Context> CreateContext(
       int request, const addrinfo* end_point, void* buffer, int length,
       DWORD flags, const void* address, int address_length,
       Listener* listener, HANDLE event);
-  HRESULT RequestAsync(std::unique_ptr<Context>&& context);
+  HRESULT RequestAsync(std::unique_ptr<Context>&& context,
+                       madoka::io::Operation* operation);
   Context* BeginRequest(std::unique_ptr<Context>&& context);
 
   static void CALLBACK OnRequested(PTP_CALLBACK_INSTANCE callback,
@@ -110,13 +310,58 @@ class AsyncSocket : public Socket {
   void OnCompleted(std::unique_ptr<Context>&& context, HRESULT result,
                    int length);
 
-  static PTP_CALLBACK_ENVIRON environment_;
+  static PTP_CALLBACK_ENVIRON default_environment_;
 
+  PTP_CALLBACK_ENVIRON const environment_;
   PTP_WORK work_;
   madoka::concurrent::CriticalSection lock_;
-  std::list<std::unique_ptr<Context>> requests_;
+  madoka::concurrent::MpscQueue<Context> requests_;
   bool cancel_connect_;
   PTP_IO io_;
+#else   // _WIN32
+  static std::unique_ptr<Context> CreateContext(
+      int request, const addrinfo* end_point, void* buffer, int length,
+      int flags, const void* address, int address_length, Listener* listener);
+  HRESULT RequestAsync(std::unique_ptr<Context>&& context,
+                       madoka::io::Operation* operation);
+
+  static void OnRequested(void* instance, ReactorWork* work);
+  void OnRequested(ReactorWork* work);
+
+  static void OnReady(void* instance, uint32_t events);
+  void OnReady(uint32_t events);
+
+  bool Attach();
+  bool EnableZeroCopy();
+  HRESULT Perform(Context* context);
+  HRESULT PerformBatch(Context* context);
+  void ReadErrorQueue();
+  void AbandonReleasing(std::list<std::unique_ptr<Context>>* abandoned);
+  void OnCompleted(std::unique_ptr<Context>&& context, HRESULT result);
+  void OnCompleted(std::list<std::unique_ptr<Context>>* contexts);
+
+  static madoka::concurrent::ThreadPool* default_pool_;
+
+  Reactor* const reactor_;
+  ReactorWork* work_;
+  madoka::concurrent::CriticalSection lock_;
+  madoka::concurrent::MpscQueue<Context> requests_;
+  std::list<std::unique_ptr<Context>> receives_;
+  std::list<std::unique_ptr<Context>> sends_;
+  bool cancel_connect_;
+  ReactorIo* io_;
+
+  size_t zero_copy_threshold_;
+  // Whether SO_ZEROCOPY is set on |descriptor_|, and the number the kernel
+  // gives the next send with MSG_ZEROCOPY.
+  bool zero_copy_;
+  uint32_t zero_copy_next_;
+  // Sends done with the socket that wait for the kernel to let go of their
+  // buffers, or of those of the sends ahead of them.
+  std::list<std::unique_ptr<Context>> releasing_;
+  // The closed socket kept open for the notifications of those sends.
+  SOCKET draining_;
+#endif  // _WIN32
 
   MADOKA_DISALLOW_COPY_AND_ASSIGN(AsyncSocket);
 };
@@ -0,0 +1,335 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_NET_AWAITABLE_H_
+#define MADOKA_NET_AWAITABLE_H_
+
+#include <madoka/io/awaitable.h>
+#include <madoka/net/async_server_socket.h>
+#include <madoka/net/async_socket.h>
+#include <madoka/net/socket_stream.h>
+
+#include <string.h>
+
+#include <memory>
+#include <tuple>
+
+namespace madoka {
+namespace net {
+
+// The lengths below give the size of the buffer and receive how much has been
+// transferred; |from_length| does the same for the address of the sender.
+
+class SocketAwaiter : public madoka::io::BasicAwaiter,
+                      public AsyncSocket::Listener {
+ public:
+  enum Request { Connect, Receive, ReceiveFrom, Send, SendTo };
+
+  SocketAwaiter(Request request, AsyncSocket* socket,
+                const addrinfo* end_point, void* buffer, int* length,
+                int flags, void* address, int address_length,
+                int* from_length)
+      : request_(request),
+        socket_(socket),
+        end_point_(end_point),
+        buffer_(buffer),
+        length_(length),
+        flags_(flags),
+        address_(address),
+        address_length_(address_length),
+        from_length_(from_length) {
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+
+    switch (request_) {
+      case Connect:
+        socket_->ConnectAsync(end_point_, this);
+        break;
+
+      case Receive:
+        socket_->ReceiveAsync(buffer_, *length_, flags_, this);
+        break;
+
+      case ReceiveFrom:
+        socket_->ReceiveFromAsync(buffer_, *length_, flags_, this);
+        break;
+
+      case Send:
+        socket_->SendAsync(buffer_, *length_, flags_, this);
+        break;
+
+      case SendTo:
+        socket_->SendToAsync(buffer_, *length_, flags_, address_,
+                             address_length_, this);
+        break;
+    }
+  }
+
+ private:
+  void OnConnected(AsyncSocket* /*socket*/, HRESULT result,
+                   const addrinfo* /*end_point*/) override {
+    Resume(result);
+  }
+
+  void OnReceived(AsyncSocket* /*socket*/, HRESULT result, void* /*buffer*/,
+                  int length, int /*flags*/) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  void OnReceivedFrom(AsyncSocket* /*socket*/, HRESULT result,
+                      void* /*buffer*/, int length, int /*flags*/,
+                      const sockaddr* address, int address_length) override {
+    *length_ = length;
+
+    if (address != nullptr && address_length <= *from_length_)
+      memmove(address_, address, address_length);
+    *from_length_ = address_length;
+
+    Resume(result);
+  }
+
+  void OnSent(AsyncSocket* /*socket*/, HRESULT result, void* /*buffer*/,
+              int length) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  void OnSentTo(AsyncSocket* /*socket*/, HRESULT result, void* /*buffer*/,
+                int length, const sockaddr* /*address*/,
+                int /*address_length*/) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  const Request request_;
+  AsyncSocket* const socket_;
+  const addrinfo* const end_point_;
+  void* const buffer_;
+  int* const length_;
+  const int flags_;
+  void* const address_;
+  const int address_length_;
+  int* const from_length_;
+};
+
+inline SocketAwaiter AwaitConnect(AsyncSocket* socket,
+                                  const addrinfo* end_point) {
+  return SocketAwaiter(SocketAwaiter::Connect, socket, end_point, nullptr,
+                       nullptr, 0, nullptr, 0, nullptr);
+}
+
+inline SocketAwaiter AwaitReceive(AsyncSocket* socket, void* buffer,
+                                  int* length, int flags) {
+  return SocketAwaiter(SocketAwaiter::Receive, socket, nullptr, buffer, length,
+                       flags, nullptr, 0, nullptr);
+}
+
+inline SocketAwaiter AwaitReceiveFrom(AsyncSocket* socket, void* buffer,
+                                      int* length, int flags, void* from,
+                                      int* from_length) {
+  return SocketAwaiter(SocketAwaiter::ReceiveFrom, socket, nullptr, buffer,
+                       length, flags, from, 0, from_length);
+}
+
+inline SocketAwaiter AwaitSend(AsyncSocket* socket, const void* buffer,
+                               int* length, int flags) {
+  return SocketAwaiter(SocketAwaiter::Send, socket, nullptr,
+                       const_cast<void*>(buffer), length, flags, nullptr, 0,
+                       nullptr);
+}
+
+inline SocketAwaiter AwaitSendTo(AsyncSocket* socket, const void* buffer,
+                                 int* length, int flags, const void* address,
+                                 int address_length) {
+  return SocketAwaiter(SocketAwaiter::SendTo, socket, nullptr,
+                       const_cast<void*>(buffer), length, flags,
+                       const_cast<void*>(address), address_length, nullptr);
+}
+
+class SocketStreamAwaiter : public madoka::io::BasicAwaiter,
+                            public SocketStream::Listener {
+ public:
+  enum Request { Connect, Receive, ReceiveFrom, Send, SendTo };
+
+  SocketStreamAwaiter(Request request, SocketStream* stream,
+                      const addrinfo* end_point, void* buffer,
+                      uint64_t* length, int flags, void* address,
+                      int address_length, int* from_length)
+      : request_(request),
+        stream_(stream),
+        end_point_(end_point),
+        buffer_(buffer),
+        length_(length),
+        flags_(flags),
+        address_(address),
+        address_length_(address_length),
+        from_length_(from_length) {
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+
+    switch (request_) {
+      case Connect:
+        stream_->ConnectAsync(end_point_, this, &context_);
+        break;
+
+      case Receive:
+        stream_->ReceiveAsync(buffer_, *length_, flags_, this, &context_);
+        break;
+
+      case ReceiveFrom:
+        stream_->ReceiveFromAsync(buffer_, *length_, flags_, this, &context_);
+        break;
+
+      case Send:
+        stream_->SendAsync(buffer_, *length_, flags_, this, &context_);
+        break;
+
+      case SendTo:
+        stream_->SendToAsync(buffer_, *length_, flags_, address_,
+                             address_length_, this, &context_);
+        break;
+    }
+  }
+
+ private:
+  void OnConnected(SocketStream* /*stream*/, HRESULT result,
+                   const addrinfo* /*end_point*/) override {
+    Resume(result);
+  }
+
+#ifdef _WIN32
+  void OnConnected(SocketStream* /*stream*/, HRESULT result,
+                   const ADDRINFOW* /*end_point*/) override {
+    Resume(result);
+  }
+#endif  // _WIN32
+
+  void OnReceived(SocketStream* /*stream*/, HRESULT result,
+                  void* /*buffer*/, uint64_t length, int /*flags*/) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  void OnReceivedFrom(SocketStream* /*stream*/, HRESULT result,
+                      void* /*buffer*/, uint64_t length, int /*flags*/,
+                      sockaddr* from, int from_length) override {
+    *length_ = length;
+
+    if (from != nullptr && from_length <= *from_length_)
+      memmove(address_, from, from_length);
+    *from_length_ = from_length;
+
+    Resume(result);
+  }
+
+  void OnSent(SocketStream* /*stream*/, HRESULT result, void* /*buffer*/,
+              uint64_t length) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  void OnSentTo(SocketStream* /*stream*/, HRESULT result, void* /*buffer*/,
+                uint64_t length, sockaddr* /*to*/,
+                int /*to_length*/) override {
+    *length_ = length;
+    Resume(result);
+  }
+
+  const Request request_;
+  SocketStream* const stream_;
+  const addrinfo* const end_point_;
+  void* const buffer_;
+  uint64_t* const length_;
+  const int flags_;
+  void* const address_;
+  const int address_length_;
+  int* const from_length_;
+  SocketStream::ContextStorage context_;
+};
+
+inline SocketStreamAwaiter AwaitConnect(SocketStream* stream,
+                                        const addrinfo* end_point) {
+  return SocketStreamAwaiter(SocketStreamAwaiter::Connect, stream, end_point,
+                             nullptr, nullptr, 0, nullptr, 0, nullptr);
+}
+
+inline SocketStreamAwaiter AwaitReceive(SocketStream* stream, void* buffer,
+                                        uint64_t* length, int flags) {
+  return SocketStreamAwaiter(SocketStreamAwaiter::Receive, stream, nullptr,
+                             buffer, length, flags, nullptr, 0, nullptr);
+}
+
+inline SocketStreamAwaiter AwaitReceiveFrom(SocketStream* stream,
+                                            void* buffer, uint64_t* length,
+                                            int flags, void* from,
+                                            int* from_length) {
+  return SocketStreamAwaiter(SocketStreamAwaiter::ReceiveFrom, stream,
+                             nullptr, buffer, length, flags, from, 0,
+                             from_length);
+}
+
+inline SocketStreamAwaiter AwaitSend(SocketStream* stream, const void* buffer,
+                                     uint64_t* length, int flags) {
+  return SocketStreamAwaiter(SocketStreamAwaiter::Send, stream, nullptr,
+                             const_cast<void*>(buffer), length, flags, nullptr,
+                             0, nullptr);
+}
+
+inline SocketStreamAwaiter AwaitSendTo(SocketStream* stream,
+                                       const void* buffer, uint64_t* length,
+                                       int flags, void* address,
+                                       int address_length) {
+  return SocketStreamAwaiter(SocketStreamAwaiter::SendTo, stream, nullptr,
+                             const_cast<void*>(buffer), length, flags,
+                             address, address_length, nullptr);
+}
+
+// Resumes with the accepted connection in |accepted|, an AsyncSocket or a
+// SocketStream, which is constructed with |args| like EndAccept does.
+template<class Impl, class... Args>
+class AcceptAwaiter : public madoka::io::BasicAwaiter,
+                      public AsyncServerSocket::Listener {
+ public:
+  AcceptAwaiter(AsyncServerSocket* server, std::unique_ptr<Impl>* accepted,
+                Args... args)
+      : server_(server), accepted_(accepted), args_(args...) {
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    server_->AcceptAsync(this);
+  }
+
+ private:
+  void OnAccepted(AsyncServerSocket* server, HRESULT result,
+                  AsyncServerSocket::Context* context) override {
+    if (SUCCEEDED(result))
+      *accepted_ = std::apply(
+          [server, context, &result](Args&... args) {
+            return server->EndAccept<Impl>(context, &result, args...);
+          },
+          args_);
+
+    Resume(result);
+  }
+
+  AsyncServerSocket* const server_;
+  std::unique_ptr<Impl>* const accepted_;
+  std::tuple<Args...> args_;
+};
+
+template<class Impl, class... Args>
+AcceptAwaiter<Impl, Args...> AwaitAccept(AsyncServerSocket* server,
+                                         std::unique_ptr<Impl>* accepted,
+                                         Args... args) {
+  return AcceptAwaiter<Impl, Args...>(server, accepted, args...);
+}
+
+}  // namespace net
+}  // namespace madoka
+
+#endif  // MADOKA_NET_AWAITABLE_H_
@@ -18,6 +18,8 @@
   #define SHUT_WR   SD_SEND
   #define SHUT_RDWR SD_BOTH
 #else   // _WIN32
+  #include <madoka/hresult.h>
+
   #include <errno.h>
   #include <unistd.h>
   #include <sys/ioctl.h>
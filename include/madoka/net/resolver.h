@@ -13,16 +13,19 @@
 namespace madoka {
 namespace net {
 
-template<typename Info, typename String, typename Char = String::value_type>
+template<typename Info, typename String,
+         typename Char = typename String::value_type>
 class ResolverBase {
  public:
-  typedef typename Info InfoType;
-  typedef typename String StringType;
-  typedef typename Char CharType;
+  typedef Info InfoType;
+  typedef String StringType;
+  typedef Char CharType;
 
   class Iterator
       : public std::iterator<std::input_iterator_tag, const InfoType*> {
    public:
+    typedef const InfoType* value_type;
+
     bool operator!=(const Iterator& other) const {
       assert(other.entries_ == nullptr || other.entries_ == entries_);
       return current_ != other.current_;
@@ -31,20 +31,21 @@ class ServerSocket : public AbstractSocket {
   std::unique_ptr<Impl> Accept() {
     struct Wrapper : Impl {
       explicit Wrapper(SOCKET descriptor) {
-        descriptor_ = descriptor;
-        bound_ = true;
-        connected_ = true;
+        this->descriptor_ = descriptor;
+        this->bound_ = true;
+        this->connected_ = true;
       }
     };
 
     sockaddr_storage address;
     int length = sizeof(address);
     SOCKET descriptor = accept(descriptor_,
-                               reinterpret_cast<sockaddr*>(&address), &length);
+                               reinterpret_cast<sockaddr*>(&address),
+                               reinterpret_cast<socklen_t*>(&length));
     if (descriptor == INVALID_SOCKET)
       return nullptr;
 
-    auto accepted = std::make_unique<Impl>(descriptor);
+    auto accepted = std::make_unique<Wrapper>(descriptor);
     if (accepted == nullptr)
       closesocket(descriptor);
 
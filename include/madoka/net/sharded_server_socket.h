@@ -0,0 +1,57 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef MADOKA_NET_SHARDED_SERVER_SOCKET_H_
+#define MADOKA_NET_SHARDED_SERVER_SOCKET_H_
+
+#ifdef _WIN32
+#  error The ShardedServerSocket requires SO_REUSEPORT.
+#endif  // _WIN32
+
+#include <madoka/net/async_server_socket.h>
+
+#include <memory>
+#include <vector>
+
+namespace madoka {
+namespace net {
+
+// Listens on one end point with a set of AsyncServerSockets sharing it
+// through SO_REUSEPORT, so that each has an accept queue and a lock of its
+// own instead of all connections going through one. The kernel deals the
+// connections out to the shards, by a hash of their addresses unless
+// SteerByCpu says otherwise.
+class ShardedServerSocket {
+ public:
+  ShardedServerSocket();
+  ~ShardedServerSocket();
+
+  // Opens a shard for each of |count| executors, whose callbacks it runs on.
+  // Connections made meanwhile may land on a shard that is not accepting yet.
+  HRESULT Open(const addrinfo* end_point, int backlog,
+               const madoka::concurrent::Executor* executors, size_t count);
+
+  // Hands each connection to the shard with the index of the CPU that
+  // received it, modulo the number of shards. Pays off when shard i runs on
+  // CPU i, where the connection stays from its SYN on.
+  HRESULT SteerByCpu();
+
+  void Close();
+
+  size_t size() const {
+    return shards_.size();
+  }
+
+  AsyncServerSocket* shard(size_t index) const {
+    return shards_[index].get();
+  }
+
+ private:
+  std::vector<std::unique_ptr<AsyncServerSocket>> shards_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(ShardedServerSocket);
+};
+
+}  // namespace net
+}  // namespace madoka
+
+#endif  // MADOKA_NET_SHARDED_SERVER_SOCKET_H_
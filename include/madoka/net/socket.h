@@ -5,9 +5,34 @@
 
 #include <madoka/net/abstract_socket.h>
 
+#ifndef _WIN32
+#include <netinet/udp.h>
+#include <string.h>
+#endif  // _WIN32
+
+#include <algorithm>
+
 namespace madoka {
 namespace net {
 
+// One datagram of ReceiveFromBatch or SendToBatch. |length| gives the size of
+// |buffer| and |address_length| that of |address|, which may be null, and
+// both receive what was actually received or sent, as |flags| does the flags
+// of a received datagram.
+//
+// A nonzero |segment_size| sends |buffer| as a train of datagrams of that
+// size, the last one shorter if need be, at the cost of one. A received
+// datagram that the kernel coalesced from such a train, see SetCoalescing,
+// gets the size of its segments there and zero otherwise.
+struct Datagram {
+  void* buffer;
+  int length;
+  void* address;
+  int address_length;
+  int flags;
+  int segment_size;
+};
+
 class Socket : public AbstractSocket {
  public:
   Socket() : connected_(false) {
@@ -77,7 +102,8 @@ class Socket : public AbstractSocket {
   int ReceiveFrom(void* buffer, int length, int flags, void* address,
                   int* address_length) {
     return recvfrom(descriptor_, static_cast<char*>(buffer), length, flags,
-                    static_cast<sockaddr*>(address), address_length);
+                    static_cast<sockaddr*>(address),
+                    reinterpret_cast<socklen_t*>(address_length));
   }
 
   int Send(const void* buffer, int length, int flags) {
@@ -90,9 +116,141 @@ class Socket : public AbstractSocket {
                   static_cast<const sockaddr*>(address), address_length);
   }
 
+  // Receives up to |count| datagrams, waiting for the first one only like
+  // ReceiveFrom does, and returns how many were received or SOCKET_ERROR.
+  int ReceiveFromBatch(Datagram* datagrams, int count, int flags) {
+#ifdef _WIN32
+    // Windows has no call for this; each datagram takes one of its own.
+    int received = 0;
+
+    for (; received < count; ++received) {
+      u_long available = 0;
+      if (received > 0 && (!IOControl(FIONREAD, &available) || available == 0))
+        break;
+
+      Datagram* datagram = datagrams + received;
+      int length = ReceiveFrom(datagram->buffer, datagram->length, flags,
+                               datagram->address, &datagram->address_length);
+      if (length == SOCKET_ERROR)
+        return received > 0 ? received : SOCKET_ERROR;
+
+      datagram->length = length;
+      datagram->flags = 0;
+      datagram->segment_size = 0;
+    }
+
+    return received;
+#else   // _WIN32
+    mmsghdr headers[kMaxBatch];
+    iovec vectors[kMaxBatch];
+    Control controls[kMaxBatch];
+    int received = 0;
+
+    while (received < count) {
+      int batch = count - received;
+      if (batch > kMaxBatch)
+        batch = kMaxBatch;
+
+      PrepareBatch(datagrams + received, batch, headers, vectors, controls,
+                   true);
+
+      int result = recvmmsg(
+          descriptor_, headers, batch,
+          flags | (received == 0 ? MSG_WAITFORONE : MSG_DONTWAIT), nullptr);
+      if (result == SOCKET_ERROR)
+        return received > 0 ? received : SOCKET_ERROR;
+
+      FinishBatch(datagrams + received, result, headers, true);
+      received += result;
+
+      if (result < batch)
+        break;
+    }
+
+    return received;
+#endif  // _WIN32
+  }
+
+  // Sends up to |count| datagrams and returns how many were sent or
+  // SOCKET_ERROR. Those sent are left out of the error of a later one, which
+  // the next call reports.
+  int SendToBatch(Datagram* datagrams, int count, int flags) {
+#ifdef _WIN32
+    int sent = 0;
+
+    for (; sent < count; ++sent) {
+      Datagram* datagram = datagrams + sent;
+      int length = 0;
+
+      // Windows has no call for this or for segmentation; each segment takes
+      // one of its own.
+      do {
+        int segment = datagram->length - length;
+        if (datagram->segment_size > 0 && segment > datagram->segment_size)
+          segment = datagram->segment_size;
+
+        int result = SendTo(static_cast<char*>(datagram->buffer) + length,
+                            segment, flags, datagram->address,
+                            datagram->address_length);
+        if (result == SOCKET_ERROR) {
+          if (length > 0)
+            break;
+
+          return sent > 0 ? sent : SOCKET_ERROR;
+        }
+
+        length += result;
+      } while (length < datagram->length);
+
+      datagram->length = length;
+    }
+
+    return sent;
+#else   // _WIN32
+    mmsghdr headers[kMaxBatch];
+    iovec vectors[kMaxBatch];
+    Control controls[kMaxBatch];
+    int sent = 0;
+
+    while (sent < count) {
+      int batch = count - sent;
+      if (batch > kMaxBatch)
+        batch = kMaxBatch;
+
+      PrepareBatch(datagrams + sent, batch, headers, vectors, controls, false);
+
+      int result = sendmmsg(descriptor_, headers, batch, flags);
+      if (result == SOCKET_ERROR)
+        return sent > 0 ? sent : SOCKET_ERROR;
+
+      FinishBatch(datagrams + sent, result, headers, false);
+      sent += result;
+
+      if (result < batch)
+        break;
+    }
+
+    return sent;
+#endif  // _WIN32
+  }
+
+#ifndef _WIN32
+  // Sends what SendTo and the like are given as a train of datagrams of
+  // |size|, or stops doing so with zero; see Datagram::segment_size.
+  bool SetSegmentSize(int size) {
+    return SetOption(SOL_UDP, UDP_SEGMENT, size);
+  }
+
+  // Lets the kernel pass a train of received datagrams from one sender on as
+  // one. Only ReceiveFromBatch and ReceiveFromBatchAsync tell where they end.
+  bool SetCoalescing(bool enable) {
+    return SetOption(SOL_UDP, UDP_GRO, enable ? 1 : 0);
+  }
+#endif  // _WIN32
+
   bool GetRemoteEndPoint(void* address, int* length) {
     return getpeername(descriptor_, static_cast<sockaddr*>(address),
-                       length) == 0;
+                       reinterpret_cast<socklen_t*>(length)) == 0;
   }
 
   bool connected() const {
@@ -100,6 +258,74 @@ class Socket : public AbstractSocket {
   }
 
  protected:
+#ifndef _WIN32
+  // How many datagrams a batch passes to the kernel at once.
+  static const int kMaxBatch = 64;
+
+  // Room for the segment size of one datagram, sent as a uint16_t and
+  // received as an int.
+  union Control {
+    cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int))];
+  };
+
+  static void PrepareBatch(Datagram* datagrams, int count, mmsghdr* headers,
+                           iovec* vectors, Control* controls, bool receive) {
+    for (int i = 0; i < count; ++i) {
+      vectors[i].iov_base = datagrams[i].buffer;
+      vectors[i].iov_len = std::max(datagrams[i].length, 0);
+
+      headers[i] = mmsghdr();
+      headers[i].msg_hdr.msg_iov = &vectors[i];
+      headers[i].msg_hdr.msg_iovlen = 1;
+
+      if (datagrams[i].address != nullptr) {
+        headers[i].msg_hdr.msg_name = datagrams[i].address;
+        headers[i].msg_hdr.msg_namelen = datagrams[i].address_length;
+      }
+
+      if (receive) {
+        headers[i].msg_hdr.msg_control = controls[i].buffer;
+        headers[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+      } else if (datagrams[i].segment_size > 0) {
+        uint16_t size = static_cast<uint16_t>(
+            std::min(datagrams[i].segment_size, 0xFFFF));
+
+        headers[i].msg_hdr.msg_control = controls[i].buffer;
+        headers[i].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(size));
+
+        cmsghdr* header = CMSG_FIRSTHDR(&headers[i].msg_hdr);
+        header->cmsg_level = SOL_UDP;
+        header->cmsg_type = UDP_SEGMENT;
+        header->cmsg_len = CMSG_LEN(sizeof(size));
+        memcpy(CMSG_DATA(header), &size, sizeof(size));
+      }
+    }
+  }
+
+  static void FinishBatch(Datagram* datagrams, int count,
+                          const mmsghdr* headers, bool received) {
+    for (int i = 0; i < count; ++i) {
+      datagrams[i].length = headers[i].msg_len;
+
+      if (!received)
+        continue;
+
+      datagrams[i].address_length = headers[i].msg_hdr.msg_namelen;
+      datagrams[i].flags = headers[i].msg_hdr.msg_flags;
+      datagrams[i].segment_size = 0;
+
+      auto message = const_cast<msghdr*>(&headers[i].msg_hdr);
+      for (auto header = CMSG_FIRSTHDR(message); header != nullptr;
+           header = CMSG_NXTHDR(message, header)) {
+        if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO)
+          memcpy(&datagrams[i].segment_size, CMSG_DATA(header),
+                 sizeof(datagrams[i].segment_size));
+      }
+    }
+  }
+#endif  // _WIN32
+
   bool connected_;
 
  private:
@@ -10,6 +10,10 @@
 #include <madoka/io/abstract_stream.h>
 #include <madoka/net/socket.h>
 
+#ifndef _WIN32
+#include <deque>
+#endif  // _WIN32
+
 namespace madoka {
 namespace net {
 
@@ -23,8 +27,10 @@ class SocketStream : public Socket, public madoka::io::AbstractStream {
 
     virtual void OnConnected(SocketStream* stream, HRESULT result,
                              const addrinfo* end_point) = 0;
+#ifdef _WIN32
     virtual void OnConnected(SocketStream* stream, HRESULT result,
                              const ADDRINFOW* end_point) = 0;
+#endif  // _WIN32
 
     virtual void OnReceived(SocketStream* stream, HRESULT result, void* buffer,
                             uint64_t length, int flags) = 0;
@@ -39,44 +45,112 @@ class SocketStream : public Socket, public madoka::io::AbstractStream {
   };
 
   SocketStream();
+  // Runs the callbacks of the stream on |executor|.
+  explicit SocketStream(madoka::concurrent::Executor executor);
   ~SocketStream();
 
   void Close() override;
 
   void ConnectAsync(const addrinfo* end_point, Listener* listener);
-  AsyncContext* BeginConnect(const addrinfo* end_point, HANDLE event);
+  void ReceiveAsync(void* buffer, uint64_t length, int flags,
+                    Listener* listener);
+  void ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                        Listener* listener);
+  void SendAsync(const void* buffer, uint64_t length, int flags,
+                 Listener* listener);
+  void SendToAsync(const void* buffer, uint64_t length, int flags, void* to,
+                   int to_length, Listener* listener);
+
+  // Like the above, but a request still pending after |timeout| is cancelled
+  // and completes with a timeout error. A stream whose connect timed out is
+  // closed.
+  void ConnectAsync(const addrinfo* end_point, Listener* listener,
+                    std::chrono::milliseconds timeout);
+  void ReceiveAsync(void* buffer, uint64_t length, int flags,
+                    Listener* listener, std::chrono::milliseconds timeout);
+  void ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                        Listener* listener, std::chrono::milliseconds timeout);
+
+  // Like the above, but the context of the request is made in |storage|
+  // instead of being allocated.
+  void ConnectAsync(const addrinfo* end_point, Listener* listener,
+                    ContextStorage* storage);
+  void ReceiveAsync(void* buffer, uint64_t length, int flags,
+                    Listener* listener, ContextStorage* storage);
+  void ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                        Listener* listener, ContextStorage* storage);
+  void SendAsync(const void* buffer, uint64_t length, int flags,
+                 Listener* listener, ContextStorage* storage);
+  void SendToAsync(const void* buffer, uint64_t length, int flags, void* to,
+                   int to_length, Listener* listener, ContextStorage* storage);
+
+  // Sends |length| bytes of |file| from |offset| on without copying them
+  // through a buffer, and calls OnSent with a null buffer once they are sent,
+  // or fewer if the file ends first. |file| must stay open until then.
+#ifdef _WIN32
+  void TransmitFileAsync(HANDLE file, uint64_t offset, uint64_t length,
+                         Listener* listener);
+#else   // _WIN32
+  void TransmitFileAsync(int file, uint64_t offset, uint64_t length,
+                         Listener* listener);
+#endif  // _WIN32
+
+#ifdef _WIN32
+  // Without |event|, End* waits for the request by itself.
+  AsyncContext* BeginConnect(const addrinfo* end_point, HANDLE event = NULL);
   HRESULT EndConnect(AsyncContext* context, const addrinfo** end_point);
 
   void ConnectAsync(const ADDRINFOW* end_point, Listener* listener);
-  AsyncContext* BeginConnect(const ADDRINFOW* end_point, HANDLE event);
+  void ConnectAsync(const ADDRINFOW* end_point, Listener* listener,
+                    std::chrono::milliseconds timeout);
+  AsyncContext* BeginConnect(const ADDRINFOW* end_point, HANDLE event = NULL);
   HRESULT EndConnect(AsyncContext* context, const ADDRINFOW** end_point);
 
   HRESULT EndConnect(AsyncContext* context);
 
-  void ReceiveAsync(void* buffer, uint64_t length, int flags,
-                    Listener* listener);
   AsyncContext* BeginReceive(void* buffer, DWORD length, int flags,
-                             HANDLE event);
+                             HANDLE event = NULL);
   HRESULT EndReceive(AsyncContext* context, DWORD* length, int* flags);
 
-  void ReceiveFromAsync(void* buffer, uint64_t length, int flags,
-                        Listener* listener);
   AsyncContext* BeginReceiveFrom(void* buffer, DWORD length, int flags,
-                                 HANDLE event);
+                                 HANDLE event = NULL);
   HRESULT EndReceiveFrom(AsyncContext* context, DWORD* length, int* flags,
                          void* address, int* address_length);
 
-  void SendAsync(const void* buffer, uint64_t length, int flags,
-                 Listener* listener);
   AsyncContext* BeginSend(const void* buffer, DWORD length, int flags,
-                          HANDLE event);
+                          HANDLE event = NULL);
   HRESULT EndSend(AsyncContext* context, DWORD* length);
 
-  void SendToAsync(const void* buffer, uint64_t length, int flags, void* to,
-                   int to_length, Listener* listener);
   AsyncContext* BeginSendTo(const void* buffer, DWORD length, int flags,
-                            void* to, int to_length, HANDLE event);
+                            void* to, int to_length, HANDLE event = NULL);
   HRESULT EndSendTo(AsyncContext* context, DWORD* length);
+#else   // _WIN32
+  // End* blocks until the request started by the matching Begin* completes.
+  AsyncContext* BeginConnect(const addrinfo* end_point);
+  HRESULT EndConnect(AsyncContext* context, const addrinfo** end_point);
+  HRESULT EndConnect(AsyncContext* context);
+
+  AsyncContext* BeginReceive(void* buffer, uint32_t length, int flags);
+  HRESULT EndReceive(AsyncContext* context, uint32_t* length, int* flags);
+
+  AsyncContext* BeginReceiveFrom(void* buffer, uint32_t length, int flags);
+  HRESULT EndReceiveFrom(AsyncContext* context, uint32_t* length, int* flags,
+                         void* address, int* address_length);
+
+  AsyncContext* BeginSend(const void* buffer, uint32_t length, int flags);
+  HRESULT EndSend(AsyncContext* context, uint32_t* length);
+
+  AsyncContext* BeginSendTo(const void* buffer, uint32_t length, int flags,
+                            void* to, int to_length);
+  HRESULT EndSendTo(AsyncContext* context, uint32_t* length);
+#endif  // _WIN32
+
+  // Cancels the request started by a Begin*, which then completes with
+  // kOperationCancelled, and leaves the stream and its other requests alone.
+  // Returns false once the request has completed; one that is just
+  // completing may still report its own result. |context| must not have been
+  // passed to End* yet.
+  bool Cancel(AsyncContext* context);
 
   HRESULT Read(void* buffer, uint64_t* length) override;
   void ReadAsync(void* buffer, uint64_t length,
@@ -89,20 +163,31 @@ class SocketStream : public Socket, public madoka::io::AbstractStream {
  private:
   void Reset();
 
+  void CommunicateAsync(int type, void* buffer, uint64_t length, int flags,
+                        void* address, int address_length,
+                        Stream::Listener* listener, Listener* socket_listener,
+                        std::chrono::milliseconds timeout,
+                        ContextStorage* storage);
+
+  void OnRequested(AbstractStream::AsyncContext* abstract_context) override;
+
+  bool IsRead(int type) const override;
+  bool IsWrite(int type) const override;
+  void CancelRequest(AbstractStream::AsyncContext* abstract_context) override;
+
+#ifdef _WIN32
   void ConnectAsync(const addrinfo* end_point, const ADDRINFOW* end_pointw,
-                    Listener* listener);
+                    Listener* listener, std::chrono::milliseconds timeout,
+                    ContextStorage* storage);
   AsyncContext* BeginConnect(const addrinfo* end_point,
                              const ADDRINFOW* end_pointw, HANDLE event);
   BOOL ConnectAsync(AsyncContext* context);
 
-  void CommunicateAsync(int type, void* buffer, uint64_t length, int flags,
-                        void* address, int address_length,
-                        Stream::Listener* listener, Listener* socket_listener);
   AsyncContext* BeginCommunicate(int type, void* buffer, DWORD length,
                                  int flags, void* address, int address_length,
                                  HANDLE event);
-
-  void OnRequested(AbstractStream::AsyncContext* abstract_context) override;
+  BOOL TransmitAsync(AsyncContext* context);
+  HRESULT WaitForResult(AsyncContext* context, DWORD* length);
 
   static void CALLBACK OnCompleted(PTP_CALLBACK_INSTANCE callback,
                                    void* instance, void* overlapped,
@@ -110,6 +195,34 @@ class SocketStream : public Socket, public madoka::io::AbstractStream {
   void OnCompleted(AsyncContext* context, HRESULT result, ULONG_PTR length);
 
   PTP_IO io_;
+#else   // _WIN32
+  void ConnectAsync(const addrinfo* end_point, Listener* listener,
+                    std::chrono::milliseconds timeout,
+                    ContextStorage* storage);
+  HRESULT ConnectAsync(AsyncContext* context);
+  HRESULT CommunicateAsync(AsyncContext* context);
+  HRESULT TransmitAsync(AsyncContext* context);
+  void ClosePipe();
+  HRESULT WriteAsync(AsyncContext* context);
+  void WriteNext(AsyncContext* context);
+
+  AsyncContext* BeginCommunicate(int type, void* buffer, uint32_t length,
+                                 int flags, void* address, int address_length);
+
+  static void OnCompleted(madoka::io::CompletionPacket* packet, int result);
+  void OnCompleted(AsyncContext* context, HRESULT result, uint64_t length);
+  static void OnNotified(AbstractStream::AsyncContext* abstract_context);
+  void OnNotified(AsyncContext* context);
+
+  // Writes go out one at a time, since io_uring would run them side by side
+  // and a short one would be resumed after those behind it.
+  AsyncContext* writing_;
+  std::deque<AsyncContext*> writes_;
+
+  // The pipe transmissions splice the file through, made by the first one.
+  // Being writes, they take turns with it.
+  int pipe_[2];
+#endif  // _WIN32
 
   MADOKA_DISALLOW_COPY_AND_ASSIGN(SocketStream);
 };
@@ -2,38 +2,124 @@
 
 #include <madoka/concurrent/condition_variable.h>
 
-#include <pthread.h>
+#include <time.h>
 
-#include "concurrent/internals.h"
+#include "concurrent/futex_posix.h"
 
 namespace madoka {
 namespace concurrent {
 
-ConditionVariable::ConditionVariable() : variable_(new VariableImpl) {
-  variable_->cond = PTHREAD_COND_INITIALIZER;
+namespace {
+
+// libstdc++ reads steady_clock from CLOCK_MONOTONIC, which is also the clock
+// the futex deadline is measured on.
+timespec ToTimespec(const ConditionVariable::Clock::time_point& deadline) {
+  auto since_epoch = deadline.time_since_epoch();
+  if (since_epoch.count() < 0)
+    return timespec();
+
+  auto seconds = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+  auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      since_epoch - seconds);
+
+  timespec result;
+  result.tv_sec = static_cast<time_t>(seconds.count());
+  result.tv_nsec = static_cast<long>(nanoseconds.count());  // NOLINT(runtime/int)
+
+  return result;
+}
+
+}  // namespace
+
+// Sleepers wait on |sequence_| for it to move past the value they saw while
+// still holding the lock, so a wake between unlocking and parking is not
+// lost. |waiters_| lets Wake skip the system call when nobody sleeps; both
+// sides access the two words sequentially consistent, so either the waker
+// sees the waiter or the waiter sees the new sequence.
+ConditionVariable::ConditionVariable() : sequence_(0), waiters_(0) {
 }
 
 ConditionVariable::~ConditionVariable() {
-  ::pthread_cond_destroy(&variable_->cond);
-  delete variable_;
 }
 
 bool ConditionVariable::Sleep(CriticalSection* lock) {
-  ::pthread_cond_wait(&variable_->cond, &lock->mutex_->mutex);
-  return true;
+  return Wait(lock, nullptr);
+}
+
+bool ConditionVariable::Sleep(Mutex* lock) {
+  return Wait(lock, nullptr);
 }
 
 bool ConditionVariable::Sleep(ReadWriteLock* lock, bool exclusive) {
-  // not supported
-  return false;
+  return Wait(lock, exclusive, nullptr);
+}
+
+bool ConditionVariable::SleepUntil(CriticalSection* lock,
+                                   const Clock::time_point& deadline) {
+  timespec time = ToTimespec(deadline);
+  return Wait(lock, &time);
+}
+
+bool ConditionVariable::SleepUntil(Mutex* lock,
+                                   const Clock::time_point& deadline) {
+  timespec time = ToTimespec(deadline);
+  return Wait(lock, &time);
+}
+
+bool ConditionVariable::SleepUntil(ReadWriteLock* lock, bool exclusive,
+                                   const Clock::time_point& deadline) {
+  timespec time = ToTimespec(deadline);
+  return Wait(lock, exclusive, &time);
 }
 
 void ConditionVariable::Wake() {
-  ::pthread_cond_signal(&variable_->cond);
+  sequence_.fetch_add(1);
+  if (waiters_.load() != 0)
+    FutexWake(&sequence_, 1);
 }
 
 void ConditionVariable::WakeAll() {
-  ::pthread_cond_broadcast(&variable_->cond);
+  sequence_.fetch_add(1);
+  if (waiters_.load() != 0)
+    FutexWakeAll(&sequence_);
+}
+
+bool ConditionVariable::Wait(Lockable* lock, const timespec* deadline) {
+  waiters_.fetch_add(1);
+  uint32_t sequence = sequence_.load();
+
+  lock->Unlock();
+  bool result = FutexWait(&sequence_, sequence, deadline);
+  lock->Lock();
+
+  waiters_.fetch_sub(1, std::memory_order_relaxed);
+
+  return result;
+}
+
+bool ConditionVariable::Wait(CriticalSection* lock, const timespec* deadline) {
+  // Releases all levels of recursion and restores them afterwards.
+  uint32_t recursion = lock->recursion_;
+  uintptr_t owner = lock->owner_.load(std::memory_order_relaxed);
+
+  lock->recursion_ = 0;
+  lock->owner_.store(0, std::memory_order_relaxed);
+
+  bool result = Wait(&lock->mutex_, deadline);
+
+  lock->owner_.store(owner, std::memory_order_relaxed);
+  lock->recursion_ = recursion;
+
+  return result;
+}
+
+bool ConditionVariable::Wait(ReadWriteLock* lock, bool exclusive,
+                             const timespec* deadline) {
+  if (!exclusive)
+    return Wait(static_cast<Lockable*>(lock), deadline);
+
+  WriteLock write_lock(lock);
+  return Wait(&write_lock, deadline);
 }
 
 }  // namespace concurrent
@@ -9,6 +9,25 @@
 namespace madoka {
 namespace concurrent {
 
+namespace {
+
+// Waits of INFINITE or longer are rounded down to just below it.
+DWORD GetTimeout(const ConditionVariable::Clock::time_point& deadline) {
+  auto now = ConditionVariable::Clock::now();
+  if (deadline <= now)
+    return 0;
+
+  auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - now + std::chrono::milliseconds(1) -
+      ConditionVariable::Clock::duration(1));
+  if (timeout.count() >= INFINITE)
+    return INFINITE - 1;
+
+  return static_cast<DWORD>(timeout.count());
+}
+
+}  // namespace
+
 ConditionVariable::ConditionVariable() : variable_(new VariableImpl) {
   ::InitializeConditionVariable(variable_);
 }
@@ -21,10 +40,57 @@ bool ConditionVariable::Sleep(CriticalSection* lock) {
   return ::SleepConditionVariableCS(variable_, lock->mutex_, INFINITE) != FALSE;
 }
 
+bool ConditionVariable::Sleep(Mutex* lock) {
+  return ::SleepConditionVariableSRW(
+      variable_, reinterpret_cast<PSRWLOCK>(&lock->lock_), INFINITE, 0) !=
+      FALSE;
+}
+
 bool ConditionVariable::Sleep(ReadWriteLock* lock, bool exclusive) {
+  return Wait(lock, exclusive, INFINITE);
+}
+
+bool ConditionVariable::SleepUntil(CriticalSection* lock,
+                                   const Clock::time_point& deadline) {
+  return ::SleepConditionVariableCS(variable_, lock->mutex_,
+                                    GetTimeout(deadline)) != FALSE;
+}
+
+bool ConditionVariable::SleepUntil(Mutex* lock,
+                                   const Clock::time_point& deadline) {
   return ::SleepConditionVariableSRW(
-      variable_, lock->lock_, INFINITE,
-      exclusive ? 0 : CONDITION_VARIABLE_LOCKMODE_SHARED) != FALSE;
+      variable_, reinterpret_cast<PSRWLOCK>(&lock->lock_),
+      GetTimeout(deadline), 0) != FALSE;
+}
+
+bool ConditionVariable::SleepUntil(ReadWriteLock* lock, bool exclusive,
+                                   const Clock::time_point& deadline) {
+  return Wait(lock, exclusive, GetTimeout(deadline));
+}
+
+// A writer also holds the upgrade lock, which must not stay held while it
+// sleeps or no other writer could get in to wake it. It is taken back before
+// the lock itself if that cannot be done without waiting.
+bool ConditionVariable::Wait(ReadWriteLock* lock, bool exclusive,
+                             uint32_t timeout) {
+  if (!exclusive) {
+    return ::SleepConditionVariableSRW(
+        variable_, lock->lock_, timeout,
+        CONDITION_VARIABLE_LOCKMODE_SHARED) != FALSE;
+  }
+
+  ::ReleaseSRWLockExclusive(&lock->lock_->upgrade);
+
+  bool woken =
+      ::SleepConditionVariableSRW(variable_, lock->lock_, timeout, 0) != FALSE;
+
+  if (!::TryAcquireSRWLockExclusive(&lock->lock_->upgrade)) {
+    ::ReleaseSRWLockExclusive(lock->lock_);
+    ::AcquireSRWLockExclusive(&lock->lock_->upgrade);
+    ::AcquireSRWLockExclusive(lock->lock_);
+  }
+
+  return woken;
 }
 
 void ConditionVariable::Wake() {
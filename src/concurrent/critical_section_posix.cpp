@@ -2,33 +2,76 @@
 
 #include <madoka/concurrent/critical_section.h>
 
-#include <pthread.h>
-
-#include "concurrent/internals.h"
-
 namespace madoka {
 namespace concurrent {
 
-CriticalSection::CriticalSection() : mutex_(new MutexImpl) {
-  mutex_->mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+namespace {
+
+// The address of a thread-local object identifies the calling thread; unlike
+// pthread_t it can be compared and stored atomically.
+uintptr_t GetCurrentThreadTag() {
+  static thread_local char tag;
+  return reinterpret_cast<uintptr_t>(&tag);
+}
+
+}  // namespace
+
+CriticalSection::CriticalSection() : owner_(0), recursion_(0) {
+}
+
+CriticalSection::CriticalSection(uint32_t spin_count)
+    : mutex_(spin_count), owner_(0), recursion_(0) {
 }
 
 CriticalSection::~CriticalSection() {
-  ::pthread_mutex_destroy(&mutex_->mutex);
-  delete mutex_;
 }
 
 void CriticalSection::Lock() {
-  ::pthread_mutex_lock(&mutex_->mutex);
+  uintptr_t self = GetCurrentThreadTag();
+
+  // Only the owner ever stores its own tag, so a match cannot be stale.
+  if (owner_.load(std::memory_order_relaxed) == self) {
+    ++recursion_;
+    return;
+  }
+
+  mutex_.Lock();
+  owner_.store(self, std::memory_order_relaxed);
+  recursion_ = 1;
 }
 
 bool CriticalSection::TryLock() {
-  return ::pthread_mutex_trylock(&mutex_->mutex) == 0;
+  uintptr_t self = GetCurrentThreadTag();
+
+  if (owner_.load(std::memory_order_relaxed) == self) {
+    ++recursion_;
+    return true;
+  }
+
+  if (!mutex_.TryLock())
+    return false;
+
+  owner_.store(self, std::memory_order_relaxed);
+  recursion_ = 1;
+
+  return true;
 }
 
 void CriticalSection::Unlock() {
-  ::pthread_mutex_unlock(&mutex_->mutex);
+  if (--recursion_ > 0)
+    return;
+
+  owner_.store(0, std::memory_order_relaxed);
+  mutex_.Unlock();
+}
+
+#ifdef MADOKA_LOCK_STATS
+// Recursive entries never reach |mutex_|, so its statistics already count
+// only the outermost ones.
+void CriticalSection::SetName(const char* name) {
+  mutex_.SetName(name);
 }
+#endif  // MADOKA_LOCK_STATS
 
 }  // namespace concurrent
 }  // namespace madoka
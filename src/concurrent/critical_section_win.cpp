@@ -1,6 +1,7 @@
 // Copyright (c) 2013 dacci.org
 
 #include <madoka/concurrent/critical_section.h>
+#include <madoka/concurrent/lock_stats.h>
 
 #include <windows.h>
 
@@ -13,6 +14,11 @@ CriticalSection::CriticalSection() : mutex_(new MutexImpl) {
   ::InitializeCriticalSection(mutex_);
 }
 
+CriticalSection::CriticalSection(uint32_t spin_count)
+    : mutex_(new MutexImpl) {
+  ::InitializeCriticalSectionAndSpinCount(mutex_, spin_count);
+}
+
 CriticalSection::~CriticalSection() {
   ::EnterCriticalSection(mutex_);
   ::DeleteCriticalSection(mutex_);
@@ -20,16 +26,49 @@ CriticalSection::~CriticalSection() {
 }
 
 void CriticalSection::Lock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr) {
+    uint64_t start = 0;
+    if (!::TryEnterCriticalSection(mutex_)) {
+      start = LockStats::Now();
+      ::EnterCriticalSection(mutex_);
+    }
+
+    if (mutex_->RecursionCount == 1)
+      acquired_at_ = stats_->Acquired(start);
+
+    return;
+  }
+#endif  // MADOKA_LOCK_STATS
+
   ::EnterCriticalSection(mutex_);
 }
 
 bool CriticalSection::TryLock() {
-  return ::TryEnterCriticalSection(mutex_) != FALSE;
+  bool acquired = ::TryEnterCriticalSection(mutex_) != FALSE;
+
+#ifdef MADOKA_LOCK_STATS
+  if (acquired && stats_ != nullptr && mutex_->RecursionCount == 1)
+    acquired_at_ = stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return acquired;
 }
 
 void CriticalSection::Unlock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr && mutex_->RecursionCount == 1)
+    stats_->Released(acquired_at_);
+#endif  // MADOKA_LOCK_STATS
+
   ::LeaveCriticalSection(mutex_);
 }
 
+#ifdef MADOKA_LOCK_STATS
+void CriticalSection::SetName(const char* name) {
+  stats_ = LockStats::Get(name);
+}
+#endif  // MADOKA_LOCK_STATS
+
 }  // namespace concurrent
 }  // namespace madoka
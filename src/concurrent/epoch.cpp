@@ -0,0 +1,246 @@
+// Copyright (c) 2016 dacci.org
+
+#include <madoka/concurrent/epoch.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <madoka/concurrent/mutex.h>
+
+#include <atomic>
+
+namespace madoka {
+namespace concurrent {
+
+namespace {
+
+// Objects retired by one thread, freed together.
+struct Bag {
+  static const size_t kCapacity = 64;
+
+  struct Entry {
+    void* object;
+    void (*deleter)(void*);
+  };
+
+  Bag() : size(0), epoch(0), next(nullptr) {
+  }
+
+  ~Bag() {
+    for (size_t i = 0; i < size; ++i)
+      entries[i].deleter(entries[i].object);
+  }
+
+  Entry entries[kCapacity];
+  size_t size;
+  uint64_t epoch;
+  Bag* next;
+};
+
+// The state of one thread. Only the owning thread stores into it; threads
+// advancing the epoch read |state| of every record. Records are never freed,
+// a thread that exits hands its record to the next.
+struct Participant {
+  Participant()
+      : state(0), in_use(true), next(nullptr), depth(0), bag(nullptr) {
+  }
+
+  // The epoch the thread entered in, shifted left by one and with the lowest
+  // bit set, or 0 while it is outside.
+  std::atomic<uint64_t> state;
+  std::atomic<bool> in_use;
+  Participant* next;
+
+  uint32_t depth;
+  Bag* bag;
+};
+
+struct Global {
+  Global() : epoch(0), participants(nullptr), sealed(nullptr) {
+  }
+
+  std::atomic<uint64_t> epoch;
+  std::atomic<Participant*> participants;
+
+  // Guards |sealed|, the bags waiting for the epoch to advance.
+  Mutex lock;
+  Bag* sealed;
+};
+
+Global* GetGlobal() {
+  // Never destroyed, threads may exit during static destruction.
+  static Global* global = new Global();
+  return global;
+}
+
+// Tags |bag| with the current epoch and queues it. The fence orders the
+// unlinking of the objects in it before the epoch is read, so every thread
+// that can still reach them entered in that epoch or earlier.
+void Seal(Bag* bag) {
+  auto global = GetGlobal();
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  bag->epoch = global->epoch.load(std::memory_order_relaxed);
+
+  global->lock.Lock();
+  bag->next = global->sealed;
+  global->sealed = bag;
+  global->lock.Unlock();
+}
+
+// Advances the epoch if every thread inside has entered in the current one,
+// and returns the epoch afterwards.
+uint64_t TryAdvance() {
+  auto global = GetGlobal();
+
+  uint64_t epoch = global->epoch.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  auto head = global->participants.load(std::memory_order_acquire);
+  for (auto record = head; record != nullptr; record = record->next) {
+    uint64_t state = record->state.load(std::memory_order_relaxed);
+    if ((state & 1) != 0 && (state >> 1) != epoch)
+      return epoch;
+  }
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  // Another thread may have advanced it meanwhile, possibly more than once;
+  // storing blindly could move it back.
+  if (global->epoch.compare_exchange_strong(epoch, epoch + 1,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed))
+    ++epoch;
+
+  return epoch;
+}
+
+// Frees the bags sealed at least two epochs before |epoch|. Skipped if
+// another thread is already at it.
+void FreeExpired(uint64_t epoch) {
+  auto global = GetGlobal();
+  if (!global->lock.TryLock())
+    return;
+
+  Bag* expired = nullptr;
+  for (auto link = &global->sealed; *link != nullptr;) {
+    auto bag = *link;
+    if (bag->epoch + 2 <= epoch) {
+      *link = bag->next;
+      bag->next = expired;
+      expired = bag;
+    } else {
+      link = &bag->next;
+    }
+  }
+
+  global->lock.Unlock();
+
+  // Deleters may retire more objects, so they run without the lock.
+  while (expired != nullptr) {
+    auto bag = expired;
+    expired = bag->next;
+    delete bag;
+  }
+}
+
+Participant* ClaimParticipant() {
+  auto global = GetGlobal();
+  auto head = global->participants.load(std::memory_order_acquire);
+
+  for (auto record = head; record != nullptr; record = record->next) {
+    bool in_use = false;
+    if (!record->in_use.load(std::memory_order_relaxed) &&
+        record->in_use.compare_exchange_strong(in_use, true,
+                                               std::memory_order_acquire))
+      return record;
+  }
+
+  auto record = new Participant();
+  record->next = head;
+  while (!global->participants.compare_exchange_weak(
+      record->next, record, std::memory_order_release,
+      std::memory_order_acquire)) {
+  }
+
+  return record;
+}
+
+class ThreadParticipant {
+ public:
+  ThreadParticipant() : record_(ClaimParticipant()) {
+  }
+
+  ~ThreadParticipant() {
+    if (record_->bag != nullptr) {
+      Seal(record_->bag);
+      record_->bag = nullptr;
+    }
+
+    record_->depth = 0;
+    record_->state.store(0, std::memory_order_release);
+    record_->in_use.store(false, std::memory_order_release);
+  }
+
+  Participant* get() const {
+    return record_;
+  }
+
+ private:
+  Participant* const record_;
+};
+
+Participant* GetParticipant() {
+  static thread_local ThreadParticipant owner;
+  return owner.get();
+}
+
+}  // namespace
+
+// The fence orders the published state before any shared node is read; a
+// thread advancing the epoch fences before it reads the state, so one of the
+// two sees the other.
+void Epoch::Enter() {
+  auto self = GetParticipant();
+  if (self->depth++ > 0)
+    return;
+
+  uint64_t epoch = GetGlobal()->epoch.load(std::memory_order_relaxed);
+  self->state.store((epoch << 1) | 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Epoch::Exit() {
+  auto self = GetParticipant();
+  if (--self->depth == 0)
+    self->state.store(0, std::memory_order_release);
+}
+
+void Epoch::Retire(void* object, void (*deleter)(void*)) {
+  auto self = GetParticipant();
+  if (self->bag == nullptr)
+    self->bag = new Bag();
+
+  auto bag = self->bag;
+  bag->entries[bag->size].object = object;
+  bag->entries[bag->size].deleter = deleter;
+
+  if (++bag->size == Bag::kCapacity) {
+    self->bag = nullptr;
+    Seal(bag);
+    FreeExpired(TryAdvance());
+  }
+}
+
+void Epoch::Collect() {
+  auto self = GetParticipant();
+  if (self->bag != nullptr) {
+    Seal(self->bag);
+    self->bag = nullptr;
+  }
+
+  FreeExpired(TryAdvance());
+}
+
+}  // namespace concurrent
+}  // namespace madoka
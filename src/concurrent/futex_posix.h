@@ -0,0 +1,59 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef CONCURRENT_FUTEX_POSIX_H_
+#define CONCURRENT_FUTEX_POSIX_H_
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+namespace madoka {
+namespace concurrent {
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "std::atomic<uint32_t> cannot be used as a futex word");
+
+// Number of times a contended lock polls its word before parking the thread.
+const uint32_t kDefaultSpinCount = 100;
+
+// Blocks while |*word| equals |expected|, until |deadline| on CLOCK_MONOTONIC
+// if it is not null. Returns early on spurious wakeups, so callers always
+// recheck their condition; returns false only if the deadline passed.
+inline bool FutexWait(std::atomic<uint32_t>* word, uint32_t expected,
+                      const timespec* deadline = nullptr) {
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word),
+                 FUTEX_WAIT_BITSET_PRIVATE, expected, deadline, nullptr,
+                 FUTEX_BITSET_MATCH_ANY) == 0 || errno != ETIMEDOUT;
+}
+
+// Wakes up to |count| threads blocked on |word|.
+inline void FutexWake(std::atomic<uint32_t>* word, int count) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE,
+          count, nullptr, nullptr, 0);
+}
+
+inline void FutexWakeAll(std::atomic<uint32_t>* word) {
+  FutexWake(word, INT_MAX);
+}
+
+// Tells the processor the thread is busy-waiting.
+inline void CpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // CONCURRENT_FUTEX_POSIX_H_
@@ -11,26 +11,16 @@ namespace concurrent {
 struct MutexImpl : CRITICAL_SECTION {
 };
 
+// Writers and the holder of the upgrade lock also hold |upgrade|
+// exclusively, so an upgrade or downgrade can briefly let go of the lock
+// itself without any writer getting in.
 struct LockImpl : SRWLOCK {
+  SRWLOCK upgrade;
 };
 
 struct VariableImpl : CONDITION_VARIABLE {
 };
 
-#else   // _WIN32
-
-struct MutexImpl {
-  pthread_mutex_t mutex;
-};
-
-struct LockImpl {
-  pthread_rwlock_t lock;
-};
-
-struct VariableImpl {
-  pthread_cond_t cond;
-};
-
 #endif  // _WIN32
 
 }  // namespace concurrent
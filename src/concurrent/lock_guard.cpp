@@ -3,6 +3,8 @@
 #include <madoka/concurrent/lock_guard.h>
 #include <madoka/concurrent/read_write_lock.h>
 
+#include <assert.h>
+
 namespace madoka {
 namespace concurrent {
 
@@ -23,6 +25,29 @@ LockGuard::LockGuard(ReadWriteLock* rw_lock, bool exclusive)
   }
 }
 
+LockGuard::LockGuard(ReadWriteLock* rw_lock, Mode mode)
+    : lock_(nullptr), rw_lock_(rw_lock), mode_(Invalid) {
+  switch (mode) {
+    case Shared:
+      rw_lock_->AcquireReadLock();
+      break;
+
+    case Upgradable:
+      rw_lock_->AcquireUpgradeLock();
+      break;
+
+    case Exclusive:
+      rw_lock_->AcquireWriteLock();
+      break;
+
+    default:
+      assert(false);
+      return;
+  }
+
+  mode_ = mode;
+}
+
 LockGuard::~LockGuard() {
   switch (mode_) {
     case Generic:
@@ -33,11 +58,29 @@ LockGuard::~LockGuard() {
       rw_lock_->ReleaseReadLock();
       break;
 
+    case Upgradable:
+      rw_lock_->ReleaseUpgradeLock();
+      break;
+
     case Exclusive:
       rw_lock_->ReleaseWriteLock();
       break;
   }
 }
 
+void LockGuard::Upgrade() {
+  assert(mode_ == Upgradable);
+
+  rw_lock_->UpgradeToWriteLock();
+  mode_ = Exclusive;
+}
+
+void LockGuard::Downgrade() {
+  assert(mode_ == Exclusive && rw_lock_ != nullptr);
+
+  rw_lock_->DowngradeToReadLock();
+  mode_ = Shared;
+}
+
 }  // namespace concurrent
 }  // namespace madoka
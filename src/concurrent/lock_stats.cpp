@@ -0,0 +1,112 @@
+// Copyright (c) 2016 dacci.org
+
+#include <madoka/concurrent/lock_stats.h>
+
+#include <madoka/concurrent/lock_guard.h>
+#include <madoka/concurrent/mutex.h>
+
+#include <chrono>
+
+namespace madoka {
+namespace concurrent {
+
+namespace {
+
+struct Registry {
+  Registry() : head(nullptr) {
+  }
+
+  Mutex lock;
+  LockStats* head;
+};
+
+Registry* GetRegistry() {
+  // Never destroyed, locks may be named and used during static destruction.
+  static Registry* registry = new Registry();
+  return registry;
+}
+
+}  // namespace
+
+LockStats::LockStats(const char* name)
+    : name_(name), next_(nullptr), acquisitions_(0), contentions_(0) {
+  for (size_t i = 0; i < kHistogramSize; ++i) {
+    wait_time_[i].store(0, std::memory_order_relaxed);
+    hold_time_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+LockStats* LockStats::Get(const char* name) {
+  auto registry = GetRegistry();
+  LockGuard guard(&registry->lock);
+
+  for (auto stats = registry->head; stats != nullptr; stats = stats->next_) {
+    if (stats->name_ == name)
+      return stats;
+  }
+
+  auto stats = new LockStats(name);
+  stats->next_ = registry->head;
+  registry->head = stats;
+
+  return stats;
+}
+
+std::vector<LockStats::Snapshot> LockStats::GetSnapshot() {
+  std::vector<Snapshot> snapshot;
+
+  auto registry = GetRegistry();
+  LockGuard guard(&registry->lock);
+
+  for (auto stats = registry->head; stats != nullptr; stats = stats->next_) {
+    snapshot.emplace_back();
+    Snapshot& entry = snapshot.back();
+
+    entry.name = stats->name_;
+    entry.acquisitions =
+        stats->acquisitions_.load(std::memory_order_relaxed);
+    entry.contentions = stats->contentions_.load(std::memory_order_relaxed);
+
+    for (size_t i = 0; i < kHistogramSize; ++i) {
+      entry.wait_time[i] =
+          stats->wait_time_[i].load(std::memory_order_relaxed);
+      entry.hold_time[i] =
+          stats->hold_time_[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  return snapshot;
+}
+
+uint64_t LockStats::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t LockStats::Acquired(uint64_t start) {
+  uint64_t now = Now();
+
+  acquisitions_.fetch_add(1, std::memory_order_relaxed);
+
+  if (start != 0) {
+    contentions_.fetch_add(1, std::memory_order_relaxed);
+    Add(wait_time_, now - start);
+  }
+
+  return now;
+}
+
+void LockStats::Released(uint64_t acquired_at) {
+  Add(hold_time_, Now() - acquired_at);
+}
+
+void LockStats::Add(std::atomic<uint64_t>* histogram, uint64_t duration) {
+  size_t index = 0;
+  for (; duration != 0 && index < kHistogramSize - 1; duration >>= 1)
+    ++index;
+
+  histogram[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace concurrent
+}  // namespace madoka
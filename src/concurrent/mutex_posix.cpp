@@ -0,0 +1,112 @@
+// Copyright (c) 2016 dacci.org
+
+#include <madoka/concurrent/mutex.h>
+#include <madoka/concurrent/lock_stats.h>
+
+#include <algorithm>
+
+#include "concurrent/futex_posix.h"
+
+namespace madoka {
+namespace concurrent {
+
+namespace {
+
+enum State : uint32_t {
+  Unlocked,
+  Locked,
+  Contended,  // locked, and other threads may be parked on the word
+};
+
+}  // namespace
+
+Mutex::Mutex() : state_(Unlocked), spins_(0), spin_count_(kDefaultSpinCount) {
+}
+
+Mutex::Mutex(uint32_t spin_count)
+    : state_(Unlocked), spins_(0), spin_count_(spin_count) {
+}
+
+Mutex::~Mutex() {
+}
+
+void Mutex::Lock() {
+  uint32_t expected = Unlocked;
+  bool contended = !state_.compare_exchange_strong(expected, Locked,
+                                                   std::memory_order_acquire,
+                                                   std::memory_order_relaxed);
+
+#ifdef MADOKA_LOCK_STATS
+  uint64_t start = contended && stats_ != nullptr ? LockStats::Now() : 0;
+#endif  // MADOKA_LOCK_STATS
+
+  if (contended)
+    LockSlow();
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    acquired_at_ = stats_->Acquired(start);
+#endif  // MADOKA_LOCK_STATS
+}
+
+bool Mutex::TryLock() {
+  uint32_t expected = Unlocked;
+  bool acquired = state_.compare_exchange_strong(expected, Locked,
+                                                 std::memory_order_acquire,
+                                                 std::memory_order_relaxed);
+
+#ifdef MADOKA_LOCK_STATS
+  if (acquired && stats_ != nullptr)
+    acquired_at_ = stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return acquired;
+}
+
+void Mutex::Unlock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Released(acquired_at_);
+#endif  // MADOKA_LOCK_STATS
+
+  if (state_.exchange(Unlocked, std::memory_order_release) == Contended)
+    FutexWake(&state_, 1);
+}
+
+#ifdef MADOKA_LOCK_STATS
+void Mutex::SetName(const char* name) {
+  stats_ = LockStats::Get(name);
+}
+#endif  // MADOKA_LOCK_STATS
+
+// Spins for about twice as long as recent acquisitions needed, within the
+// budget, and keeps a running average of that in |spins_|.
+void Mutex::LockSlow() {
+  uint32_t average = spins_.load(std::memory_order_relaxed);
+  uint32_t limit = std::min(spin_count_, average * 2 + 10);
+
+  uint32_t count = 0;
+  for (; count < limit; ++count) {
+    CpuRelax();
+
+    uint32_t state = state_.load(std::memory_order_relaxed);
+    if (state == Unlocked &&
+        state_.compare_exchange_weak(state, Locked, std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      break;
+  }
+
+  spins_.store(average + (static_cast<int32_t>(count - average) / 8),
+               std::memory_order_relaxed);
+
+  if (count < limit)
+    return;
+
+  // Whoever wakes up cannot know whether others are still parked, so it
+  // takes the lock as contended and the next Unlock wakes one more.
+  while (state_.exchange(Contended, std::memory_order_acquire) != Unlocked)
+    FutexWait(&state_, Contended);
+}
+
+}  // namespace concurrent
+}  // namespace madoka
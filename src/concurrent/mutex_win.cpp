@@ -0,0 +1,69 @@
+// Copyright (c) 2016 dacci.org
+
+#include <madoka/concurrent/mutex.h>
+#include <madoka/concurrent/lock_stats.h>
+
+#include <windows.h>
+
+namespace madoka {
+namespace concurrent {
+
+static_assert(sizeof(SRWLOCK) == sizeof(void*),
+              "SRWLOCK does not fit into Mutex");
+
+// Slim reader/writer locks spin on their own, so |spin_count| is not used.
+Mutex::Mutex() : lock_(nullptr) {
+}
+
+Mutex::Mutex(uint32_t spin_count) : lock_(nullptr) {
+}
+
+Mutex::~Mutex() {
+}
+
+void Mutex::Lock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr) {
+    uint64_t start = 0;
+    if (!::TryAcquireSRWLockExclusive(reinterpret_cast<PSRWLOCK>(&lock_))) {
+      start = LockStats::Now();
+      ::AcquireSRWLockExclusive(reinterpret_cast<PSRWLOCK>(&lock_));
+    }
+
+    acquired_at_ = stats_->Acquired(start);
+    return;
+  }
+#endif  // MADOKA_LOCK_STATS
+
+  ::AcquireSRWLockExclusive(reinterpret_cast<PSRWLOCK>(&lock_));
+}
+
+bool Mutex::TryLock() {
+  bool acquired =
+      ::TryAcquireSRWLockExclusive(reinterpret_cast<PSRWLOCK>(&lock_)) != 0;
+
+#ifdef MADOKA_LOCK_STATS
+  if (acquired && stats_ != nullptr)
+    acquired_at_ = stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return acquired;
+}
+
+void Mutex::Unlock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Released(acquired_at_);
+#endif  // MADOKA_LOCK_STATS
+
+  ::ReleaseSRWLockExclusive(reinterpret_cast<PSRWLOCK>(&lock_));
+}
+
+#ifdef MADOKA_LOCK_STATS
+void Mutex::SetName(const char* name) {
+  stats_ = LockStats::Get(name);
+}
+#endif  // MADOKA_LOCK_STATS
+
+}  // namespace concurrent
+}  // namespace madoka
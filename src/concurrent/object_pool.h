@@ -0,0 +1,163 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef CONCURRENT_OBJECT_POOL_H_
+#define CONCURRENT_OBJECT_POOL_H_
+
+#include <stddef.h>
+
+#include <madoka/concurrent/critical_section.h>
+#include <madoka/concurrent/lock_guard.h>
+
+#include <new>
+
+namespace madoka {
+namespace concurrent {
+
+// Recycles the storage of T through a free list per thread. Threads that free
+// more than they allocate, typically the ones running completion callbacks,
+// hand the surplus in batches to a shared depot where allocating threads pick
+// it up again. Requests of any other size, such as for types derived from T,
+// go straight to the global allocator.
+template<class T>
+class ObjectPool {
+ public:
+  static void* Allocate(size_t size) {
+    if (size != sizeof(T))
+      return ::operator new(size);
+
+    auto& cache = GetCache();
+    if (cache.head == nullptr)
+      GetDepot()->Take(&cache);
+
+    Block* block = cache.head;
+    if (block == nullptr)
+      return ::operator new(size);
+
+    cache.head = block->next;
+    --cache.count;
+
+    return block;
+  }
+
+  static void Free(void* pointer, size_t size) {
+    if (pointer == nullptr)
+      return;
+
+    if (size != sizeof(T)) {
+      ::operator delete(pointer);
+      return;
+    }
+
+    auto& cache = GetCache();
+    if (cache.count >= kCacheSize)
+      GetDepot()->Give(&cache, kBatchSize);
+
+    auto block = static_cast<Block*>(pointer);
+    block->next = cache.head;
+    cache.head = block;
+    ++cache.count;
+  }
+
+ private:
+  static const size_t kBatchSize = 32;
+  static const size_t kCacheSize = kBatchSize * 2;
+  static const size_t kDepotSize = kBatchSize * 32;
+
+  struct Block {
+    Block* next;
+  };
+
+  static_assert(sizeof(T) >= sizeof(Block), "T is too small to be pooled");
+
+  struct Cache {
+    Cache() : head(nullptr), count(0) {
+    }
+
+    ~Cache() {
+      GetDepot()->Give(this, count);
+    }
+
+    Block* head;
+    size_t count;
+  };
+
+  class Depot {
+   public:
+    Depot() : head_(nullptr), count_(0) {
+    }
+
+    // Moves up to a batch of blocks to |cache|, which must be empty.
+    void Take(Cache* cache) {
+      LockGuard guard(&lock_);
+
+      Block* last = nullptr;
+      for (auto block = head_; block != nullptr && cache->count < kBatchSize;
+           block = block->next) {
+        last = block;
+        ++cache->count;
+      }
+
+      if (last == nullptr)
+        return;
+
+      cache->head = head_;
+      head_ = last->next;
+      last->next = nullptr;
+      count_ -= cache->count;
+    }
+
+    // Moves |count| blocks from |cache|; the ones that do not fit are freed.
+    void Give(Cache* cache, size_t count) {
+      LockGuard guard(&lock_);
+
+      for (; count > 0 && cache->head != nullptr; --count) {
+        Block* block = cache->head;
+        cache->head = block->next;
+        --cache->count;
+
+        if (count_ < kDepotSize) {
+          block->next = head_;
+          head_ = block;
+          ++count_;
+        } else {
+          ::operator delete(block);
+        }
+      }
+    }
+
+   private:
+    CriticalSection lock_;
+    Block* head_;
+    size_t count_;
+  };
+
+  static Cache& GetCache() {
+    static thread_local Cache cache;
+    return cache;
+  }
+
+  static Depot* GetDepot() {
+    // Never destroyed, threads may exit after the static destructors ran.
+    static Depot* depot = new Depot();
+    return depot;
+  }
+};
+
+// Routes the allocations of the deriving type T through ObjectPool<T>. Types
+// deleted through a pointer to a base need a virtual destructor so the sized
+// operator delete sees the real size.
+template<class T>
+struct PooledObject {
+  static void* operator new(size_t size) {
+    return ObjectPool<T>::Allocate(size);
+  }
+
+  static void operator delete(void* pointer, size_t size) {
+    ObjectPool<T>::Free(pointer, size);
+  }
+};
+
+}  // namespace concurrent
+}  // namespace madoka
+
+#endif  // CONCURRENT_OBJECT_POOL_H_
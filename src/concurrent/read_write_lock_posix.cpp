@@ -1,45 +1,741 @@
 // Copyright (c) 2014 dacci.org
 
 #include <madoka/concurrent/read_write_lock.h>
+#include <madoka/concurrent/lock_guard.h>
+#include <madoka/concurrent/lock_stats.h>
 
-#include <pthread.h>
+#include <chrono>
+#include <thread>
 
-#include "concurrent/internals.h"
+#include "concurrent/futex_posix.h"
 
 namespace madoka {
 namespace concurrent {
 
-ReadWriteLock::ReadWriteLock() : lock_(new LockImpl) {
-  lock_->lock = PTHREAD_RWLOCK_INITIALIZER;
+namespace {
+
+// Bits of ReadWriteLock::state_.
+const uint32_t kReaderMask = 0x1FFFFFFF;
+const uint32_t kUpgrader = 0x20000000;
+const uint32_t kWaiters = 0x40000000;
+const uint32_t kWriter = 0x80000000;
+
+// How many times longer than the last revocation took the bias stays off.
+const uint64_t kInhibitFactor = 9;
+
+// The read locks a thread holds through the bias. Only the owning thread
+// stores into the slots; writers revoking the bias scan every record. Nested
+// read locks of the same lock share one slot and are counted, so a thread
+// that already reads a lock never queues behind a writer waiting for it.
+// Records are never freed, a thread that exits hands its record to the next.
+struct ReaderSlots {
+  static const size_t kSlotCount = 8;
+
+  ReaderSlots() : in_use(true), next(nullptr) {
+    for (size_t i = 0; i < kSlotCount; ++i) {
+      slots[i].store(nullptr, std::memory_order_relaxed);
+      counts[i] = 0;
+    }
+  }
+
+  std::atomic<const ReadWriteLock*> slots[kSlotCount];
+  uint32_t counts[kSlotCount];
+  std::atomic<bool> in_use;
+  ReaderSlots* next;
+};
+
+std::atomic<ReaderSlots*> reader_slots(nullptr);
+
+ReaderSlots* ClaimReaderSlots() {
+  auto head = reader_slots.load(std::memory_order_acquire);
+
+  for (auto record = head; record != nullptr; record = record->next) {
+    bool in_use = false;
+    if (!record->in_use.load(std::memory_order_relaxed) &&
+        record->in_use.compare_exchange_strong(in_use, true,
+                                               std::memory_order_acquire))
+      return record;
+  }
+
+  auto record = new ReaderSlots();
+  record->next = head;
+  while (!reader_slots.compare_exchange_weak(record->next, record,
+                                             std::memory_order_release,
+                                             std::memory_order_acquire)) {
+  }
+
+  return record;
+}
+
+class ThreadReaderSlots {
+ public:
+  ThreadReaderSlots() : record_(ClaimReaderSlots()) {
+  }
+
+  ~ThreadReaderSlots() {
+    record_->in_use.store(false, std::memory_order_release);
+  }
+
+  ReaderSlots* get() const {
+    return record_;
+  }
+
+ private:
+  ReaderSlots* const record_;
+};
+
+// Returns the record of the calling thread, or nullptr if it has none yet and
+// |create| is false.
+ReaderSlots* GetReaderSlots(bool create) {
+  static thread_local ReaderSlots* current = nullptr;
+
+  if (current == nullptr && create) {
+    static thread_local ThreadReaderSlots owner;
+    current = owner.get();
+  }
+
+  return current;
+}
+
+uint64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+ReadWriteLock::ReadWriteLock()
+    : state_(0),
+      waiting_readers_(0),
+      waiting_writers_(0),
+      waiting_upgraders_(0),
+      upgrade_pending_(false),
+      reader_sequence_(0),
+      writer_sequence_(0),
+      upgrade_sequence_(0),
+      policy_(PreferReaders),
+      reader_biased_(false),
+      biased_(false),
+      inhibit_until_(0) {
+}
+
+ReadWriteLock::ReadWriteLock(bool reader_biased)
+    : state_(0),
+      waiting_readers_(0),
+      waiting_writers_(0),
+      waiting_upgraders_(0),
+      upgrade_pending_(false),
+      reader_sequence_(0),
+      writer_sequence_(0),
+      upgrade_sequence_(0),
+      policy_(PreferReaders),
+      reader_biased_(reader_biased),
+      biased_(reader_biased),
+      inhibit_until_(0) {
+}
+
+ReadWriteLock::ReadWriteLock(Policy policy, bool reader_biased)
+    : state_(0),
+      waiting_readers_(0),
+      waiting_writers_(0),
+      waiting_upgraders_(0),
+      upgrade_pending_(false),
+      reader_sequence_(0),
+      writer_sequence_(0),
+      upgrade_sequence_(0),
+      policy_(policy),
+      reader_biased_(reader_biased),
+      biased_(reader_biased),
+      inhibit_until_(0) {
 }
 
 ReadWriteLock::~ReadWriteLock() {
-  ::pthread_rwlock_destroy(&lock_->lock);
-  delete lock_;
 }
 
 void ReadWriteLock::AcquireReadLock() {
-  ::pthread_rwlock_rdlock(&lock_->lock);
+  if (reader_biased_ && TryAcquireBiased()) {
+#ifdef MADOKA_LOCK_STATS
+    if (stats_ != nullptr)
+      stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+    return;
+  }
+
+  bool contended = !TryAcquireShared();
+
+#ifdef MADOKA_LOCK_STATS
+  uint64_t start = contended && stats_ != nullptr ? LockStats::Now() : 0;
+#endif  // MADOKA_LOCK_STATS
+
+  if (contended)
+    AcquireSharedSlow();
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Acquired(start);
+#endif  // MADOKA_LOCK_STATS
+
+  // No writer can be revoking while a read lock is held. Releasing the bias
+  // passes on what the last writer published to the readers that take the
+  // fast path through it.
+  if (reader_biased_ && !biased_.load(std::memory_order_relaxed) &&
+      Now() >= inhibit_until_.load(std::memory_order_relaxed))
+    biased_.store(true, std::memory_order_release);
 }
 
 bool ReadWriteLock::TryAcquireReadLock() {
-  return ::pthread_rwlock_tryrdlock(&lock_->lock) == 0;
+  bool acquired = (reader_biased_ && TryAcquireBiased()) || TryAcquireShared();
+  if (!acquired) {
+    LockGuard guard(&wait_lock_);
+    acquired = EnterShared();
+  }
+
+#ifdef MADOKA_LOCK_STATS
+  if (acquired && stats_ != nullptr)
+    stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return acquired;
 }
 
 void ReadWriteLock::ReleaseReadLock() {
-  ::pthread_rwlock_unlock(&lock_->lock);
+  if (reader_biased_ && ReleaseBiased())
+    return;
+
+  uint32_t state = state_.fetch_sub(1, std::memory_order_release);
+  if ((state & kWaiters) != 0 && (state & kReaderMask) == 1) {
+    LockGuard guard(&wait_lock_);
+    WakeWaiters(false);
+  }
 }
 
 void ReadWriteLock::AcquireWriteLock() {
-  ::pthread_rwlock_wrlock(&lock_->lock);
+  uint32_t expected = 0;
+  bool contended = !state_.compare_exchange_strong(expected, kWriter,
+                                                   std::memory_order_acquire,
+                                                   std::memory_order_relaxed);
+
+#ifdef MADOKA_LOCK_STATS
+  uint64_t start = contended && stats_ != nullptr ? LockStats::Now() : 0;
+#endif  // MADOKA_LOCK_STATS
+
+  if (contended)
+    AcquireExclusiveSlow();
+
+  RevokeBias();
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    acquired_at_ = stats_->Acquired(start);
+#endif  // MADOKA_LOCK_STATS
 }
 
 bool ReadWriteLock::TryAcquireWriteLock() {
-  return ::pthread_rwlock_trywrlock(&lock_->lock) == 0;
+  // Takes a free lock even if others wait for it; waiting readers that were
+  // already admitted are counted in |state_|, so they are never overtaken.
+  uint32_t state = state_.load(std::memory_order_relaxed);
+  do {
+    if ((state & (kWriter | kUpgrader | kReaderMask)) != 0)
+      return false;
+  } while (!state_.compare_exchange_weak(state, state | kWriter,
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed));
+
+  if (biased_.load(std::memory_order_relaxed)) {
+    // Waiting for biased readers would block, so only proceed if there are
+    // none; readers that saw the bias cleared queue on the lock meanwhile.
+    biased_.store(false);
+
+    for (auto record = reader_slots.load(std::memory_order_acquire);
+         record != nullptr; record = record->next) {
+      for (auto& slot : record->slots) {
+        if (slot.load() == this) {
+          biased_.store(true, std::memory_order_release);
+          ReleaseExclusive();
+          return false;
+        }
+      }
+    }
+  }
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    acquired_at_ = stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return true;
 }
 
 void ReadWriteLock::ReleaseWriteLock() {
-  ::pthread_rwlock_unlock(&lock_->lock);
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Released(acquired_at_);
+#endif  // MADOKA_LOCK_STATS
+
+  ReleaseExclusive();
+}
+
+void ReadWriteLock::AcquireUpgradeLock() {
+  bool contended = !TryAcquireUpgrade();
+
+#ifdef MADOKA_LOCK_STATS
+  uint64_t start = contended && stats_ != nullptr ? LockStats::Now() : 0;
+#endif  // MADOKA_LOCK_STATS
+
+  if (contended)
+    AcquireUpgradeSlow();
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Acquired(start);
+#endif  // MADOKA_LOCK_STATS
+}
+
+bool ReadWriteLock::TryAcquireUpgradeLock() {
+  bool acquired = TryAcquireUpgrade();
+  if (!acquired) {
+    LockGuard guard(&wait_lock_);
+    acquired = EnterUpgrade();
+  }
+
+#ifdef MADOKA_LOCK_STATS
+  if (acquired && stats_ != nullptr)
+    stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return acquired;
+}
+
+void ReadWriteLock::ReleaseUpgradeLock() {
+  uint32_t state = state_.load(std::memory_order_relaxed);
+  while ((state & kWaiters) == 0) {
+    if (state_.compare_exchange_weak(state, state & ~kUpgrader,
+                                     std::memory_order_release,
+                                     std::memory_order_relaxed))
+      return;
+  }
+
+  LockGuard guard(&wait_lock_);
+  state_.fetch_and(~kUpgrader, std::memory_order_release);
+  WakeWaiters(false);
+}
+
+void ReadWriteLock::UpgradeToWriteLock() {
+  uint32_t expected = kUpgrader;
+  if (!state_.compare_exchange_strong(expected, kWriter,
+                                      std::memory_order_acquire,
+                                      std::memory_order_relaxed))
+    UpgradeSlow();
+
+  RevokeBias();
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    acquired_at_ = LockStats::Now();
+#endif  // MADOKA_LOCK_STATS
+}
+
+void ReadWriteLock::DowngradeToReadLock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Released(acquired_at_);
+#endif  // MADOKA_LOCK_STATS
+
+  uint32_t expected = kWriter;
+  if (state_.compare_exchange_strong(expected, 1, std::memory_order_release,
+                                     std::memory_order_relaxed))
+    return;
+
+  LockGuard guard(&wait_lock_);
+
+  // Holding the write lock with kWaiters set, nobody else changes |state_|
+  // without |wait_lock_|.
+  uint32_t readers = 1;
+  bool admit = waiting_readers_ > 0 &&
+               (policy_ != PreferWriters || waiting_writers_ == 0);
+  if (admit) {
+    readers += waiting_readers_;
+    waiting_readers_ = 0;
+  }
+
+  state_.store(readers | (HasWaiters() ? kWaiters : 0),
+               std::memory_order_release);
+
+  if (admit) {
+    reader_sequence_.fetch_add(1, std::memory_order_relaxed);
+    FutexWakeAll(&reader_sequence_);
+  }
+
+  if (waiting_upgraders_ > 0) {
+    upgrade_sequence_.fetch_add(1, std::memory_order_relaxed);
+    FutexWakeAll(&upgrade_sequence_);
+  }
+}
+
+#ifdef MADOKA_LOCK_STATS
+void ReadWriteLock::SetName(const char* name) {
+  stats_ = LockStats::Get(name);
+}
+#endif  // MADOKA_LOCK_STATS
+
+// The following are called with |wait_lock_| held. They tell whether a new
+// reader or upgrader may enter the lock in |state| under the policy, and
+// whether any thread sleeps in a slow path.
+bool ReadWriteLock::MayEnterShared(uint32_t state) const {
+  if ((state & kWriter) != 0 || upgrade_pending_)
+    return false;
+
+  return policy_ == PreferReaders || waiting_writers_ == 0;
+}
+
+bool ReadWriteLock::MayEnterUpgrade(uint32_t state) const {
+  if ((state & (kWriter | kUpgrader)) != 0)
+    return false;
+
+  return policy_ == PreferReaders || waiting_writers_ == 0;
+}
+
+bool ReadWriteLock::HasWaiters() const {
+  return waiting_readers_ > 0 || waiting_writers_ > 0 ||
+         waiting_upgraders_ > 0 || upgrade_pending_;
+}
+
+// Takes a read lock without waiting if no writer holds it and nobody waits.
+bool ReadWriteLock::TryAcquireShared() {
+  uint32_t state = state_.load(std::memory_order_relaxed);
+  while ((state & (kWriter | kWaiters)) == 0) {
+    if (state_.compare_exchange_weak(state, state + 1,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      return true;
+  }
+
+  return false;
+}
+
+// Called with |wait_lock_| held. Takes a read lock if the policy lets a new
+// reader in now.
+bool ReadWriteLock::EnterShared() {
+  uint32_t state = state_.load(std::memory_order_relaxed);
+
+  while (MayEnterShared(state)) {
+    if (state_.compare_exchange_weak(state, state + 1,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      return true;
+  }
+
+  return false;
+}
+
+// Waiting threads set kWaiters with a compare-and-swap against the state
+// they decided on, so the thread that releases the lock in that state is
+// certain to see them and takes the slow path to wake them.
+void ReadWriteLock::AcquireSharedSlow() {
+  wait_lock_.Lock();
+
+  for (;;) {
+    if (EnterShared())
+      break;
+
+    uint32_t state = state_.load(std::memory_order_relaxed);
+    if (MayEnterShared(state))
+      continue;
+
+    if (!state_.compare_exchange_weak(state, state | kWaiters,
+                                      std::memory_order_relaxed))
+      continue;
+
+    ++waiting_readers_;
+
+    // Waiting readers are only ever let in as a group by WakeWaiters, which
+    // counts them as holders before bumping the sequence.
+    uint32_t sequence = reader_sequence_.load(std::memory_order_relaxed);
+    do {
+      wait_lock_.Unlock();
+      FutexWait(&reader_sequence_, sequence);
+      wait_lock_.Lock();
+    } while (reader_sequence_.load(std::memory_order_relaxed) == sequence);
+
+    break;
+  }
+
+  wait_lock_.Unlock();
+}
+
+// Takes the upgrade lock without waiting if nobody holds it, no writer holds
+// the lock and nobody waits.
+bool ReadWriteLock::TryAcquireUpgrade() {
+  uint32_t state = state_.load(std::memory_order_relaxed);
+  while ((state & (kWriter | kUpgrader | kWaiters)) == 0) {
+    if (state_.compare_exchange_weak(state, state | kUpgrader,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      return true;
+  }
+
+  return false;
+}
+
+// Called with |wait_lock_| held. Takes the upgrade lock if the policy lets a
+// new upgrader in now.
+bool ReadWriteLock::EnterUpgrade() {
+  uint32_t state = state_.load(std::memory_order_relaxed);
+
+  while (MayEnterUpgrade(state)) {
+    if (state_.compare_exchange_weak(state, state | kUpgrader,
+                                     std::memory_order_acquire,
+                                     std::memory_order_relaxed))
+      return true;
+  }
+
+  return false;
+}
+
+// Waiting upgraders are all woken whenever the upgrade lock may have become
+// free and race for it; there is only ever one holder to wait for.
+void ReadWriteLock::AcquireUpgradeSlow() {
+  wait_lock_.Lock();
+
+  bool waited = false;
+  for (;;) {
+    if (EnterUpgrade())
+      break;
+
+    uint32_t state = state_.load(std::memory_order_relaxed);
+    if (MayEnterUpgrade(state))
+      continue;
+
+    if (!state_.compare_exchange_weak(state, state | kWaiters,
+                                      std::memory_order_relaxed))
+      continue;
+
+    if (!waited) {
+      ++waiting_upgraders_;
+      waited = true;
+    }
+
+    uint32_t sequence = upgrade_sequence_.load(std::memory_order_relaxed);
+    wait_lock_.Unlock();
+    FutexWait(&upgrade_sequence_, sequence);
+    wait_lock_.Lock();
+  }
+
+  if (waited) {
+    --waiting_upgraders_;
+    if (!HasWaiters())
+      state_.fetch_and(~kWaiters, std::memory_order_relaxed);
+  }
+
+  wait_lock_.Unlock();
+}
+
+// Keeps kWaiters set while the upgrade is pending, so new readers take the
+// slow path and queue, and the last reader to leave wakes the upgrader.
+void ReadWriteLock::UpgradeSlow() {
+  wait_lock_.Lock();
+
+  upgrade_pending_ = true;
+
+  for (;;) {
+    uint32_t state = state_.load(std::memory_order_relaxed);
+
+    if ((state & kReaderMask) == 0) {
+      if (state_.compare_exchange_weak(state, (state & ~kUpgrader) | kWriter,
+                                       std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+        break;
+
+      continue;
+    }
+
+    if (!state_.compare_exchange_weak(state, state | kWaiters,
+                                      std::memory_order_relaxed))
+      continue;
+
+    uint32_t sequence = upgrade_sequence_.load(std::memory_order_relaxed);
+    wait_lock_.Unlock();
+    FutexWait(&upgrade_sequence_, sequence);
+    wait_lock_.Lock();
+  }
+
+  upgrade_pending_ = false;
+  if (!HasWaiters())
+    state_.fetch_and(~kWaiters, std::memory_order_relaxed);
+
+  wait_lock_.Unlock();
+}
+
+void ReadWriteLock::AcquireExclusiveSlow() {
+  wait_lock_.Lock();
+
+  ++waiting_writers_;
+
+  for (;;) {
+    uint32_t state = state_.load(std::memory_order_relaxed);
+
+    if ((state & (kWriter | kUpgrader | kReaderMask)) == 0) {
+      if (state_.compare_exchange_weak(state, state | kWriter,
+                                       std::memory_order_acquire,
+                                       std::memory_order_relaxed))
+        break;
+
+      continue;
+    }
+
+    if (!state_.compare_exchange_weak(state, state | kWaiters,
+                                      std::memory_order_relaxed))
+      continue;
+
+    uint32_t sequence = writer_sequence_.load(std::memory_order_relaxed);
+    wait_lock_.Unlock();
+    FutexWait(&writer_sequence_, sequence);
+    wait_lock_.Lock();
+  }
+
+  --waiting_writers_;
+  if (!HasWaiters())
+    state_.fetch_and(~kWaiters, std::memory_order_relaxed);
+
+  wait_lock_.Unlock();
+}
+
+void ReadWriteLock::ReleaseExclusive() {
+  uint32_t expected = kWriter;
+  if (state_.compare_exchange_strong(expected, 0, std::memory_order_release,
+                                     std::memory_order_relaxed))
+    return;
+
+  LockGuard guard(&wait_lock_);
+  state_.fetch_and(~kWriter, std::memory_order_release);
+  WakeWaiters(true);
+}
+
+// Called with |wait_lock_| held when the lock may have become free. A
+// pending upgrade goes first, as it holds out every writer. Otherwise either
+// admits every waiting reader at once or wakes one waiting writer to race for
+// the lock; |writer_left| tells whether the last holder was a writer. Waiting
+// upgraders are woken as well if the upgrade lock is free.
+void ReadWriteLock::WakeWaiters(bool writer_left) {
+  if (upgrade_pending_) {
+    if ((state_.load(std::memory_order_relaxed) & kReaderMask) == 0) {
+      upgrade_sequence_.fetch_add(1, std::memory_order_relaxed);
+      FutexWakeAll(&upgrade_sequence_);
+    }
+
+    return;
+  }
+
+  bool readers_first =
+      waiting_readers_ > 0 &&
+      (waiting_writers_ == 0 || (writer_left && policy_ != PreferWriters));
+
+  if (readers_first) {
+    uint32_t state = state_.load(std::memory_order_relaxed);
+    uint32_t waiters =
+        waiting_writers_ > 0 || waiting_upgraders_ > 0 ? kWaiters : 0;
+
+    // Someone who took the lock in the meantime wakes them on release.
+    while ((state & (kWriter | kReaderMask)) == 0) {
+      if (state_.compare_exchange_weak(
+              state, (state & ~kWaiters) + waiting_readers_ + waiters,
+              std::memory_order_release, std::memory_order_relaxed)) {
+        waiting_readers_ = 0;
+        reader_sequence_.fetch_add(1, std::memory_order_relaxed);
+        FutexWakeAll(&reader_sequence_);
+        break;
+      }
+    }
+  } else if (waiting_writers_ > 0) {
+    if ((state_.load(std::memory_order_relaxed) &
+         (kWriter | kUpgrader | kReaderMask)) == 0) {
+      writer_sequence_.fetch_add(1, std::memory_order_relaxed);
+      FutexWake(&writer_sequence_, 1);
+    }
+  }
+
+  if (waiting_upgraders_ > 0 &&
+      (state_.load(std::memory_order_relaxed) & (kWriter | kUpgrader)) == 0) {
+    upgrade_sequence_.fetch_add(1, std::memory_order_relaxed);
+    FutexWakeAll(&upgrade_sequence_);
+  }
+}
+
+// The slot is published before the bias is checked again, and a revoking
+// writer clears the bias before it scans the slots; both sides use
+// sequentially consistent accesses, so at least one of them sees the other.
+bool ReadWriteLock::TryAcquireBiased() {
+  auto record = GetReaderSlots(true);
+  size_t index = ReaderSlots::kSlotCount;
+
+  for (size_t i = 0; i < ReaderSlots::kSlotCount; ++i) {
+    auto lock = record->slots[i].load(std::memory_order_relaxed);
+    if (lock == this) {
+      ++record->counts[i];
+      return true;
+    }
+
+    if (lock == nullptr && index == ReaderSlots::kSlotCount)
+      index = i;
+  }
+
+  if (index == ReaderSlots::kSlotCount ||
+      !biased_.load(std::memory_order_relaxed))
+    return false;
+
+  record->slots[index].store(this);
+  if (biased_.load()) {
+    record->counts[index] = 1;
+    return true;
+  }
+
+  record->slots[index].store(nullptr, std::memory_order_release);
+
+  return false;
+}
+
+bool ReadWriteLock::ReleaseBiased() {
+  auto record = GetReaderSlots(false);
+  if (record == nullptr)
+    return false;
+
+  for (size_t i = 0; i < ReaderSlots::kSlotCount; ++i) {
+    if (record->slots[i].load(std::memory_order_relaxed) == this) {
+      if (--record->counts[i] == 0)
+        record->slots[i].store(nullptr, std::memory_order_release);
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Called with the write lock held.
+void ReadWriteLock::RevokeBias() {
+  if (!biased_.load(std::memory_order_relaxed))
+    return;
+
+  biased_.store(false);
+
+  uint64_t start = Now();
+
+  for (auto record = reader_slots.load(std::memory_order_acquire);
+       record != nullptr; record = record->next) {
+    for (auto& slot : record->slots) {
+      for (int spins = 0; slot.load() == this; ++spins) {
+        if (spins < 100)
+          CpuRelax();
+        else
+          std::this_thread::yield();
+      }
+    }
+  }
+
+  uint64_t now = Now();
+  inhibit_until_.store(now + (now - start) * kInhibitFactor,
+                       std::memory_order_relaxed);
 }
 
 }  // namespace concurrent
@@ -1,6 +1,7 @@
 // Copyright (c) 2014 dacci.org
 
 #include <madoka/concurrent/read_write_lock.h>
+#include <madoka/concurrent/lock_stats.h>
 
 #include <windows.h>
 
@@ -11,6 +12,18 @@ namespace concurrent {
 
 ReadWriteLock::ReadWriteLock() : lock_(new LockImpl) {
   ::InitializeSRWLock(lock_);
+  ::InitializeSRWLock(&lock_->upgrade);
+}
+
+ReadWriteLock::ReadWriteLock(bool reader_biased) : lock_(new LockImpl) {
+  ::InitializeSRWLock(lock_);
+  ::InitializeSRWLock(&lock_->upgrade);
+}
+
+ReadWriteLock::ReadWriteLock(Policy policy, bool reader_biased)
+    : lock_(new LockImpl) {
+  ::InitializeSRWLock(lock_);
+  ::InitializeSRWLock(&lock_->upgrade);
 }
 
 ReadWriteLock::~ReadWriteLock() {
@@ -18,11 +31,31 @@ ReadWriteLock::~ReadWriteLock() {
 }
 
 void ReadWriteLock::AcquireReadLock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr) {
+    uint64_t start = 0;
+    if (!::TryAcquireSRWLockShared(lock_)) {
+      start = LockStats::Now();
+      ::AcquireSRWLockShared(lock_);
+    }
+
+    stats_->Acquired(start);
+    return;
+  }
+#endif  // MADOKA_LOCK_STATS
+
   ::AcquireSRWLockShared(lock_);
 }
 
 bool ReadWriteLock::TryAcquireReadLock() {
-  return ::TryAcquireSRWLockShared(lock_) != 0;
+  bool acquired = ::TryAcquireSRWLockShared(lock_) != 0;
+
+#ifdef MADOKA_LOCK_STATS
+  if (acquired && stats_ != nullptr)
+    stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return acquired;
 }
 
 void ReadWriteLock::ReleaseReadLock() {
@@ -30,16 +63,119 @@ void ReadWriteLock::ReleaseReadLock() {
 }
 
 void ReadWriteLock::AcquireWriteLock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr) {
+    uint64_t start = 0;
+    if (!TryAcquireWriteLock()) {
+      start = LockStats::Now();
+      ::AcquireSRWLockExclusive(&lock_->upgrade);
+      ::AcquireSRWLockExclusive(lock_);
+      acquired_at_ = stats_->Acquired(start);
+    }
+
+    return;
+  }
+#endif  // MADOKA_LOCK_STATS
+
+  ::AcquireSRWLockExclusive(&lock_->upgrade);
   ::AcquireSRWLockExclusive(lock_);
 }
 
 bool ReadWriteLock::TryAcquireWriteLock() {
-  return ::TryAcquireSRWLockExclusive(lock_) != 0;
+  if (!::TryAcquireSRWLockExclusive(&lock_->upgrade))
+    return false;
+
+  if (!::TryAcquireSRWLockExclusive(lock_)) {
+    ::ReleaseSRWLockExclusive(&lock_->upgrade);
+    return false;
+  }
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    acquired_at_ = stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return true;
 }
 
 void ReadWriteLock::ReleaseWriteLock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Released(acquired_at_);
+#endif  // MADOKA_LOCK_STATS
+
   ::ReleaseSRWLockExclusive(lock_);
+  ::ReleaseSRWLockExclusive(&lock_->upgrade);
+}
+
+void ReadWriteLock::AcquireUpgradeLock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr) {
+    uint64_t start = 0;
+    if (!TryAcquireUpgradeLock()) {
+      start = LockStats::Now();
+      ::AcquireSRWLockExclusive(&lock_->upgrade);
+      ::AcquireSRWLockShared(lock_);
+      stats_->Acquired(start);
+    }
+
+    return;
+  }
+#endif  // MADOKA_LOCK_STATS
+
+  ::AcquireSRWLockExclusive(&lock_->upgrade);
+  ::AcquireSRWLockShared(lock_);
+}
+
+bool ReadWriteLock::TryAcquireUpgradeLock() {
+  if (!::TryAcquireSRWLockExclusive(&lock_->upgrade))
+    return false;
+
+  if (!::TryAcquireSRWLockShared(lock_)) {
+    ::ReleaseSRWLockExclusive(&lock_->upgrade);
+    return false;
+  }
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Acquired(0);
+#endif  // MADOKA_LOCK_STATS
+
+  return true;
+}
+
+void ReadWriteLock::ReleaseUpgradeLock() {
+  ::ReleaseSRWLockShared(lock_);
+  ::ReleaseSRWLockExclusive(&lock_->upgrade);
+}
+
+// Readers may slip in between, but no writer can without |upgrade|.
+void ReadWriteLock::UpgradeToWriteLock() {
+  ::ReleaseSRWLockShared(lock_);
+  ::AcquireSRWLockExclusive(lock_);
+
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    acquired_at_ = LockStats::Now();
+#endif  // MADOKA_LOCK_STATS
+}
+
+void ReadWriteLock::DowngradeToReadLock() {
+#ifdef MADOKA_LOCK_STATS
+  if (stats_ != nullptr)
+    stats_->Released(acquired_at_);
+#endif  // MADOKA_LOCK_STATS
+
+  ::ReleaseSRWLockExclusive(lock_);
+  ::AcquireSRWLockShared(lock_);
+  ::ReleaseSRWLockExclusive(&lock_->upgrade);
+}
+
+#ifdef MADOKA_LOCK_STATS
+void ReadWriteLock::SetName(const char* name) {
+  stats_ = LockStats::Get(name);
 }
+#endif  // MADOKA_LOCK_STATS
 
 }  // namespace concurrent
 }  // namespace madoka
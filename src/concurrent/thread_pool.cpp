@@ -0,0 +1,345 @@
+// Copyright (c) 2016 dacci.org
+
+#include <madoka/concurrent/thread_pool.h>
+
+#include <madoka/concurrent/condition_variable.h>
+#include <madoka/concurrent/lock_guard.h>
+#include <madoka/concurrent/mutex.h>
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+namespace madoka {
+namespace concurrent {
+
+namespace {
+
+typedef ThreadPool::Task Task;
+
+// A Chase-Lev deque: the owning thread pushes and pops at the bottom without
+// contention, thieves take from the top, and only a race for the last task
+// costs a compare-and-swap. The buffer grows as needed; thieves may still be
+// reading a replaced one, so those are kept until the deque is destroyed.
+class WorkDeque {
+ public:
+  WorkDeque() : top_(0), bottom_(0), buffer_(new Buffer(kInitialCapacity)) {
+  }
+
+  ~WorkDeque() {
+    delete buffer_.load(std::memory_order_relaxed);
+  }
+
+  void Push(Task* task) {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    int64_t top = top_.load(std::memory_order_acquire);
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+
+    if (bottom - top >= static_cast<int64_t>(buffer->capacity))
+      buffer = Grow(buffer, top, bottom);
+
+    buffer->Put(bottom, task);
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  // Called by the owner only.
+  Task* Pop() {
+    int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_seq_cst);
+
+    if (top > bottom) {
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Task* task = buffer->Get(bottom);
+    if (top == bottom) {
+      // The last task; a thief may be taking it right now.
+      if (!top_.compare_exchange_strong(top, top + 1,
+                                        std::memory_order_seq_cst,
+                                        std::memory_order_relaxed))
+        task = nullptr;
+
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    return task;
+  }
+
+  // May fail when racing with another thief even if tasks remain.
+  Task* Steal() {
+    int64_t top = top_.load(std::memory_order_seq_cst);
+    int64_t bottom = bottom_.load(std::memory_order_seq_cst);
+    if (top >= bottom)
+      return nullptr;
+
+    Task* task = buffer_.load(std::memory_order_acquire)->Get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+      return nullptr;
+
+    return task;
+  }
+
+  size_t size() const {
+    int64_t bottom = bottom_.load(std::memory_order_seq_cst);
+    int64_t top = top_.load(std::memory_order_seq_cst);
+    return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+  }
+
+ private:
+  static const size_t kInitialCapacity = 64;
+
+  // The slots are atomic only so a thief may read one the owner is
+  // overwriting; it then loses the race for |top_| and discards what it read.
+  struct Buffer {
+    explicit Buffer(size_t capacity)
+        : capacity(capacity), slots(new std::atomic<Task*>[capacity]) {
+    }
+
+    Task* Get(int64_t index) const {
+      return slots[index & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+
+    void Put(int64_t index, Task* task) {
+      slots[index & (capacity - 1)].store(task, std::memory_order_relaxed);
+    }
+
+    const size_t capacity;
+    std::unique_ptr<std::atomic<Task*>[]> slots;
+  };
+
+  Buffer* Grow(Buffer* buffer, int64_t top, int64_t bottom) {
+    auto grown = new Buffer(buffer->capacity * 2);
+    for (int64_t i = top; i < bottom; ++i)
+      grown->Put(i, buffer->Get(i));
+
+    retired_.emplace_back(buffer);
+    buffer_.store(grown, std::memory_order_release);
+
+    return grown;
+  }
+
+  std::atomic<int64_t> top_;
+  std::atomic<int64_t> bottom_;
+  std::atomic<Buffer*> buffer_;
+  std::vector<std::unique_ptr<Buffer>> retired_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(WorkDeque);
+};
+
+thread_local ThreadPoolWorker* current_worker = nullptr;
+
+}  // namespace
+
+struct ThreadPoolWorker {
+  explicit ThreadPoolWorker(ThreadPool* pool)
+      : pool(pool), victim(0), sleeping(false), notified(false) {
+  }
+
+  ThreadPool* const pool;
+
+  WorkDeque deque;
+
+  // Where the worker starts looking for tasks to steal next time.
+  size_t victim;
+
+  // Submissions from threads outside the pool. Popping is serialized by
+  // |inbox_lock|, which thieves only ever try to take.
+  MpscQueue<Task> inbox;
+  Mutex inbox_lock;
+
+  // Set while the worker is parked or about to be; whoever clears it owes
+  // the worker a notification.
+  std::atomic<bool> sleeping;
+  Mutex park_lock;
+  ConditionVariable park;
+  bool notified;
+
+  std::thread thread;
+};
+
+ThreadPool::ThreadPool(int threads) : next_(0), sleepers_(0), stopping_(false) {
+  threads = std::max(threads, 1);
+
+  for (int i = 0; i < threads; ++i)
+    workers_.push_back(new ThreadPoolWorker(this));
+
+  for (auto worker : workers_)
+    worker->thread = std::thread(&ThreadPool::Run, this, worker);
+}
+
+ThreadPool::~ThreadPool() {
+  stopping_.store(true, std::memory_order_seq_cst);
+
+  for (auto worker : workers_) {
+    LockGuard guard(&worker->park_lock);
+    worker->notified = true;
+    worker->park.Wake();
+  }
+
+  // The others may still be stealing from a worker that has stopped.
+  for (auto worker : workers_)
+    worker->thread.join();
+
+  for (auto worker : workers_)
+    delete worker;
+}
+
+ThreadPool* ThreadPool::GetDefault() {
+  // Never destroyed, sockets may well outlive the static destructors.
+  static ThreadPool* pool =
+      new ThreadPool(std::max(2U, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+void ThreadPool::Submit(Task* task) {
+  ThreadPoolWorker* preferred = nullptr;
+
+  auto self = current_worker;
+  if (self != nullptr && self->pool == this) {
+    self->deque.Push(task);
+  } else {
+    size_t index = next_.fetch_add(1, std::memory_order_relaxed);
+    preferred = workers_[index % workers_.size()];
+    preferred->inbox.Push(task);
+  }
+
+  // Pairs with the fence in Park: either the task is seen by a worker about
+  // to park, or that worker is seen here.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) > 0)
+    WakeOne(preferred);
+}
+
+std::vector<size_t> ThreadPool::GetQueueDepths() const {
+  std::vector<size_t> depths;
+  depths.reserve(workers_.size());
+
+  for (auto worker : workers_)
+    depths.push_back(worker->deque.size() + worker->inbox.size());
+
+  return depths;
+}
+
+void ThreadPool::Run(ThreadPoolWorker* self) {
+  current_worker = self;
+
+  for (;;) {
+    auto task = FindTask(self);
+    if (task != nullptr) {
+      task->run(task);
+      continue;
+    }
+
+    if (stopping_.load(std::memory_order_acquire) && !HasTasks())
+      break;
+
+    Park(self);
+  }
+
+  current_worker = nullptr;
+}
+
+// Takes the worker's own newest task, then moves its inbox into its deque
+// where others can steal from, and only then goes stealing, starting at a
+// different victim each time.
+Task* ThreadPool::FindTask(ThreadPoolWorker* self) {
+  auto task = self->deque.Pop();
+  if (task != nullptr)
+    return task;
+
+  if (self->inbox_lock.TryLock()) {
+    task = self->inbox.Pop(nullptr);
+    if (task != nullptr) {
+      while (auto next = self->inbox.Pop(nullptr))
+        self->deque.Push(next);
+    }
+
+    self->inbox_lock.Unlock();
+
+    if (task != nullptr)
+      return task;
+  }
+
+  size_t count = workers_.size();
+  size_t start = self->victim++;
+  for (size_t i = 0; i < count; ++i) {
+    auto victim = workers_[(start + i) % count];
+    if (victim == self)
+      continue;
+
+    task = victim->deque.Steal();
+    if (task != nullptr)
+      return task;
+
+    if (!victim->inbox.empty() && victim->inbox_lock.TryLock()) {
+      task = victim->inbox.Pop(nullptr);
+      victim->inbox_lock.Unlock();
+
+      if (task != nullptr)
+        return task;
+    }
+  }
+
+  return nullptr;
+}
+
+bool ThreadPool::HasTasks() const {
+  for (auto worker : workers_) {
+    if (worker->deque.size() > 0 || !worker->inbox.empty())
+      return true;
+  }
+
+  return false;
+}
+
+void ThreadPool::Park(ThreadPoolWorker* self) {
+  sleepers_.fetch_add(1, std::memory_order_relaxed);
+  self->sleeping.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (!HasTasks() && !stopping_.load(std::memory_order_relaxed)) {
+    LockGuard guard(&self->park_lock);
+
+    while (!self->notified)
+      self->park.Sleep(&self->park_lock);
+
+    self->notified = false;
+  }
+
+  if (self->sleeping.exchange(false, std::memory_order_relaxed))
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Wakes |preferred| if it sleeps, or else any other sleeping worker so it can
+// steal the task just submitted.
+void ThreadPool::WakeOne(ThreadPoolWorker* preferred) {
+  if (preferred != nullptr &&
+      preferred->sleeping.load(std::memory_order_relaxed) &&
+      preferred->sleeping.exchange(false, std::memory_order_relaxed)) {
+    Notify(preferred);
+    return;
+  }
+
+  for (auto worker : workers_) {
+    if (worker->sleeping.load(std::memory_order_relaxed) &&
+        worker->sleeping.exchange(false, std::memory_order_relaxed)) {
+      Notify(worker);
+      return;
+    }
+  }
+}
+
+void ThreadPool::Notify(ThreadPoolWorker* worker) {
+  sleepers_.fetch_sub(1, std::memory_order_relaxed);
+
+  LockGuard guard(&worker->park_lock);
+  worker->notified = true;
+  worker->park.Wake();
+}
+
+}  // namespace concurrent
+}  // namespace madoka
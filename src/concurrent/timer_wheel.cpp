@@ -0,0 +1,249 @@
+// Copyright (c) 2016 dacci.org
+
+#include <madoka/concurrent/timer_wheel.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif  // _MSC_VER
+
+#include <madoka/concurrent/lock_guard.h>
+
+#include <algorithm>
+
+namespace madoka {
+namespace concurrent {
+
+namespace {
+
+const uint64_t kNever = UINT64_MAX;
+
+// The position of the lowest bit set in |value|, which must not be zero.
+int FindFirstSet(uint64_t value) {
+#ifdef _MSC_VER
+  unsigned long index;  // NOLINT(runtime/int)
+  _BitScanForward64(&index, value);
+  return static_cast<int>(index);
+#else   // _MSC_VER
+  return __builtin_ctzll(value);
+#endif  // _MSC_VER
+}
+
+}  // namespace
+
+TimerWheel::TimerWheel(Clock::duration resolution)
+    : resolution_(std::max(resolution, Clock::duration(1))),
+      origin_(Clock::now()),
+      stopping_(false),
+      current_(0),
+      wake_(kNever),
+      count_(0),
+      expired_(nullptr),
+      running_(nullptr) {
+  std::fill(&slots_[0][0], &slots_[0][0] + kLevels * kSlots, nullptr);
+  std::fill(occupied_, occupied_ + kSlots / 64, 0);
+
+  thread_ = std::thread(&TimerWheel::Run, this);
+}
+
+TimerWheel::~TimerWheel() {
+  {
+    LockGuard guard(&lock_);
+    stopping_ = true;
+    changed_.Wake();
+  }
+
+  thread_.join();
+}
+
+TimerWheel* TimerWheel::GetDefault() {
+  // Never destroyed, sockets may well outlive the static destructors.
+  static TimerWheel* wheel = new TimerWheel(std::chrono::milliseconds(1));
+  return wheel;
+}
+
+void TimerWheel::Start(Timer* timer, Clock::duration timeout) {
+  auto elapsed = Clock::now() - origin_ + std::max(timeout, Clock::duration());
+  uint64_t expiry = (elapsed + resolution_ - Clock::duration(1)) / resolution_;
+
+  LockGuard guard(&lock_);
+
+  // The current tick has been processed already.
+  timer->expiry_ = std::max(expiry, current_ + 1);
+  Insert(timer);
+  ++count_;
+
+  if (timer->expiry_ < wake_)
+    changed_.Wake();
+}
+
+bool TimerWheel::Cancel(Timer* timer) {
+  LockGuard guard(&lock_);
+
+  if (timer->link_ != nullptr) {
+    if (timer->slot_ < kLevels * kSlots)
+      --count_;
+
+    Unlink(timer);
+    return true;
+  }
+
+  if (std::this_thread::get_id() != thread_.get_id()) {
+    while (running_ == timer)
+      idle_.Sleep(&lock_);
+  }
+
+  return false;
+}
+
+uint64_t TimerWheel::GetTick(const Clock::time_point& time) const {
+  return (time - origin_) / resolution_;
+}
+
+// Picks the lowest wheel whose range covers the timer; the slot is taken
+// from the bits of the expiry that wheel stands for, so the timer moves down
+// exactly when the wheels below have wrapped around to its expiry.
+void TimerWheel::Insert(Timer* timer) {
+  uint64_t delta = timer->expiry_ - current_;
+  if (delta > UINT32_MAX) {
+    delta = UINT32_MAX;
+    timer->expiry_ = current_ + delta;
+  }
+
+  int level = 0;
+  while (level < kLevels - 1 && delta >> ((level + 1) * kSlotBits) != 0)
+    ++level;
+
+  uint32_t index = (timer->expiry_ >> (level * kSlotBits)) & kSlotMask;
+  timer->slot_ = level * kSlots + index;
+  Link(timer, &slots_[level][index]);
+
+  if (level == 0)
+    occupied_[index / 64] |= 1ULL << (index % 64);
+}
+
+void TimerWheel::Link(Timer* timer, Timer** head) {
+  timer->next_ = *head;
+  if (timer->next_ != nullptr)
+    timer->next_->link_ = &timer->next_;
+
+  *head = timer;
+  timer->link_ = head;
+}
+
+void TimerWheel::Unlink(Timer* timer) {
+  *timer->link_ = timer->next_;
+  if (timer->next_ != nullptr)
+    timer->next_->link_ = timer->link_;
+
+  timer->next_ = nullptr;
+  timer->link_ = nullptr;
+
+  uint32_t index = timer->slot_;
+  if (index < kSlots && slots_[0][index] == nullptr)
+    occupied_[index / 64] &= ~(1ULL << (index % 64));
+}
+
+void TimerWheel::Cascade(int level) {
+  uint32_t index = (current_ >> (level * kSlotBits)) & kSlotMask;
+
+  Timer* timer = slots_[level][index];
+  slots_[level][index] = nullptr;
+
+  while (timer != nullptr) {
+    Timer* next = timer->next_;
+    Insert(timer);
+    timer = next;
+  }
+}
+
+// Advances to the next tick, moving timers down from the wheels above where
+// the ones below wrap around, and moves the timers of the tick to |expired_|.
+void TimerWheel::Tick() {
+  ++current_;
+
+  for (int level = 1; level < kLevels; ++level) {
+    if (((current_ >> ((level - 1) * kSlotBits)) & kSlotMask) != 0)
+      break;
+
+    Cascade(level);
+  }
+
+  uint32_t index = current_ & kSlotMask;
+  while (Timer* timer = slots_[0][index]) {
+    Unlink(timer);
+    --count_;
+
+    timer->slot_ = kLevels * kSlots;
+    Link(timer, &expired_);
+  }
+}
+
+// The next tick with timers to expire in the lowest wheel, or where it wraps
+// around if none before that.
+uint64_t TimerWheel::GetNextTick() const {
+  if (count_ == 0)
+    return kNever;
+
+  uint32_t index = (current_ & kSlotMask) + 1;
+  for (uint32_t word = index / 64; word < kSlots / 64; ++word) {
+    uint64_t bits = occupied_[word];
+    if (word == index / 64 && index % 64 != 0)
+      bits &= ~0ULL << (index % 64);
+
+    if (bits != 0)
+      return (current_ & ~static_cast<uint64_t>(kSlotMask)) + word * 64 +
+             FindFirstSet(bits);
+  }
+
+  return (current_ | kSlotMask) + 1;
+}
+
+void TimerWheel::Run() {
+  LockGuard guard(&lock_);
+
+  while (!stopping_) {
+    // Ticks without anything to do in between are skipped.
+    uint64_t now = GetTick(Clock::now());
+    while (current_ < now) {
+      uint64_t next = GetNextTick();
+      if (next > now) {
+        current_ = now;
+        break;
+      }
+
+      current_ = next - 1;
+      Tick();
+    }
+
+    while (expired_ != nullptr && !stopping_) {
+      Timer* timer = expired_;
+      Unlink(timer);
+      running_ = timer;
+
+      lock_.Unlock();
+      timer->callback(timer);
+      lock_.Lock();
+
+      running_ = nullptr;
+      idle_.WakeAll();
+    }
+
+    if (stopping_)
+      break;
+
+    wake_ = GetNextTick();
+    if (wake_ <= GetTick(Clock::now()))
+      continue;
+
+    if (wake_ == kNever)
+      changed_.Sleep(&lock_);
+    else
+      changed_.SleepUntil(
+          &lock_, origin_ + resolution_ * static_cast<Clock::rep>(wake_));
+
+    wake_ = kNever;
+  }
+}
+
+}  // namespace concurrent
+}  // namespace madoka
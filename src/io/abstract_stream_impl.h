@@ -3,37 +3,128 @@
 #ifndef IO_ABSTRACT_STREAM_IMPL_H_
 #define IO_ABSTRACT_STREAM_IMPL_H_
 
+#ifndef _WIN32
+#include <errno.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "io/completion_port_posix.h"
+#endif  // _WIN32
+
+#include <chrono>
+#include <new>
+
 #ifndef HRESULT_FROM_LAST_ERROR
+#ifdef _WIN32
 #define HRESULT_FROM_LAST_ERROR() HRESULT_FROM_WIN32(GetLastError())
+#else   // _WIN32
+#define HRESULT_FROM_LAST_ERROR() HRESULT_FROM_ERRNO(errno)
+#endif  // _WIN32
 #endif  // HRESULT_FROM_LAST_ERROR
 
 namespace madoka {
 namespace io {
 
-enum AbstractStream::GeneralRequest {
+const std::chrono::milliseconds kNoTimeout =
+    (std::chrono::milliseconds::max)();
+
+enum AbstractStream::GeneralRequest : int {
   Invalid = 0,
   Read = -1,
   Write = -2,
 };
 
-struct AbstractStream::AsyncContext {
+#ifdef _WIN32
+struct AbstractStream::AsyncContext : madoka::concurrent::MpscQueueEntry {
+#else   // _WIN32
+struct AbstractStream::AsyncContext : madoka::concurrent::MpscQueueEntry,
+                                      CompletionPacket {
+#endif  // _WIN32
+  // Contexts are owned through pointers to this base.
+  virtual ~AsyncContext() {}
+
   AbstractStream* stream;
   int type;
   void* buffer;
   uint64_t length;
   void* listener;
+  AsyncContext* prev_request;
+  AsyncContext* next_request;
+  // Whether the stream allocated the context, rather than a ContextStorage.
+  bool owned;
+  std::chrono::milliseconds timeout;
+
+  // Cancels the request once |timeout| has passed.
+  struct Deadline : madoka::concurrent::TimerWheel::Timer {
+    AsyncContext* context;
+  } deadline;
+
+  // Set with the lock of the stream held; |timed_out| when the timer did it.
+  bool cancelled;
+  bool timed_out;
+
+  // What the request completes with once it has been stopped by |cancelled|.
+  HRESULT CancelResult() const {
+    if (!timed_out)
+      return kOperationCancelled;
+
+#ifdef _WIN32
+    return __HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+#else   // _WIN32
+    return HRESULT_FROM_ERRNO(ETIMEDOUT);
+#endif  // _WIN32
+  }
+#ifdef _WIN32
+  // What a request started with Begin* without an event completed with.
+  HRESULT result;
+  bool completed;
+#else   // _WIN32
+  // A futex word: 0 while pending, 2 once End* sleeps on it and 1 when done.
+  std::atomic<uint32_t> completed;
+
+  // Carries a completion over to the executor of the stream.
+  struct Notification : madoka::concurrent::ThreadPool::Task {
+    AsyncContext* context;
+    void (*notify)(AsyncContext* context);
+  } notification;
+#endif  // _WIN32
 };
 
 template<class T>
 std::unique_ptr<T> AbstractStream::CreateContext(
     int type, void* buffer, uint64_t length, Listener* listener) {
-  auto context = std::make_unique<T>();
+  return CreateContext<T>(type, buffer, length, listener, nullptr);
+}
+
+template<class T>
+std::unique_ptr<T> AbstractStream::CreateContext(
+    int type, void* buffer, uint64_t length, Listener* listener,
+    ContextStorage* storage) {
+  static_assert(sizeof(T) <= sizeof(ContextStorage),
+                "ContextStorage is too small for the context");
+
+  // Contexts are pooled, which hides the placement form of operator new.
+  std::unique_ptr<T> context(storage != nullptr ? ::new (storage->data) T()
+                                                : new T());
   if (context != nullptr) {
     context->stream = this;
     context->type = type;
     context->buffer = buffer;
     context->length = length;
     context->listener = listener;
+    context->prev_request = nullptr;
+    context->next_request = nullptr;
+    context->owned = storage == nullptr;
+    context->timeout = kNoTimeout;
+    context->cancelled = false;
+    context->timed_out = false;
+#ifdef _WIN32
+    context->result = S_OK;
+    context->completed = false;
+#else   // _WIN32
+    context->completed.store(0, std::memory_order_relaxed);
+#endif  // _WIN32
   }
 
   return context;
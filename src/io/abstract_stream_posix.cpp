@@ -0,0 +1,261 @@
+// Copyright (c) 2016 dacci.org
+
+#include "madoka/io/abstract_stream.h"
+
+#include "madoka/concurrent/lock_guard.h"
+
+#include "concurrent/futex_posix.h"
+#include "io/abstract_stream_impl.h"
+
+namespace madoka {
+namespace io {
+
+AbstractStream::~AbstractStream() {
+  Reset();
+}
+
+AbstractStream::AbstractStream() : AbstractStream(nullptr) {
+}
+
+AbstractStream::AbstractStream(madoka::concurrent::Executor executor)
+    : port_(CompletionPort::GetDefault()),
+      executor_(executor != nullptr
+                    ? executor
+                    : madoka::concurrent::ThreadPool::GetDefault()),
+      requests_(nullptr), callbacks_(0) {
+  lock_.SetName("madoka::io::AbstractStream");
+}
+
+size_t AbstractStream::CancelReads() {
+  return CancelAll(true);
+}
+
+size_t AbstractStream::CancelWrites() {
+  return CancelAll(false);
+}
+
+void AbstractStream::Reset() {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  Collect();
+
+  while (requests_ != nullptr || callbacks_ > 0) {
+    empty_.Sleep(&lock_);
+    Collect();
+  }
+}
+
+HRESULT AbstractStream::DispatchRequest(
+    std::unique_ptr<AsyncContext>&& context) {  // NOLINT(build/c++11)
+  return DispatchRequest(std::move(context), kNoTimeout);
+}
+
+HRESULT AbstractStream::DispatchRequest(
+    std::unique_ptr<AsyncContext>&& context,  // NOLINT(build/c++11)
+    std::chrono::milliseconds timeout) {
+  if (!port_->IsValid()) {
+    if (!context->owned)
+      context.release();
+
+    return E_HANDLE;
+  }
+
+  auto pointer = context.release();
+  dispatched_.Push(pointer);
+
+  if (timeout != kNoTimeout) {
+    pointer->timeout = timeout;
+    pointer->deadline.callback = OnTimedOut;
+    pointer->deadline.context = pointer;
+    madoka::concurrent::TimerWheel::GetDefault()->Start(&pointer->deadline,
+                                                        timeout);
+  }
+
+  // Starting a request only queues a submission entry, so unlike the thread
+  // pool version it is started right on the calling thread.
+  OnRequested(pointer);
+
+  return S_OK;
+}
+
+void AbstractStream::EndRequest(AsyncContext* context) {
+  EndRequest(context, false);
+}
+
+void AbstractStream::EndRequestBeforeCallback(AsyncContext* context) {
+  EndRequest(context, true);
+}
+
+void AbstractStream::EndCallback() {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (--callbacks_ == 0 && requests_ == nullptr)
+    empty_.WakeAll();
+}
+
+// Never called with |lock_| held, since cancelling the timer waits for
+// OnTimedOut, which takes it. The stream stays busy until EndCallback if
+// |callback| is true.
+void AbstractStream::EndRequest(AsyncContext* context, bool callback) {
+  if (context->timeout != kNoTimeout)
+    madoka::concurrent::TimerWheel::GetDefault()->Cancel(&context->deadline);
+
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  Collect();
+
+  if (context->prev_request != nullptr)
+    context->prev_request->next_request = context->next_request;
+  else
+    requests_ = context->next_request;
+
+  if (context->next_request != nullptr)
+    context->next_request->prev_request = context->prev_request;
+
+  if (callback)
+    ++callbacks_;
+
+  if (context->owned)
+    delete context;
+
+  if (requests_ == nullptr && callbacks_ == 0)
+    empty_.WakeAll();
+}
+
+bool AbstractStream::IsValidRequest(AsyncContext* context) {
+  if (context == nullptr || context->stream != this)
+    return false;
+
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  Collect();
+
+  for (auto i = requests_; i != nullptr; i = i->next_request) {
+    if (i == context)
+      return true;
+  }
+
+  return false;
+}
+
+bool AbstractStream::Cancel(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (!IsValidRequest(context) || context->cancelled)
+    return false;
+
+  context->cancelled = true;
+  CancelRequest(context);
+
+  return true;
+}
+
+bool AbstractStream::IsRead(int type) const {
+  return type == GeneralRequest::Read;
+}
+
+bool AbstractStream::IsWrite(int type) const {
+  return type == GeneralRequest::Write;
+}
+
+void AbstractStream::CancelRequest(AsyncContext* context) {
+  port_->Cancel(context);
+}
+
+// Only the thread waiting for |context| is woken, and only if it sleeps. The
+// lock keeps that thread from freeing |context| in EndRequest before the wake
+// up has been issued.
+void AbstractStream::SetCompleted(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (context->completed.exchange(1, std::memory_order_release) == 2)
+    madoka::concurrent::FutexWakeAll(&context->completed);
+}
+
+void AbstractStream::WaitForCompletion(AsyncContext* context) {
+  uint32_t state = 0;
+  if (context->completed.compare_exchange_strong(state, 2,
+                                                 std::memory_order_acquire))
+    state = 2;
+
+  while (state != 1) {
+    madoka::concurrent::FutexWait(&context->completed, 2);
+    state = context->completed.load(std::memory_order_acquire);
+  }
+}
+
+void AbstractStream::CancelRequests() {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  Collect();
+
+  for (auto i = requests_; i != nullptr; i = i->next_request)
+    port_->Cancel(i);
+}
+
+void AbstractStream::Notify(AsyncContext* context,
+                            void (*notify)(AsyncContext* context)) {
+  context->notification.run = OnNotified;
+  context->notification.context = context;
+  context->notification.notify = notify;
+  executor_->Submit(&context->notification);
+}
+
+void AbstractStream::OnNotified(madoka::concurrent::ThreadPool::Task* task) {
+  auto notification = static_cast<AsyncContext::Notification*>(task);
+  notification->notify(notification->context);
+}
+
+void AbstractStream::OnTimedOut(
+    madoka::concurrent::TimerWheel::Timer* timer) {
+  auto context = static_cast<AsyncContext::Deadline*>(timer)->context;
+  context->stream->OnTimedOut(context);
+}
+
+// Runs on the thread of the timer wheel. The context stays alive meanwhile,
+// since EndRequest cancels the timer first, which waits for this to return.
+void AbstractStream::OnTimedOut(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (context->cancelled)
+    return;
+
+  context->cancelled = true;
+  context->timed_out = true;
+  CancelRequest(context);
+}
+
+size_t AbstractStream::CancelAll(bool reads) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  Collect();
+
+  size_t count = 0;
+  for (auto i = requests_; i != nullptr; i = i->next_request) {
+    if (i->cancelled || !(reads ? IsRead(i->type) : IsWrite(i->type)))
+      continue;
+
+    i->cancelled = true;
+    CancelRequest(i);
+    ++count;
+  }
+
+  return count;
+}
+
+// Called with |lock_| held, which also makes this the only consumer of
+// |dispatched_|.
+void AbstractStream::Collect() {
+  while (auto context = dispatched_.Pop(nullptr)) {
+    context->prev_request = nullptr;
+    context->next_request = requests_;
+
+    if (requests_ != nullptr)
+      requests_->prev_request = context;
+
+    requests_ = context;
+  }
+}
+
+}  // namespace io
+}  // namespace madoka
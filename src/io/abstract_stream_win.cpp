@@ -13,41 +13,103 @@ AbstractStream::~AbstractStream() {
   Reset();
 }
 
-AbstractStream::AbstractStream() {
+AbstractStream::AbstractStream() : AbstractStream(nullptr) {
+}
+
+AbstractStream::AbstractStream(madoka::concurrent::Executor executor)
+    : executor_(executor), requests_(nullptr), callbacks_(0) {
+  lock_.SetName("madoka::io::AbstractStream");
+}
+
+size_t AbstractStream::CancelReads() {
+  return CancelAll(true);
+}
+
+size_t AbstractStream::CancelWrites() {
+  return CancelAll(false);
 }
 
 void AbstractStream::Reset() {
   madoka::concurrent::LockGuard guard(&lock_);
 
-  while (!requests_.empty())
+  Collect();
+
+  while (requests_ != nullptr || callbacks_ > 0) {
     empty_.Sleep(&lock_);
+    Collect();
+  }
 }
 
 HRESULT AbstractStream::DispatchRequest(
     std::unique_ptr<AsyncContext>&& context) {  // NOLINT(build/c++11)
-  madoka::concurrent::LockGuard guard(&lock_);
+  return DispatchRequest(std::move(context), kNoTimeout);
+}
 
-  if (!TrySubmitThreadpoolCallback(OnRequested, context.get(), nullptr))
-    return HRESULT_FROM_LAST_ERROR();
+HRESULT AbstractStream::DispatchRequest(
+    std::unique_ptr<AsyncContext>&& context,  // NOLINT(build/c++11)
+    std::chrono::milliseconds timeout) {
+  auto pointer = context.release();
+  dispatched_.Push(pointer);
+
+  if (timeout != kNoTimeout) {
+    pointer->timeout = timeout;
+    pointer->deadline.callback = OnTimedOut;
+    pointer->deadline.context = pointer;
+    madoka::concurrent::TimerWheel::GetDefault()->Start(&pointer->deadline,
+                                                        timeout);
+  }
 
-  requests_.push_back(std::move(context));
+  if (!TrySubmitThreadpoolCallback(OnRequested, pointer, executor_)) {
+    HRESULT result = HRESULT_FROM_LAST_ERROR();
+    EndRequest(pointer);
+    return result;
+  }
 
   return S_OK;
 }
 
 void AbstractStream::EndRequest(AsyncContext* context) {
+  EndRequest(context, false);
+}
+
+void AbstractStream::EndRequestBeforeCallback(AsyncContext* context) {
+  EndRequest(context, true);
+}
+
+void AbstractStream::EndCallback() {
   madoka::concurrent::LockGuard guard(&lock_);
 
-  for (auto i = requests_.begin(), l = requests_.end(); i != l; ++i) {
-    if (i->get() == context) {
-      requests_.erase(i);
+  if (--callbacks_ == 0 && requests_ == nullptr)
+    empty_.WakeAll();
+}
 
-      if (requests_.empty())
-        empty_.WakeAll();
+// Never called with |lock_| held, since cancelling the timer waits for
+// OnTimedOut, which takes it. The stream stays busy until EndCallback if
+// |callback| is true.
+void AbstractStream::EndRequest(AsyncContext* context, bool callback) {
+  if (context->timeout != kNoTimeout)
+    madoka::concurrent::TimerWheel::GetDefault()->Cancel(&context->deadline);
 
-      break;
-    }
-  }
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  Collect();
+
+  if (context->prev_request != nullptr)
+    context->prev_request->next_request = context->next_request;
+  else
+    requests_ = context->next_request;
+
+  if (context->next_request != nullptr)
+    context->next_request->prev_request = context->prev_request;
+
+  if (callback)
+    ++callbacks_;
+
+  if (context->owned)
+    delete context;
+
+  if (requests_ == nullptr && callbacks_ == 0)
+    empty_.WakeAll();
 }
 
 bool AbstractStream::IsValidRequest(AsyncContext* context) {
@@ -56,14 +118,105 @@ bool AbstractStream::IsValidRequest(AsyncContext* context) {
 
   madoka::concurrent::LockGuard guard(&lock_);
 
-  for (auto i = requests_.begin(), l = requests_.end(); i != l; ++i) {
-    if (i->get() == context)
+  Collect();
+
+  for (auto i = requests_; i != nullptr; i = i->next_request) {
+    if (i == context)
       return true;
   }
 
   return false;
 }
 
+bool AbstractStream::Cancel(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (!IsValidRequest(context) || context->cancelled)
+    return false;
+
+  context->cancelled = true;
+  CancelRequest(context);
+
+  return true;
+}
+
+bool AbstractStream::IsRead(int type) const {
+  return type == GeneralRequest::Read;
+}
+
+bool AbstractStream::IsWrite(int type) const {
+  return type == GeneralRequest::Write;
+}
+
+// Overridden by the streams that start overlapped operations.
+void AbstractStream::CancelRequest(AsyncContext* /*context*/) {
+}
+
+void AbstractStream::SetCompleted(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  context->completed = true;
+  completed_.WakeAll();
+}
+
+void AbstractStream::WaitForCompletion(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  while (!context->completed)
+    completed_.Sleep(&lock_);
+}
+
+void AbstractStream::OnTimedOut(
+    madoka::concurrent::TimerWheel::Timer* timer) {
+  auto context = static_cast<AsyncContext::Deadline*>(timer)->context;
+  context->stream->OnTimedOut(context);
+}
+
+// Runs on the thread of the timer wheel. The context stays alive meanwhile,
+// since EndRequest cancels the timer first, which waits for this to return.
+void AbstractStream::OnTimedOut(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (context->cancelled)
+    return;
+
+  context->cancelled = true;
+  context->timed_out = true;
+  CancelRequest(context);
+}
+
+size_t AbstractStream::CancelAll(bool reads) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  Collect();
+
+  size_t count = 0;
+  for (auto i = requests_; i != nullptr; i = i->next_request) {
+    if (i->cancelled || !(reads ? IsRead(i->type) : IsWrite(i->type)))
+      continue;
+
+    i->cancelled = true;
+    CancelRequest(i);
+    ++count;
+  }
+
+  return count;
+}
+
+// Called with |lock_| held, which also makes this the only consumer of
+// |dispatched_|.
+void AbstractStream::Collect() {
+  while (auto context = dispatched_.Pop(nullptr)) {
+    context->prev_request = nullptr;
+    context->next_request = requests_;
+
+    if (requests_ != nullptr)
+      requests_->prev_request = context;
+
+    requests_ = context;
+  }
+}
+
 void CALLBACK AbstractStream::OnRequested(PTP_CALLBACK_INSTANCE /*callback*/,
                                           void* request) {
   auto context = static_cast<AsyncContext*>(request);
@@ -0,0 +1,402 @@
+// Copyright (c) 2016 dacci.org
+
+#include "io/completion_port_posix.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "madoka/concurrent/lock_guard.h"
+
+namespace madoka {
+namespace io {
+
+namespace {
+
+// How long the reaper waits before retrying entries io_uring_enter failed to
+// submit for a while, doubling up to the last delay before it gives up.
+const std::chrono::milliseconds kFirstRetryDelay(1);
+const std::chrono::milliseconds kLastRetryDelay(512);
+
+int Setup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int Enter(int ring, unsigned to_submit, unsigned min_complete,
+          unsigned flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+template<typename T>
+T* Offset(void* base, uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+}  // namespace
+
+CompletionPort::CompletionPort(unsigned entries)
+    : ring_(-1),
+      wakeup_(-1),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      sq_head_(nullptr),
+      sq_tail_(nullptr),
+      sq_array_(nullptr),
+      sq_mask_(0),
+      sq_entries_(0),
+      sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqes_size_(0),
+      cq_ring_(MAP_FAILED),
+      cq_ring_size_(0),
+      cq_head_(nullptr),
+      cq_tail_(nullptr),
+      cq_mask_(0),
+      cq_entries_(0),
+      cqes_(nullptr),
+      tail_(0),
+      error_(0),
+      flushing_(false),
+      stopping_(false) {
+  lock_.SetName("madoka::io::CompletionPort");
+
+  io_uring_params params = {};
+  int ring = Setup(entries, &params);
+  if (ring == -1)
+    return;
+
+  do {
+    wakeup_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup_ == -1)
+      break;
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+      break;
+
+    if (single) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED)
+        break;
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(
+        mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED)
+      break;
+
+    sq_head_ = Offset<unsigned>(sq_ring_, params.sq_off.head);
+    sq_tail_ = Offset<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_array_ = Offset<unsigned>(sq_ring_, params.sq_off.array);
+    sq_mask_ = *Offset<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+
+    cq_head_ = Offset<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = Offset<unsigned>(cq_ring_, params.cq_off.tail);
+    cq_mask_ = *Offset<unsigned>(cq_ring_, params.cq_off.ring_mask);
+    cq_entries_ = params.cq_entries;
+    cqes_ = Offset<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+
+    tail_ = *sq_tail_;
+    ring_ = ring;
+
+    wakeup_packet_.callback = OnWakeup;
+    wakeup_packet_.port = this;
+    Arm();
+
+    reaper_ = std::thread(&CompletionPort::Reap, this);
+
+    return;
+  } while (false);
+
+  if (wakeup_ != -1) {
+    close(wakeup_);
+    wakeup_ = -1;
+  }
+
+  if (sqes_ != MAP_FAILED)
+    munmap(sqes_, sqes_size_);
+
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+
+  if (sq_ring_ != MAP_FAILED)
+    munmap(sq_ring_, sq_ring_size_);
+
+  close(ring);
+}
+
+CompletionPort::~CompletionPort() {
+  if (!IsValid())
+    return;
+
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    stopping_ = true;
+  }
+
+  // The reaper checks |stopping_| whenever the completion queue runs dry.
+  Wake();
+  reaper_.join();
+
+  munmap(sqes_, sqes_size_);
+
+  if (cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+
+  munmap(sq_ring_, sq_ring_size_);
+
+  close(ring_);
+  close(wakeup_);
+}
+
+CompletionPort* CompletionPort::GetDefault() {
+  // Never destroyed, streams may well outlive the static destructors.
+  static CompletionPort* port = new CompletionPort(1024);
+  return port;
+}
+
+HRESULT CompletionPort::Submit(io_uring_sqe* entry, CompletionPacket* packet) {
+  if (!IsValid())
+    return E_HANDLE;
+
+  entry->user_data = reinterpret_cast<uintptr_t>(packet);
+
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  // Behind the backlog if there is one, so that a cancellation never gets
+  // ahead of what it cancels.
+  backlog_.push_back(*entry);
+  Refill();
+
+  if (!flushing_)
+    Flush();
+
+  return S_OK;
+}
+
+HRESULT CompletionPort::Cancel(CompletionPacket* packet) {
+  io_uring_sqe entry = {};
+  entry.opcode = IORING_OP_ASYNC_CANCEL;
+  entry.fd = -1;
+  entry.addr = reinterpret_cast<uintptr_t>(packet);
+
+  return Submit(&entry, nullptr);
+}
+
+void CompletionPort::OnWakeup(CompletionPacket* packet, int result) {
+  auto port = static_cast<Wakeup*>(packet)->port;
+
+  uint64_t value;
+  read(port->wakeup_, &value, sizeof(value));
+
+  // Arming it again is worth it unless the poll failed for good, in which
+  // case it would only fail again.
+  if (result >= 0 || result == -EAGAIN || result == -EBUSY)
+    port->Arm();
+}
+
+void CompletionPort::Arm() {
+  io_uring_sqe entry = {};
+  entry.opcode = IORING_OP_POLL_ADD;
+  entry.fd = wakeup_;
+  entry.poll32_events = POLLIN;
+
+  Submit(&entry, &wakeup_packet_);
+}
+
+void CompletionPort::Wake() {
+  uint64_t value = 1;
+  write(wakeup_, &value, sizeof(value));
+}
+
+// Called with |lock_| held to move what fits of |backlog_| to the submission
+// queue.
+void CompletionPort::Refill() {
+  while (!backlog_.empty() &&
+         tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) < sq_entries_) {
+    unsigned index = tail_ & sq_mask_;
+    sqes_[index] = backlog_.front();
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, ++tail_, __ATOMIC_RELEASE);
+
+    backlog_.pop_front();
+  }
+}
+
+// Called with |lock_| held. The lock is released around io_uring_enter so
+// other threads can keep queueing; whatever they queued in the meantime is
+// picked up by the next round instead of costing another system call each.
+void CompletionPort::Flush() {
+  flushing_ = true;
+
+  for (;;) {
+    Refill();
+
+    unsigned pending = tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (pending == 0)
+      break;
+
+    lock_.Unlock();
+    int result = Enter(ring_, pending, 0, 0);
+    int error = errno;
+    lock_.Lock();
+
+    if (result > 0) {
+      error_ = 0;
+      continue;
+    }
+
+    if (result < 0 && error == EINTR)
+      continue;
+
+    // EAGAIN and EBUSY leave the entries in place for the reaper to retry,
+    // which is woken up in case nothing in flight would get it to that.
+    if (result == 0 || error == EAGAIN || error == EBUSY) {
+      error_ = result == 0 ? EAGAIN : error;
+      Wake();
+    } else {
+      Fail(error);
+    }
+
+    break;
+  }
+
+  flushing_ = false;
+}
+
+// Called with |lock_| held to take the entries io_uring_enter has not
+// submitted back out of the submission queue and |backlog_|, and to have the
+// reaper complete their packets with |error|. The kernel only reads the
+// submission queue inside io_uring_enter, which no one else is in to submit.
+void CompletionPort::Fail(int error) {
+  io_uring_cqe completion = {};
+  completion.res = -error;
+
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  for (unsigned i = head; i != tail_; ++i) {
+    completion.user_data = sqes_[sq_array_[i & sq_mask_]].user_data;
+    if (completion.user_data != 0)
+      failed_.push_back(completion);
+  }
+
+  tail_ = head;
+  __atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+
+  for (auto& entry : backlog_) {
+    completion.user_data = entry.user_data;
+    if (completion.user_data != 0)
+      failed_.push_back(completion);
+  }
+
+  backlog_.clear();
+  error_ = 0;
+
+  Wake();
+}
+
+void CompletionPort::Reap() {
+  std::vector<io_uring_cqe> batch(cq_entries_);
+  std::vector<io_uring_cqe> failed;
+  auto retry_delay = kFirstRetryDelay;
+
+  for (;;) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+      bool retrying;
+      {
+        madoka::concurrent::LockGuard guard(&lock_);
+
+        if (stopping_)
+          break;
+
+        // Entries a failure of io_uring_enter left queued are retried here,
+        // less and less often, until they are given up on.
+        if (error_ == 0) {
+          retry_delay = kFirstRetryDelay;
+        } else if (!flushing_) {
+          if (retry_delay > kLastRetryDelay)
+            Fail(error_);
+          else
+            Flush();
+        }
+
+        retrying = error_ != 0;
+        failed.swap(failed_);
+      }
+
+      for (auto& completion : failed) {
+        auto packet = reinterpret_cast<CompletionPacket*>(completion.user_data);
+        packet->callback(packet, completion.res);
+      }
+
+      if (!failed.empty()) {
+        failed.clear();
+        continue;
+      }
+
+      if (retrying) {
+        std::this_thread::sleep_for(retry_delay);
+        retry_delay *= 2;
+        continue;
+      }
+
+      if (Enter(ring_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR &&
+          errno != EAGAIN && errno != EBUSY)
+        break;
+
+      continue;
+    }
+
+    // Copy the whole batch out first so the kernel can reuse the slots while
+    // the callbacks are running.
+    size_t count = 0;
+    for (; head != tail; ++head)
+      batch[count++] = cqes_[head & cq_mask_];
+
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+    // The kernel orders the two rings, but nothing the compiler can see does;
+    // pairing with the release in Submit publishes what the submitters wrote
+    // to their packets.
+    __atomic_load_n(sq_tail_, __ATOMIC_ACQUIRE);
+
+    for (size_t i = 0; i < count; ++i) {
+      auto packet = reinterpret_cast<CompletionPacket*>(batch[i].user_data);
+      if (packet != nullptr)
+        packet->callback(packet, batch[i].res);
+    }
+
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    if (!flushing_ && (tail_ != __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) ||
+                       !backlog_.empty()))
+      Flush();
+  }
+}
+
+}  // namespace io
+}  // namespace madoka
@@ -0,0 +1,108 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef IO_COMPLETION_PORT_POSIX_H_
+#define IO_COMPLETION_PORT_POSIX_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#include <madoka/common.h>
+#include <madoka/hresult.h>
+#include <madoka/concurrent/critical_section.h>
+
+#include <deque>
+#include <thread>
+#include <vector>
+
+namespace madoka {
+namespace io {
+
+// Plays the role of OVERLAPPED: embedded in every operation context and
+// passed back to |callback| with the result of the operation, which is the
+// number of bytes transferred or a negated errno value.
+struct CompletionPacket {
+  void (*callback)(CompletionPacket* packet, int result);
+};
+
+// An io_uring instance with a thread reaping its completion queue.
+class CompletionPort {
+ public:
+  explicit CompletionPort(unsigned entries);
+  ~CompletionPort();
+
+  static CompletionPort* GetDefault();
+
+  // Queues |entry| on behalf of |packet|. Entries queued while another thread
+  // is inside io_uring_enter are submitted by that thread with the same
+  // system call. When the submission queue is full the entry waits in
+  // |backlog_| until there is room, so this fails only on an invalid port;
+  // should io_uring_enter fail for good, |packet| completes with its error.
+  HRESULT Submit(io_uring_sqe* entry, CompletionPacket* packet);
+  // Asks the kernel to cancel the operation submitted for |packet|, which then
+  // completes with -ECANCELED if it was still in flight.
+  HRESULT Cancel(CompletionPacket* packet);
+
+  bool IsValid() const {
+    return ring_ != -1;
+  }
+
+ private:
+  // The packet of the poll kept on |wakeup_|, which gets the reaper out of
+  // io_uring_enter without having to submit anything.
+  struct Wakeup : CompletionPacket {
+    CompletionPort* port;
+  };
+
+  static void OnWakeup(CompletionPacket* packet, int result);
+
+  void Arm();
+  void Wake();
+  void Refill();
+  void Flush();
+  void Fail(int error);
+  void Reap();
+
+  int ring_;
+  int wakeup_;
+  Wakeup wakeup_packet_;
+
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_array_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  unsigned cq_entries_;
+  io_uring_cqe* cqes_;
+
+  madoka::concurrent::CriticalSection lock_;
+  unsigned tail_;
+  // Entries that found the submission queue full, in the order they came.
+  std::deque<io_uring_sqe> backlog_;
+  // The errno value io_uring_enter last failed with for a while, leaving the
+  // entries queued for the reaper to retry, or zero.
+  int error_;
+  // Completions of the entries taken back out of the queues by Fail, which
+  // the reaper delivers.
+  std::vector<io_uring_cqe> failed_;
+  bool flushing_;
+  bool stopping_;
+
+  std::thread reaper_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(CompletionPort);
+};
+
+}  // namespace io
+}  // namespace madoka
+
+#endif  // IO_COMPLETION_PORT_POSIX_H_
@@ -3,12 +3,16 @@
 #ifndef IO_HANDLE_STREAM_IMPL_H_
 #define IO_HANDLE_STREAM_IMPL_H_
 
+#include "concurrent/object_pool.h"
 #include "io/abstract_stream_impl.h"
 
 namespace madoka {
 namespace io {
 
-struct HandleStream::AsyncContext : AbstractStream::AsyncContext, OVERLAPPED {
+struct HandleStream::AsyncContext
+    : AbstractStream::AsyncContext,
+      madoka::concurrent::PooledObject<HandleStream::AsyncContext>,
+      OVERLAPPED {
 };
 
 }  // namespace io
@@ -193,9 +193,17 @@ HRESULT HandleStream::EndWrite(AsyncContext* context, DWORD* length) {
   return EndRequest(context, length);
 }
 
+bool HandleStream::Cancel(AsyncContext* context) {
+  return AbstractStream::Cancel(context);
+}
+
 HandleStream::HandleStream() : handle_(INVALID_HANDLE_VALUE) {
 }
 
+HandleStream::HandleStream(madoka::concurrent::Executor executor)
+    : AbstractStream(executor), handle_(INVALID_HANDLE_VALUE) {
+}
+
 void HandleStream::Reset() {
   madoka::concurrent::LockGuard guard(&lock_);
 
@@ -216,15 +224,26 @@ void HandleStream::Reset() {
 HRESULT HandleStream::EndRequest(AsyncContext* context, DWORD* length) {
   HRESULT result = S_OK;
 
-  DWORD bytes = 0;
-  if (WaitForSingleObject(context->hEvent, INFINITE) == WAIT_OBJECT_0 &&
-      GetOverlappedResult(handle_, context, &bytes, TRUE)) {
-    if (length != nullptr)
-      *length = bytes;
-  } else {
+  if (context->hEvent == NULL) {
+    WaitForCompletion(context);
+    result = context->result;
+  } else if (WaitForSingleObject(context->hEvent, INFINITE) != WAIT_OBJECT_0) {
     result = HRESULT_FROM_LAST_ERROR();
   }
 
+  DWORD bytes = 0;
+  if (SUCCEEDED(result)) {
+    if (GetOverlappedResult(handle_, context, &bytes, FALSE)) {
+      if (length != nullptr)
+        *length = bytes;
+    } else if (GetLastError() == ERROR_OPERATION_ABORTED &&
+               context->cancelled) {
+      result = context->CancelResult();
+    } else {
+      result = HRESULT_FROM_LAST_ERROR();
+    }
+  }
+
   AbstractStream::EndRequest(context);
 
   return result;
@@ -234,19 +253,22 @@ void HandleStream::OnRequested(AbstractStream::AsyncContext* async_context) {
   auto context = static_cast<AsyncContext*>(async_context);
   HRESULT result = S_OK;
 
-  {
-    madoka::concurrent::LockGuard guard(&lock_);
+  // Held until the operation has started, so that cancelling it either finds
+  // it started or is noticed here.
+  lock_.Lock();
 
-    if (io_ == nullptr) {
-      io_ = CreateThreadpoolIo(handle_, OnCompleted, this, nullptr);
-      if (io_ == nullptr)
-        result = HRESULT_FROM_LAST_ERROR();
-    }
+  if (io_ == nullptr) {
+    io_ = CreateThreadpoolIo(handle_, OnCompleted, this, executor_);
+    if (io_ == nullptr)
+      result = HRESULT_FROM_LAST_ERROR();
   }
 
-  StartThreadpoolIo(io_);
+  if (SUCCEEDED(result) && context->cancelled)
+    result = context->CancelResult();
 
   if (SUCCEEDED(result)) {
+    StartThreadpoolIo(io_);
+
     BOOL succeeded;
     switch (context->type) {
       case GeneralRequest::Read:
@@ -267,12 +289,20 @@ void HandleStream::OnRequested(AbstractStream::AsyncContext* async_context) {
     DWORD error = GetLastError();
     if (!succeeded && error != ERROR_IO_PENDING)
       result = __HRESULT_FROM_WIN32(error);
+
+    if (FAILED(result))
+      CancelThreadpoolIo(io_);
   }
 
-  if (FAILED(result)) {
-    CancelThreadpoolIo(io_);
+  lock_.Unlock();
+
+  if (FAILED(result))
     OnCompleted(context, result, 0);
-  }
+}
+
+void HandleStream::CancelRequest(AbstractStream::AsyncContext* async_context) {
+  if (IsValid())
+    CancelIoEx(handle_, static_cast<AsyncContext*>(async_context));
 }
 
 void CALLBACK HandleStream::OnCompleted(PTP_CALLBACK_INSTANCE /*callback*/,
@@ -290,12 +320,34 @@ void HandleStream::OnCompleted(AsyncContext* context, HRESULT result,
   {
     madoka::concurrent::LockGuard guard(&lock_);
 
-    if (!IsValidRequest(context) || context->listener == nullptr)
+    if (!IsValidRequest(context))
       return;
+
+    if (context->cancelled &&
+        result == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED))
+      result = context->CancelResult();
+
+    if (context->listener == nullptr) {
+      if (context->hEvent != NULL)
+        return;
+
+      context->result = result;
+    }
+  }
+
+  if (context->listener == nullptr) {
+    SetCompleted(context);
+    return;
   }
 
   auto listener = static_cast<Listener*>(context->listener);
 
+  // The listener may reuse the storage of a context it provided, so such a
+  // context is ended first; the stream is kept until the listener returns.
+  bool owned = context->owned;
+  if (!owned)
+    EndRequestBeforeCallback(context);
+
   switch (context->type) {
     case GeneralRequest::Read:
       listener->OnRead(this, result, context->buffer, length);
@@ -310,7 +362,10 @@ void HandleStream::OnCompleted(AsyncContext* context, HRESULT result,
       break;
   }
 
-  AbstractStream::EndRequest(context);
+  if (owned)
+    AbstractStream::EndRequest(context);
+  else
+    EndCallback();
 }
 
 }  // namespace io
@@ -0,0 +1,100 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef IO_OPERATION_TABLE_H_
+#define IO_OPERATION_TABLE_H_
+
+#include <stdint.h>
+
+#include <madoka/io/operation.h>
+
+#include <vector>
+
+namespace madoka {
+namespace io {
+
+// Maps operation handles to the contexts of pending operations in constant
+// time. A handle is a slot index with the generation of the slot, which is
+// bumped whenever the slot is freed, so a stale handle never finds the
+// context that reused its slot. Freed slots are reused before the table
+// grows. Not synchronized; the owner guards it with a lock of its own.
+template<class T>
+class OperationTable {
+ public:
+  OperationTable() : free_(kNone) {
+  }
+
+  Operation Add(T* context) {
+    uint32_t index;
+    if (free_ != kNone) {
+      index = free_;
+      free_ = slots_[index].next_free;
+    } else {
+      index = static_cast<uint32_t>(slots_.size());
+      slots_.push_back(Slot());
+    }
+
+    auto& slot = slots_[index];
+    slot.context = context;
+
+    return static_cast<Operation>(slot.generation) << 32 | index;
+  }
+
+  T* Find(Operation operation) const {
+    uint32_t index = static_cast<uint32_t>(operation);
+    if (index >= slots_.size())
+      return nullptr;
+
+    auto& slot = slots_[index];
+    if (slot.generation != static_cast<uint32_t>(operation >> 32))
+      return nullptr;
+
+    return slot.context;
+  }
+
+  // Does nothing if |operation| was removed already.
+  void Remove(Operation operation) {
+    if (Find(operation) == nullptr)
+      return;
+
+    uint32_t index = static_cast<uint32_t>(operation);
+    auto& slot = slots_[index];
+    slot.context = nullptr;
+
+    // Generation zero is never used so that no handle equals kNoOperation.
+    if (++slot.generation == 0)
+      slot.generation = 1;
+
+    slot.next_free = free_;
+    free_ = index;
+  }
+
+  // Calls |function| with every context in the table. |function| may remove
+  // the context it is given, but no other.
+  template<class Function>
+  void ForEach(Function function) {
+    for (auto& slot : slots_) {
+      if (slot.context != nullptr)
+        function(slot.context);
+    }
+  }
+
+ private:
+  static const uint32_t kNone = UINT32_MAX;
+
+  struct Slot {
+    Slot() : context(nullptr), generation(1), next_free(kNone) {
+    }
+
+    T* context;
+    uint32_t generation;
+    uint32_t next_free;
+  };
+
+  std::vector<Slot> slots_;
+  uint32_t free_;
+};
+
+}  // namespace io
+}  // namespace madoka
+
+#endif  // IO_OPERATION_TABLE_H_
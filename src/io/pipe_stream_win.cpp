@@ -30,6 +30,10 @@ struct PipeStream::AsyncContext : HandleStream::AsyncContext{
 PipeStream::PipeStream() : connected_(false) {
 }
 
+PipeStream::PipeStream(madoka::concurrent::Executor executor)
+    : HandleStream(executor), connected_(false) {
+}
+
 PipeStream::~PipeStream() {
   Reset();
 }
@@ -83,6 +87,22 @@ HRESULT PipeStream::Create(const char* name, DWORD pipe_mode) {
 }
 
 void PipeStream::WaitForConnectionAsync(Listener* listener) {
+  WaitForConnectionAsync(listener, kNoTimeout, nullptr);
+}
+
+void PipeStream::WaitForConnectionAsync(Listener* listener,
+                                        std::chrono::milliseconds timeout) {
+  WaitForConnectionAsync(listener, timeout, nullptr);
+}
+
+void PipeStream::WaitForConnectionAsync(Listener* listener,
+                                        ContextStorage* storage) {
+  WaitForConnectionAsync(listener, kNoTimeout, storage);
+}
+
+void PipeStream::WaitForConnectionAsync(Listener* listener,
+                                        std::chrono::milliseconds timeout,
+                                        ContextStorage* storage) {
   HRESULT result = S_OK;
 
   if (listener == nullptr)
@@ -92,9 +112,9 @@ void PipeStream::WaitForConnectionAsync(Listener* listener) {
 
   if (SUCCEEDED(result)) {
     auto context = CreateContext<AsyncContext>(PipeRequest::WaitForConnection,
-                                               nullptr, 0, listener);
+                                               nullptr, 0, listener, storage);
     if (context != nullptr)
-      result = DispatchRequest(std::move(context));
+      result = DispatchRequest(std::move(context), timeout);
     else
       result = E_OUTOFMEMORY;
   }
@@ -104,8 +124,6 @@ void PipeStream::WaitForConnectionAsync(Listener* listener) {
 }
 
 PipeStream::AsyncContext* PipeStream::BeginWaitForConnection(HANDLE event) {
-  if (event == NULL)
-    return nullptr;
   if (!IsValid())
     return nullptr;
 
@@ -142,31 +160,11 @@ HRESULT PipeStream::WaitForConnection() {
   if (!IsValid())
     return E_HANDLE;
 
-  HANDLE event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
-  if (event == NULL)
-    return HRESULT_FROM_LAST_ERROR();
-
-  HRESULT result = S_OK;
-
-  do {
-    auto context = BeginWaitForConnection(event);
-    if (context == nullptr) {
-      result = E_FAIL;
-      break;
-    }
-
-    if (!WaitForSingleObject(event, INFINITE) != WAIT_OBJECT_0) {
-      result = HRESULT_FROM_LAST_ERROR();
-      EndWaitForConnection(context);
-      break;
-    }
-
-    result = EndWaitForConnection(context);
-  } while (false);
-
-  CloseHandle(event);
+  auto context = BeginWaitForConnection(NULL);
+  if (context == nullptr)
+    return E_FAIL;
 
-  return result;
+  return EndWaitForConnection(context);
 }
 
 HRESULT PipeStream::Disconnect() {
@@ -410,6 +408,14 @@ HRESULT PipeStream::PeekData(void* buffer, DWORD length, DWORD* bytes_read,
 void PipeStream::TransactDataAsync(void* write_buffer, DWORD write_length,
                                    void* read_buffer, DWORD read_length,
                                    Listener* listener) {
+  TransactDataAsync(write_buffer, write_length, read_buffer, read_length,
+                    listener, nullptr);
+}
+
+void PipeStream::TransactDataAsync(void* write_buffer, DWORD write_length,
+                                   void* read_buffer, DWORD read_length,
+                                   Listener* listener,
+                                   ContextStorage* storage) {
   HRESULT result = S_OK;
 
   if (listener == nullptr)
@@ -419,7 +425,7 @@ void PipeStream::TransactDataAsync(void* write_buffer, DWORD write_length,
 
   if (SUCCEEDED(result)) {
     auto context = CreateContext<AsyncContext>(
-        PipeRequest::Transact, write_buffer, write_length, listener);
+        PipeRequest::Transact, write_buffer, write_length, listener, storage);
     if (context != nullptr) {
       context->buffer2 = read_buffer;
       context->length2 = read_length;
@@ -438,8 +444,6 @@ PipeStream::AsyncContext* PipeStream::BeginTransactData(void* write_buffer,
                                                         void* read_buffer,
                                                         DWORD read_length,
                                                         HANDLE event) {
-  if (event == NULL)
-    return nullptr;
   if (!IsValid())
     return nullptr;
 
@@ -471,32 +475,19 @@ HRESULT PipeStream::EndTransactData(AsyncContext* context, DWORD* read_length) {
 
 HRESULT PipeStream::TransactData(void* write_buffer, DWORD write_length,
                                  void* read_buffer, DWORD* read_length) {
-  HANDLE event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
-  if (event == NULL)
-    return HRESULT_FROM_LAST_ERROR();
-
-  HRESULT result = S_OK;
-
-  do {
-    auto context = BeginTransactData(write_buffer, write_length, read_buffer,
-                                     *read_length, event);
-    if (context == nullptr) {
-      result = E_FAIL;
-      break;
-    }
-
-    if (WaitForSingleObject(event, INFINITE) != WAIT_OBJECT_0) {
-      result = HRESULT_FROM_LAST_ERROR();
-      EndTransactData(context, read_length);
-      break;
-    }
+  if (read_length == nullptr)
+    return E_INVALIDARG;
 
-    result = EndTransactData(context, read_length);
-  } while (false);
+  auto context = BeginTransactData(write_buffer, write_length, read_buffer,
+                                   *read_length, NULL);
+  if (context == nullptr)
+    return E_FAIL;
 
-  CloseHandle(event);
+  return EndTransactData(context, read_length);
+}
 
-  return result;
+bool PipeStream::Cancel(AsyncContext* context) {
+  return HandleStream::Cancel(context);
 }
 
 HRESULT PipeStream::OnCustomRequested(
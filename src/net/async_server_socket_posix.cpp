@@ -0,0 +1,414 @@
+// Copyright (c) 2016 dacci.org
+
+#include "madoka/net/async_server_socket.h"
+
+#include <assert.h>
+#include <sys/epoll.h>
+
+#include <iterator>
+
+#include "madoka/concurrent/lock_guard.h"
+
+#include "concurrent/object_pool.h"
+#include "io/operation_table.h"
+#include "net/reactor_posix.h"
+
+namespace madoka {
+namespace net {
+
+namespace {
+const std::chrono::milliseconds kNoTimeout =
+    (std::chrono::milliseconds::max)();
+}  // namespace
+
+struct AsyncServerSocket::Context
+    : madoka::concurrent::MpscQueueEntry,
+      madoka::concurrent::PooledObject<AsyncServerSocket::Context>,
+      madoka::concurrent::TimerWheel::Timer {
+  Context()
+      : server(nullptr),
+        timeout(kNoTimeout),
+        operation(madoka::io::kNoOperation),
+        pending(false),
+        aborted(S_OK),
+        result(S_OK),
+        listener(nullptr),
+        socket(INVALID_SOCKET),
+        address(),
+        address_length(sizeof(address)) {
+  }
+
+  ~Context() {
+    if (socket != INVALID_SOCKET) {
+      closesocket(socket);
+      socket = INVALID_SOCKET;
+    }
+  }
+
+  AsyncServerSocket* server;
+  std::chrono::milliseconds timeout;
+
+  madoka::io::Operation operation;
+  // Whether the context waits in |accepts_|, and where.
+  bool pending;
+  std::list<std::unique_ptr<Context>>::iterator position;
+  // Set once the context has been taken off the pending list to fail, by
+  // its timer or by cancellation.
+  HRESULT aborted;
+
+  HRESULT result;
+  Listener* listener;
+  SOCKET socket;
+  sockaddr_storage address;
+  socklen_t address_length;
+};
+
+madoka::concurrent::ThreadPool* AsyncServerSocket::default_pool_ = nullptr;
+
+AsyncServerSocket::AsyncServerSocket() : AsyncServerSocket(nullptr) {
+}
+
+AsyncServerSocket::AsyncServerSocket(int family, int type, int protocol)
+    : AsyncServerSocket() {
+  Create(family, type, protocol);
+}
+
+AsyncServerSocket::AsyncServerSocket(madoka::concurrent::Executor executor)
+    : operations_(std::make_unique<madoka::io::OperationTable<Context>>()),
+      reactor_(Reactor::GetDefault()),
+      work_(reactor_->CreateWork(
+          OnRequested, this, executor != nullptr ? executor : default_pool_)),
+      io_(nullptr) {
+  lock_.SetName("madoka::net::AsyncServerSocket");
+}
+
+AsyncServerSocket::AsyncServerSocket(int family, int type, int protocol,
+                                     madoka::concurrent::Executor executor)
+    : AsyncServerSocket(executor) {
+  Create(family, type, protocol);
+}
+
+AsyncServerSocket::~AsyncServerSocket() {
+  Close();
+
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (work_ != nullptr) {
+    ReactorWork* work = work_;
+    work_ = nullptr;
+
+    lock_.Unlock();
+    reactor_->WaitForWorkCallbacks(work);
+    lock_.Lock();
+
+    reactor_->CloseWork(work);
+  }
+
+  if (io_ != nullptr) {
+    ReactorIo* io = io_;
+    io_ = nullptr;
+
+    lock_.Unlock();
+    reactor_->CloseIo(io);
+    lock_.Lock();
+  }
+}
+
+madoka::concurrent::ThreadPool* AsyncServerSocket::GetThreadPool() {
+  return default_pool_;
+}
+
+void AsyncServerSocket::SetThreadPool(madoka::concurrent::ThreadPool* pool) {
+  default_pool_ = pool;
+}
+
+void AsyncServerSocket::Close() {
+  std::list<std::unique_ptr<Context>> aborted;
+
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    if (io_ != nullptr)
+      reactor_->DetachIo(io_);
+
+    ServerSocket::Close();
+    listening_ = false;
+
+    aborted.swap(accepts_);
+
+    for (auto& context : aborted) {
+      context->pending = false;
+      operations_->Remove(context->operation);
+    }
+  }
+
+  for (auto& context : aborted)
+    OnCompleted(std::move(context), E_ABORT);
+}
+
+madoka::io::Operation AsyncServerSocket::AcceptAsync(Listener* listener) {
+  return AcceptAsync(listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncServerSocket::AcceptAsync(
+    Listener* listener, std::chrono::milliseconds timeout) {
+  HRESULT result = S_OK;
+
+  do {
+    if (listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = std::make_unique<Context>();
+    if (context == nullptr) {
+      result = E_POINTER;
+      break;
+    }
+
+    context->callback = OnTimedOut;
+    context->server = this;
+    context->timeout = timeout;
+    context->listener = listener;
+
+    if (work_ == nullptr) {
+      result = E_HANDLE;
+      break;
+    }
+
+    madoka::io::Operation operation;
+    {
+      madoka::concurrent::LockGuard guard(&lock_);
+      operation = context->operation = operations_->Add(context.get());
+    }
+
+    if (requests_.Push(context.release()))
+      reactor_->SubmitWork(work_);
+
+    return operation;
+  } while (false);
+
+  assert(FAILED(result));
+  listener->OnAccepted(this, result, nullptr);
+
+  return madoka::io::kNoOperation;
+}
+
+bool AsyncServerSocket::Cancel(madoka::io::Operation operation) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  auto context = operations_->Find(operation);
+  if (context == nullptr)
+    return false;
+
+  Abort(context, madoka::io::kOperationCancelled);
+
+  return true;
+}
+
+size_t AsyncServerSocket::CancelAccepts() {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  size_t count = 0;
+  operations_->ForEach([this, &count](Context* context) {
+    Abort(context, madoka::io::kOperationCancelled);
+    ++count;
+  });
+
+  return count;
+}
+
+SOCKET AsyncServerSocket::RawEndAccept(Context* context, HRESULT* result) {
+  SOCKET descriptor = INVALID_SOCKET;
+
+  HRESULT local_result = S_OK;
+
+  do {
+    if (FAILED(context->result)) {
+      local_result = context->result;
+      break;
+    }
+
+    descriptor = context->socket;
+    context->socket = INVALID_SOCKET;
+  } while (false);
+
+  if (result != nullptr)
+    *result = local_result;
+
+  return descriptor;
+}
+
+void AsyncServerSocket::OnRequested(void* instance, ReactorWork* work) {
+  static_cast<AsyncServerSocket*>(instance)->OnRequested(work);
+}
+
+void AsyncServerSocket::OnRequested(ReactorWork* work) {
+  HRESULT result = S_OK;
+
+  lock_.Lock();
+
+  bool more;
+  std::unique_ptr<Context> context(requests_.Pop(&more));
+  if (more)
+    reactor_->SubmitWork(work);
+
+  do {
+    if (FAILED(context->aborted)) {
+      result = context->aborted;
+      break;
+    }
+
+    if (!IsValid()) {
+      result = HRESULT_FROM_ERRNO(ENOTSOCK);
+      break;
+    }
+
+    if (!bound_) {
+      result = HRESULT_FROM_ERRNO(EINVAL);
+      break;
+    }
+
+    if (!Attach()) {
+      result = HRESULT_FROM_ERRNO(errno);
+      break;
+    }
+
+    if (accepts_.empty()) {
+      result = Perform(context.get());
+      if (result != E_PENDING)
+        break;
+
+      result = S_OK;
+    }
+
+    if (context->timeout != kNoTimeout)
+      madoka::concurrent::TimerWheel::GetDefault()->Start(context.get(),
+                                                          context->timeout);
+
+    accepts_.push_back(std::move(context));
+    accepts_.back()->pending = true;
+    accepts_.back()->position = std::prev(accepts_.end());
+  } while (false);
+
+  if (context != nullptr)
+    operations_->Remove(context->operation);
+
+  lock_.Unlock();
+
+  if (context != nullptr)
+    OnCompleted(std::move(context), result);
+}
+
+void AsyncServerSocket::OnReady(void* instance, uint32_t events) {
+  static_cast<AsyncServerSocket*>(instance)->OnReady(events);
+}
+
+void AsyncServerSocket::OnReady(uint32_t events) {
+  std::list<std::unique_ptr<Context>> completed;
+
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) == 0)
+    return;
+
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    while (!accepts_.empty()) {
+      HRESULT result = Perform(accepts_.front().get());
+      if (result == E_PENDING)
+        break;
+
+      accepts_.front()->result = result;
+      accepts_.front()->pending = false;
+      operations_->Remove(accepts_.front()->operation);
+      completed.splice(completed.end(), accepts_, accepts_.begin());
+    }
+  }
+
+  for (auto& context : completed)
+    OnCompleted(std::move(context), context->result);
+}
+
+bool AsyncServerSocket::Attach() {
+  if (io_ == nullptr) {
+    io_ = reactor_->CreateIo(OnReady, this, work_->pool);
+    if (io_ == nullptr) {
+      errno = ENOMEM;
+      return false;
+    }
+  }
+
+  return reactor_->AttachIo(io_, descriptor_);
+}
+
+HRESULT AsyncServerSocket::Perform(Context* context) {
+  for (;;) {
+    context->address_length = sizeof(context->address);
+    context->socket = accept4(descriptor_,
+                              reinterpret_cast<sockaddr*>(&context->address),
+                              &context->address_length, SOCK_CLOEXEC);
+    if (context->socket != INVALID_SOCKET)
+      return S_OK;
+
+    switch (errno) {
+      case EINTR:
+      case ECONNABORTED:
+        continue;
+
+      case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+      case EWOULDBLOCK:
+#endif
+        return E_PENDING;
+
+      default:
+        return HRESULT_FROM_ERRNO(errno);
+    }
+  }
+}
+
+void AsyncServerSocket::OnTimedOut(
+    madoka::concurrent::TimerWheel::Timer* timer) {
+  auto context = static_cast<Context*>(timer);
+  context->server->OnTimedOut(context);
+}
+
+// Hands the context back to OnRequested to complete it off the thread of the
+// timer wheel; see AsyncSocket::OnTimedOut.
+void AsyncServerSocket::OnTimedOut(Context* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (context->pending)
+    Abort(context, HRESULT_FROM_ERRNO(ETIMEDOUT));
+}
+
+// Called with |lock_| held for a context still in |operations_|; see
+// AsyncSocket::Abort.
+void AsyncServerSocket::Abort(Context* context, HRESULT result) {
+  operations_->Remove(context->operation);
+  context->aborted = result;
+
+  if (!context->pending)
+    return;
+
+  context->position->release();
+  accepts_.erase(context->position);
+  context->pending = false;
+
+  if (requests_.Push(context))
+    reactor_->SubmitWork(work_);
+}
+
+void AsyncServerSocket::OnCompleted(std::unique_ptr<Context>&& context,
+                                    HRESULT result) {
+  if (context->timeout != kNoTimeout)
+    madoka::concurrent::TimerWheel::GetDefault()->Cancel(context.get());
+
+  context->result = result;
+
+  assert(context->listener != nullptr);
+  context->listener->OnAccepted(this, result, context.get());
+}
+
+}  // namespace net
+}  // namespace madoka
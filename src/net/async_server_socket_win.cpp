@@ -6,21 +6,34 @@
 
 #include "madoka/concurrent/lock_guard.h"
 
+#include "concurrent/object_pool.h"
+#include "io/operation_table.h"
+
 namespace madoka {
 namespace net {
 
 namespace {
 LPFN_ACCEPTEX AcceptEx = nullptr;
+
+const std::chrono::milliseconds kNoTimeout =
+    (std::chrono::milliseconds::max)();
 }  // namespace
 
-struct AsyncServerSocket::Context : OVERLAPPED {
+struct AsyncServerSocket::Context
+    : madoka::concurrent::MpscQueueEntry,
+      madoka::concurrent::PooledObject<AsyncServerSocket::Context>,
+      madoka::concurrent::TimerWheel::Timer,
+      OVERLAPPED {
   Context()
       : OVERLAPPED(),
+        server(nullptr),
+        timeout(kNoTimeout),
+        operation(madoka::io::kNoOperation),
+        aborted(S_OK),
         result(S_OK),
         listener(nullptr),
         event(NULL),
-        socket(INVALID_SOCKET),
-        buffer(new char[(sizeof(sockaddr_storage) + 16) * 2]) {
+        socket(INVALID_SOCKET) {
   }
 
   ~Context() {
@@ -30,19 +43,25 @@ struct AsyncServerSocket::Context : OVERLAPPED {
     }
   }
 
+  AsyncServerSocket* server;
+  std::chrono::milliseconds timeout;
+
+  madoka::io::Operation operation;
+  // Set once the accept has been asked to stop, by its timer or by
+  // cancellation, to what it is to complete with instead of being aborted.
+  HRESULT aborted;
+
   HRESULT result;
   Listener* listener;
   HANDLE event;
   SOCKET socket;
-  std::unique_ptr<char[]> buffer;
+  // Receives the local and remote addresses from AcceptEx.
+  char buffer[(sizeof(sockaddr_storage) + 16) * 2];
 };
 
-PTP_CALLBACK_ENVIRON AsyncServerSocket::environment_ = NULL;
+PTP_CALLBACK_ENVIRON AsyncServerSocket::default_environment_ = NULL;
 
-AsyncServerSocket::AsyncServerSocket()
-    : work_(CreateThreadpoolWork(OnRequested, this, environment_)),
-      protocol_(),
-      io_(nullptr) {
+AsyncServerSocket::AsyncServerSocket() : AsyncServerSocket(nullptr) {
 }
 
 AsyncServerSocket::AsyncServerSocket(int family, int type, int protocol)
@@ -50,6 +69,21 @@ AsyncServerSocket::AsyncServerSocket(int family, int type, int protocol)
   Create(family, type, protocol);
 }
 
+AsyncServerSocket::AsyncServerSocket(madoka::concurrent::Executor executor)
+    : operations_(std::make_unique<madoka::io::OperationTable<Context>>()),
+      environment_(executor != nullptr ? executor : default_environment_),
+      work_(CreateThreadpoolWork(OnRequested, this, environment_)),
+      protocol_(),
+      io_(nullptr) {
+  lock_.SetName("madoka::net::AsyncServerSocket");
+}
+
+AsyncServerSocket::AsyncServerSocket(int family, int type, int protocol,
+                                     madoka::concurrent::Executor executor)
+    : AsyncServerSocket(executor) {
+  Create(family, type, protocol);
+}
+
 AsyncServerSocket::~AsyncServerSocket() {
   Close();
 
@@ -85,15 +119,20 @@ void AsyncServerSocket::Close() {
 }
 
 PTP_CALLBACK_ENVIRON AsyncServerSocket::GetCallbackEnvironment() {
-  return environment_;
+  return default_environment_;
 }
 
 void AsyncServerSocket::SetCallbackEnvironment(
     PTP_CALLBACK_ENVIRON environment) {
-  environment_ = environment;
+  default_environment_ = environment;
 }
 
-void AsyncServerSocket::AcceptAsync(Listener* listener) {
+madoka::io::Operation AsyncServerSocket::AcceptAsync(Listener* listener) {
+  return AcceptAsync(listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncServerSocket::AcceptAsync(
+    Listener* listener, std::chrono::milliseconds timeout) {
   HRESULT result = S_OK;
 
   do {
@@ -103,29 +142,61 @@ void AsyncServerSocket::AcceptAsync(Listener* listener) {
     }
 
     auto context = std::make_unique<Context>();
-    if (context == nullptr || context->buffer == nullptr) {
+    if (context == nullptr) {
       result = E_POINTER;
       break;
     }
 
+    context->callback = OnTimedOut;
+    context->server = this;
+    context->timeout = timeout;
     context->listener = listener;
 
-    madoka::concurrent::LockGuard guard(&lock_);
-
     if (work_ == nullptr) {
       result = E_HANDLE;
       break;
     }
 
-    requests_.push_back(std::move(context));
-    if (requests_.size() == 1)
+    madoka::io::Operation operation;
+    {
+      madoka::concurrent::LockGuard guard(&lock_);
+      operation = context->operation = operations_->Add(context.get());
+    }
+
+    if (requests_.Push(context.release()))
       SubmitThreadpoolWork(work_);
 
-    return;
+    return operation;
   } while (false);
 
   assert(FAILED(result));
   listener->OnAccepted(this, result, nullptr);
+
+  return madoka::io::kNoOperation;
+}
+
+bool AsyncServerSocket::Cancel(madoka::io::Operation operation) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  auto context = operations_->Find(operation);
+  if (context == nullptr)
+    return false;
+
+  Abort(context, madoka::io::kOperationCancelled);
+
+  return true;
+}
+
+size_t AsyncServerSocket::CancelAccepts() {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  size_t count = 0;
+  operations_->ForEach([this, &count](Context* context) {
+    Abort(context, madoka::io::kOperationCancelled);
+    ++count;
+  });
+
+  return count;
 }
 
 AsyncServerSocket::Context* AsyncServerSocket::BeginAccept(HANDLE event) {
@@ -133,21 +204,23 @@ AsyncServerSocket::Context* AsyncServerSocket::BeginAccept(HANDLE event) {
     return nullptr;
 
   auto context = std::make_unique<Context>();
-  if (context == nullptr || context->buffer == nullptr)
+  if (context == nullptr)
     return nullptr;
 
   context->event = event;
 
-  madoka::concurrent::LockGuard guard(&lock_);
-
   if (work_ == nullptr)
     return nullptr;
 
   ResetEvent(event);
 
-  auto pointer = context.get();
-  requests_.push_back(std::move(context));
-  if (requests_.size() == 1)
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    context->operation = operations_->Add(context.get());
+  }
+
+  auto pointer = context.release();
+  if (requests_.Push(pointer))
     SubmitThreadpoolWork(work_);
 
   return pointer;
@@ -193,12 +266,17 @@ void AsyncServerSocket::OnRequested(PTP_WORK work) {
 
   lock_.Lock();
 
-  auto context = std::move(requests_.front());
-  requests_.pop_front();
-  if (!requests_.empty())
+  bool more;
+  std::unique_ptr<Context> context(requests_.Pop(&more));
+  if (more)
     SubmitThreadpoolWork(work);
 
   do {
+    if (FAILED(context->aborted)) {
+      result = context->aborted;
+      break;
+    }
+
     if (!IsValid()) {
       result = __HRESULT_FROM_WIN32(WSAENOTSOCK);
       break;
@@ -244,11 +322,16 @@ void AsyncServerSocket::OnRequested(PTP_WORK work) {
       break;
     }
 
+    // Armed before the accept is started, which may complete right away.
+    if (context->timeout != kNoTimeout)
+      madoka::concurrent::TimerWheel::GetDefault()->Start(context.get(),
+                                                          context->timeout);
+
     StartThreadpoolIo(io_);
 
     BOOL succeeded = AcceptEx(descriptor_,
                               context->socket,
-                              context->buffer.get(),
+                              context->buffer,
                               0,        // buffer to receive
                               sizeof(sockaddr_storage) + 16,
                               sizeof(sockaddr_storage) + 16,
@@ -281,8 +364,45 @@ void CALLBACK AsyncServerSocket::OnCompleted(PTP_CALLBACK_INSTANCE /*callback*/,
       __HRESULT_FROM_WIN32(error));
 }
 
+void AsyncServerSocket::OnTimedOut(
+    madoka::concurrent::TimerWheel::Timer* timer) {
+  auto context = static_cast<Context*>(timer);
+  context->server->OnTimedOut(context);
+}
+
+// The context stays alive meanwhile: OnCompleted cancels the timer, which
+// waits for this to return.
+void AsyncServerSocket::OnTimedOut(Context* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (operations_->Find(context->operation) == context)
+    Abort(context, __HRESULT_FROM_WIN32(WSAETIMEDOUT));
+}
+
+// Called with |lock_| held for a context still in |operations_|; see
+// AsyncSocket::Abort.
+void AsyncServerSocket::Abort(Context* context, HRESULT result) {
+  operations_->Remove(context->operation);
+  context->aborted = result;
+
+  if (IsValid())
+    CancelIoEx(reinterpret_cast<HANDLE>(descriptor_), context);
+}
+
 void AsyncServerSocket::OnCompleted(std::unique_ptr<Context>&& context,
                                     HRESULT result) {
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    operations_->Remove(context->operation);
+  }
+
+  if (context->timeout != kNoTimeout)
+    madoka::concurrent::TimerWheel::GetDefault()->Cancel(context.get());
+
+  if (FAILED(context->aborted) &&
+      result == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED))
+    result = context->aborted;
+
   if (SUCCEEDED(result)) {
     if (setsockopt(context->socket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
                    reinterpret_cast<char*>(&descriptor_),
@@ -0,0 +1,1305 @@
+// Copyright (c) 2016 dacci.org
+
+#include "madoka/net/async_socket.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "madoka/concurrent/lock_guard.h"
+
+#include "concurrent/object_pool.h"
+#include "io/operation_table.h"
+#include "net/reactor_posix.h"
+
+namespace madoka {
+namespace net {
+
+namespace {
+enum Request {
+  Invalid, Connect, Receive, ReceiveFrom, Send, SendTo, ReceiveBatch, SendBatch
+};
+
+const std::chrono::milliseconds kNoTimeout =
+    (std::chrono::milliseconds::max)();
+
+// Completions passed to Listener::OnBatchCompleted at most in one call.
+const size_t kMaxCompletions = 64;
+
+// Pieces of a vectored operation kept in the context itself; more than that
+// are allocated.
+const int kInlinePieces = 4;
+}  // namespace
+
+struct AsyncSocket::Context
+    : madoka::concurrent::MpscQueueEntry,
+      madoka::concurrent::PooledObject<AsyncSocket::Context>,
+      madoka::concurrent::TimerWheel::Timer,
+      iovec {
+  Context()
+      : iovec(),
+        socket(nullptr),
+        timeout(kNoTimeout),
+        operation(madoka::io::kNoOperation),
+        pending(nullptr),
+        aborted(S_OK),
+        request(Request::Invalid),
+        result(S_OK),
+        end_point(nullptr),
+        flags(0),
+        address(),
+        address_length(sizeof(address)),
+        listener(nullptr),
+        transferred(0),
+        pieces(nullptr),
+        piece_count(0),
+        datagrams(nullptr),
+        datagram_count(0),
+        zero_copy_first(0),
+        zero_copy_sends(0),
+        zero_copy_held(0) {
+  }
+
+  AsyncSocket* socket;
+  std::chrono::milliseconds timeout;
+
+  madoka::io::Operation operation;
+  // The list the context waits in, if any, and where.
+  std::list<std::unique_ptr<Context>>* pending;
+  std::list<std::unique_ptr<Context>>::iterator position;
+  // Set once the context has been taken off the pending list to fail, by
+  // its timer or by cancellation.
+  HRESULT aborted;
+
+  Request request;
+  HRESULT result;
+  const addrinfo* end_point;
+  int flags;
+  sockaddr_storage address;
+  socklen_t address_length;
+  Listener* listener;
+  size_t transferred;
+
+  // What a vectored operation has yet to fill or send, in |inline_pieces| or
+  // |more_pieces|. The inherited iovec then holds the array of the caller and
+  // the total length.
+  iovec* pieces;
+  int piece_count;
+  iovec inline_pieces[kInlinePieces];
+  std::unique_ptr<iovec[]> more_pieces;
+
+  // What a batch receives or sends; |transferred| counts the datagrams done.
+  Datagram* datagrams;
+  int datagram_count;
+
+  // The numbers of the sends with MSG_ZEROCOPY made for the operation,
+  // |zero_copy_sends| of them from |zero_copy_first| on, and how many of
+  // those the kernel still holds the buffer for.
+  uint32_t zero_copy_first;
+  uint32_t zero_copy_sends;
+  uint32_t zero_copy_held;
+};
+
+namespace {
+
+HRESULT SetPieces(AsyncSocket::Context* context, const iovec* buffers,
+                  int count) {
+  if (buffers == nullptr || count <= 0 || count > IOV_MAX)
+    return E_INVALIDARG;
+
+  size_t length = 0;
+  for (int i = 0; i < count; ++i) {
+    if (buffers[i].iov_base == nullptr && buffers[i].iov_len != 0)
+      return E_INVALIDARG;
+
+    length += buffers[i].iov_len;
+    if (length > INT_MAX)
+      return E_INVALIDARG;
+  }
+
+  if (count <= kInlinePieces) {
+    context->pieces = context->inline_pieces;
+  } else {
+    context->more_pieces.reset(new (std::nothrow) iovec[count]);
+    if (context->more_pieces == nullptr)
+      return E_OUTOFMEMORY;
+
+    context->pieces = context->more_pieces.get();
+  }
+
+  std::copy(buffers, buffers + count, context->pieces);
+  context->piece_count = count;
+  context->iov_base = const_cast<iovec*>(buffers);
+  context->iov_len = length;
+
+  return S_OK;
+}
+
+// Takes the zero-copy sends from |first| to |last| the kernel has let go of
+// off what |context| waits for. The numbers wrap around.
+void Release(AsyncSocket::Context* context, uint32_t first, uint32_t last) {
+  if (context->zero_copy_held == 0)
+    return;
+
+  int64_t begin = static_cast<int32_t>(first - context->zero_copy_first);
+  int64_t end = static_cast<int32_t>(last - context->zero_copy_first) + 1LL;
+  begin = std::max<int64_t>(begin, 0);
+  end = std::min<int64_t>(end, context->zero_copy_sends);
+
+  if (begin < end)
+    context->zero_copy_held -= static_cast<uint32_t>(end - begin);
+}
+
+// Drops the first |length| bytes from the pieces of |context|.
+void ConsumePieces(AsyncSocket::Context* context, size_t length) {
+  while (context->piece_count > 0 && length >= context->pieces->iov_len) {
+    length -= context->pieces->iov_len;
+    ++context->pieces;
+    --context->piece_count;
+  }
+
+  if (length > 0) {
+    context->pieces->iov_base =
+        static_cast<char*>(context->pieces->iov_base) + length;
+    context->pieces->iov_len -= length;
+  }
+}
+
+}  // namespace
+
+madoka::concurrent::ThreadPool* AsyncSocket::default_pool_ = nullptr;
+
+AsyncSocket::AsyncSocket() : AsyncSocket(nullptr) {
+}
+
+AsyncSocket::AsyncSocket(int family, int type, int protocol) : AsyncSocket() {
+  Create(family, type, protocol);
+}
+
+AsyncSocket::AsyncSocket(madoka::concurrent::Executor executor)
+    : operations_(std::make_unique<madoka::io::OperationTable<Context>>()),
+      reactor_(Reactor::GetDefault()),
+      work_(reactor_->CreateWork(
+          OnRequested, this, executor != nullptr ? executor : default_pool_)),
+      cancel_connect_(false),
+      io_(nullptr),
+      zero_copy_threshold_(0),
+      zero_copy_(false),
+      zero_copy_next_(0),
+      draining_(INVALID_SOCKET) {
+  lock_.SetName("madoka::net::AsyncSocket");
+}
+
+AsyncSocket::AsyncSocket(int family, int type, int protocol,
+                         madoka::concurrent::Executor executor)
+    : AsyncSocket(executor) {
+  Create(family, type, protocol);
+}
+
+AsyncSocket::~AsyncSocket() {
+  Close();
+
+  std::list<std::unique_ptr<Context>> abandoned;
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    AbandonReleasing(&abandoned);
+  }
+
+  if (!abandoned.empty())
+    OnCompleted(&abandoned);
+
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (work_ != nullptr) {
+    ReactorWork* work = work_;
+    work_ = nullptr;
+
+    lock_.Unlock();
+    reactor_->WaitForWorkCallbacks(work);
+    lock_.Lock();
+
+    reactor_->CloseWork(work);
+  }
+
+  if (io_ != nullptr) {
+    ReactorIo* io = io_;
+    io_ = nullptr;
+
+    lock_.Unlock();
+    reactor_->CloseIo(io);
+    lock_.Lock();
+  }
+}
+
+madoka::concurrent::ThreadPool* AsyncSocket::GetThreadPool() {
+  return default_pool_;
+}
+
+void AsyncSocket::SetThreadPool(madoka::concurrent::ThreadPool* pool) {
+  default_pool_ = pool;
+}
+
+void AsyncSocket::Close() {
+  std::list<std::unique_ptr<Context>> aborted;
+
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    cancel_connect_ = true;
+
+    aborted.splice(aborted.end(), receives_);
+    aborted.splice(aborted.end(), sends_);
+
+    bool held = !releasing_.empty();
+    for (auto& context : aborted) {
+      context->pending = nullptr;
+      operations_->Remove(context->operation);
+      held = held || context->zero_copy_held > 0;
+    }
+
+    if (held && IsValid()) {
+      // Only the error queue tells when the kernel lets go of the buffers of
+      // zero-copy sends, so the socket is shut down but kept open until it
+      // has; see OnReady. The sends aborted here complete after those.
+      for (auto i = aborted.begin(); i != aborted.end();) {
+        auto context = i++;
+        if ((*context)->request == Request::Send ||
+            (*context)->request == Request::SendTo ||
+            (*context)->request == Request::SendBatch) {
+          (*context)->result = E_ABORT;
+          releasing_.splice(releasing_.end(), aborted, context);
+        }
+      }
+
+      Shutdown(SD_BOTH);
+      draining_ = descriptor_;
+      descriptor_ = INVALID_SOCKET;
+    } else if (io_ != nullptr && draining_ == INVALID_SOCKET) {
+      reactor_->DetachIo(io_);
+    }
+
+    Socket::Close();
+    zero_copy_ = false;
+  }
+
+  for (auto& context : aborted)
+    OnCompleted(std::move(context), E_ABORT);
+}
+
+void AsyncSocket::SetZeroCopyThreshold(size_t threshold) {
+  madoka::concurrent::LockGuard guard(&lock_);
+  zero_copy_threshold_ = threshold;
+}
+
+madoka::io::Operation AsyncSocket::ConnectAsync(const addrinfo* end_point,
+                                                Listener* listener) {
+  return ConnectAsync(end_point, listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncSocket::ConnectAsync(
+    const addrinfo* end_point, Listener* listener,
+    std::chrono::milliseconds timeout) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if (end_point == nullptr || listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::Connect, end_point, nullptr, 0, 0,
+                                 nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    context->timeout = timeout;
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnConnected(this, result, end_point);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::ReceiveAsync(void* buffer, int length,
+                                                int flags, Listener* listener) {
+  return ReceiveAsync(buffer, length, flags, listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncSocket::ReceiveAsync(
+    void* buffer, int length, int flags, Listener* listener,
+    std::chrono::milliseconds timeout) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if ((buffer == nullptr && length != 0) || listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::Receive, nullptr, buffer, length,
+                                 flags, nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    context->timeout = timeout;
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnReceived(this, result, buffer, 0, 0);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::ReceiveFromAsync(void* buffer, int length,
+                                                    int flags,
+                                                    Listener* listener) {
+  return ReceiveFromAsync(buffer, length, flags, listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncSocket::ReceiveFromAsync(
+    void* buffer, int length, int flags, Listener* listener,
+    std::chrono::milliseconds timeout) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if ((buffer == nullptr && length != 0) || listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::ReceiveFrom, nullptr, buffer, length,
+                                 flags, nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    context->timeout = timeout;
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnReceivedFrom(this, result, buffer, 0, 0, nullptr, 0);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::SendAsync(const void* buffer, int length,
+                                             int flags, Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if ((buffer == nullptr && length != 0) || listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::Send, nullptr,
+                                 const_cast<void*>(buffer), length, flags,
+                                 nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnSent(this, result, const_cast<void*>(buffer), 0);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::SendToAsync(const void* buffer, int length,
+                                               int flags, const void* address,
+                                               int address_length,
+                                               Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if ((buffer == nullptr && length != 0) || address == nullptr ||
+        address_length <= 0 ||
+        address_length > static_cast<int>(sizeof(sockaddr_storage)) ||
+        listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::SendTo, nullptr,
+                                 const_cast<void*>(buffer), length, flags,
+                                 address, address_length, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnSentTo(this, result, const_cast<void*>(buffer), 0,
+                       static_cast<const sockaddr*>(address), address_length);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::ReceiveVectorAsync(const Buffer* buffers,
+                                                      int count, int flags,
+                                                      Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if (listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::Receive, nullptr, nullptr, 0, flags,
+                                 nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    result = SetPieces(context.get(), buffers, count);
+    if (FAILED(result))
+      break;
+
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnReceived(this, result, const_cast<Buffer*>(buffers), 0, 0);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::SendVectorAsync(const Buffer* buffers,
+                                                   int count, int flags,
+                                                   Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if (listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::Send, nullptr, nullptr, 0, flags,
+                                 nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    result = SetPieces(context.get(), buffers, count);
+    if (FAILED(result))
+      break;
+
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnSent(this, result, const_cast<Buffer*>(buffers), 0);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::ReceiveFromBatchAsync(Datagram* datagrams,
+                                                         int count, int flags,
+                                                         Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if (datagrams == nullptr || count <= 0 || listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::ReceiveBatch, nullptr, nullptr, 0,
+                                 flags, nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    context->datagrams = datagrams;
+    context->datagram_count = count;
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result) && listener != nullptr)
+    listener->OnReceivedBatch(this, result, datagrams, 0);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::SendToBatchAsync(Datagram* datagrams,
+                                                    int count, int flags,
+                                                    Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if (datagrams == nullptr || count <= 0 || listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::SendBatch, nullptr, nullptr, 0,
+                                 flags, nullptr, 0, listener);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    context->datagrams = datagrams;
+    context->datagram_count = count;
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result) && listener != nullptr)
+    listener->OnSentBatch(this, result, datagrams, 0);
+
+  return operation;
+}
+
+bool AsyncSocket::Cancel(madoka::io::Operation operation) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  auto context = operations_->Find(operation);
+  if (context == nullptr)
+    return false;
+
+  Abort(context, madoka::io::kOperationCancelled);
+
+  return true;
+}
+
+size_t AsyncSocket::CancelReceives() {
+  return CancelAll(true);
+}
+
+size_t AsyncSocket::CancelSends() {
+  return CancelAll(false);
+}
+
+std::unique_ptr<AsyncSocket::Context> AsyncSocket::CreateContext(
+    int request, const addrinfo* end_point, void* buffer, int length,
+    int flags, const void* address, int address_length, Listener* listener) {
+  auto context = std::make_unique<Context>();
+  if (context != nullptr) {
+    context->callback = OnTimedOut;
+    context->request = static_cast<Request>(request);
+    context->end_point = end_point;
+    context->iov_base = buffer;
+    context->iov_len = std::max(length, 0);
+    context->flags = flags;
+
+    if (address != nullptr && address_length > 0) {
+      memmove(&context->address, address, address_length);
+      context->address_length = address_length;
+    }
+
+    context->listener = listener;
+  }
+
+  return context;
+}
+
+HRESULT AsyncSocket::RequestAsync(std::unique_ptr<Context>&& context,
+                                  madoka::io::Operation* operation) {
+  if (context == nullptr)
+    return E_INVALIDARG;
+  if (work_ == nullptr)
+    return E_HANDLE;
+
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    context->operation = operations_->Add(context.get());
+    *operation = context->operation;
+  }
+
+  if (requests_.Push(context.release()))
+    reactor_->SubmitWork(work_);
+
+  return S_OK;
+}
+
+void AsyncSocket::OnRequested(void* instance, ReactorWork* work) {
+  static_cast<AsyncSocket*>(instance)->OnRequested(work);
+}
+
+void AsyncSocket::OnRequested(ReactorWork* work) {
+  HRESULT result = S_OK;
+  std::list<std::unique_ptr<Context>> abandoned;
+
+  lock_.Lock();
+
+  bool more;
+  std::unique_ptr<Context> context(requests_.Pop(&more));
+  if (more)
+    reactor_->SubmitWork(work);
+
+  do {
+    if (FAILED(context->aborted)) {
+      result = context->aborted;
+      break;
+    }
+
+    if (context->request == Request::Connect) {
+      if (connected_) {
+        result = HRESULT_FROM_ERRNO(EISCONN);
+        break;
+      }
+
+      if (cancel_connect_) {
+        result = E_ABORT;
+        break;
+      }
+
+      if (!Create(context->end_point)) {
+        result = HRESULT_FROM_ERRNO(errno);
+        break;
+      }
+
+      cancel_connect_ = false;
+    } else if ((context->request == Request::Receive ||
+                context->request == Request::Send) &&
+               !connected_) {
+      result = HRESULT_FROM_ERRNO(ENOTCONN);
+      break;
+    } else if ((context->request == Request::ReceiveFrom ||
+                context->request == Request::ReceiveBatch) &&
+               !bound_) {
+      result = HRESULT_FROM_ERRNO(EINVAL);
+      break;
+    } else if (!IsValid()) {
+      result = HRESULT_FROM_ERRNO(ENOTSOCK);
+      break;
+    }
+
+    // The I/O object can only follow a new socket by leaving the one still
+    // open for its zero-copy sends.
+    if (draining_ != INVALID_SOCKET)
+      AbandonReleasing(&abandoned);
+
+    if (!Attach()) {
+      result = HRESULT_FROM_ERRNO(errno);
+      break;
+    }
+
+    std::list<std::unique_ptr<Context>>* pending;
+    switch (context->request) {
+      case Request::Connect:
+        if (connect(descriptor_, context->end_point->ai_addr,
+                    context->end_point->ai_addrlen) == 0) {
+          connected_ = true;
+          pending = nullptr;
+        } else if (errno == EINPROGRESS) {
+          pending = &sends_;
+        } else {
+          result = HRESULT_FROM_ERRNO(errno);
+          pending = nullptr;
+        }
+        break;
+
+      case Request::Receive:
+      case Request::ReceiveFrom:
+      case Request::ReceiveBatch:
+        pending = &receives_;
+        break;
+
+      case Request::Send:
+      case Request::SendTo:
+      case Request::SendBatch:
+        pending = &sends_;
+        break;
+
+      default:
+        assert(false);
+        pending = nullptr;
+        result = E_NOTIMPL;
+    }
+
+    if (pending == nullptr)
+      break;
+
+    // Operations in the same direction complete in order, so the new one is
+    // attempted right away only when nothing is waiting ahead of it.
+    if (context->request != Request::Connect && pending->empty()) {
+      result = Perform(context.get());
+      if (result != E_PENDING)
+        break;
+
+      result = S_OK;
+    }
+
+    if (context->timeout != kNoTimeout) {
+      context->socket = this;
+      madoka::concurrent::TimerWheel::GetDefault()->Start(context.get(),
+                                                          context->timeout);
+    }
+
+    pending->push_back(std::move(context));
+    pending->back()->pending = pending;
+    pending->back()->position = std::prev(pending->end());
+  } while (false);
+
+  if (context != nullptr) {
+    operations_->Remove(context->operation);
+
+    // Completes once the kernel has let go of its buffer and of those of the
+    // sends ahead of it; see OnReady.
+    bool send = context->request == Request::Send ||
+                context->request == Request::SendTo ||
+                context->request == Request::SendBatch;
+    if (context->zero_copy_held > 0 || (send && !releasing_.empty())) {
+      context->result = result;
+      releasing_.push_back(std::move(context));
+    }
+  }
+
+  lock_.Unlock();
+
+  if (!abandoned.empty())
+    OnCompleted(&abandoned);
+
+  if (context != nullptr)
+    OnCompleted(std::move(context), result);
+}
+
+void AsyncSocket::OnReady(void* instance, uint32_t events) {
+  static_cast<AsyncSocket*>(instance)->OnReady(events);
+}
+
+void AsyncSocket::OnReady(uint32_t events) {
+  std::list<std::unique_ptr<Context>> completed;
+
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      while (!receives_.empty()) {
+        HRESULT result = Perform(receives_.front().get());
+        if (result == E_PENDING)
+          break;
+
+        receives_.front()->result = result;
+        receives_.front()->pending = nullptr;
+        operations_->Remove(receives_.front()->operation);
+        completed.splice(completed.end(), receives_, receives_.begin());
+      }
+    }
+
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+      while (!sends_.empty()) {
+        HRESULT result = Perform(sends_.front().get());
+        if (result == E_PENDING)
+          break;
+
+        sends_.front()->result = result;
+        sends_.front()->pending = nullptr;
+        operations_->Remove(sends_.front()->operation);
+
+        auto& done =
+            sends_.front()->zero_copy_held > 0 || !releasing_.empty() ?
+                releasing_ : completed;
+        done.splice(done.end(), sends_, sends_.begin());
+      }
+    }
+
+    if ((events & EPOLLERR) &&
+        (zero_copy_ || draining_ != INVALID_SOCKET)) {
+      ReadErrorQueue();
+
+      // Sends still complete in order.
+      while (!releasing_.empty() && releasing_.front()->zero_copy_held == 0)
+        completed.splice(completed.end(), releasing_, releasing_.begin());
+
+      // The socket closed while the kernel held the buffers of its sends was
+      // kept open only for them.
+      if (draining_ != INVALID_SOCKET && releasing_.empty()) {
+        reactor_->DetachIo(io_);
+        closesocket(draining_);
+        draining_ = INVALID_SOCKET;
+      }
+    }
+  }
+
+  if (!completed.empty())
+    OnCompleted(&completed);
+}
+
+bool AsyncSocket::Attach() {
+  if (io_ == nullptr) {
+    io_ = reactor_->CreateIo(OnReady, this, work_->pool);
+    if (io_ == nullptr) {
+      errno = ENOMEM;
+      return false;
+    }
+  }
+
+  return reactor_->AttachIo(io_, descriptor_);
+}
+
+// Called with |lock_| held before a send that could go without copying.
+bool AsyncSocket::EnableZeroCopy() {
+  if (zero_copy_)
+    return true;
+
+  if (!SetOption(SOL_SOCKET, SO_ZEROCOPY, 1)) {
+    zero_copy_threshold_ = 0;
+    return false;
+  }
+
+  zero_copy_ = true;
+  zero_copy_next_ = 0;
+
+  return true;
+}
+
+HRESULT AsyncSocket::Perform(Context* context) {
+  if (context->request == Request::Connect) {
+    int error = 0;
+    if (!GetOption(SOL_SOCKET, SO_ERROR, &error))
+      error = errno;
+    if (error != 0)
+      return HRESULT_FROM_ERRNO(error);
+
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getpeername(descriptor_, reinterpret_cast<sockaddr*>(&address),
+                    &length) != 0) {
+      if (errno == ENOTCONN)
+        return E_PENDING;
+
+      return HRESULT_FROM_ERRNO(errno);
+    }
+
+    connected_ = true;
+
+    return S_OK;
+  }
+
+  if (context->request == Request::ReceiveBatch ||
+      context->request == Request::SendBatch)
+    return PerformBatch(context);
+
+  msghdr message = {};
+  iovec remaining = {
+    static_cast<char*>(context->iov_base) + context->transferred,
+    context->iov_len - context->transferred
+  };
+  if (context->pieces != nullptr) {
+    message.msg_iov = context->pieces;
+    message.msg_iovlen = context->piece_count;
+  } else {
+    message.msg_iov = &remaining;
+    message.msg_iovlen = 1;
+  }
+
+  if (context->request == Request::ReceiveFrom ||
+      context->request == Request::SendTo) {
+    message.msg_name = &context->address;
+    message.msg_namelen = context->address_length;
+  }
+
+  // Set once the kernel is short of memory to track a zero-copy send.
+  bool copy = false;
+
+  for (;;) {
+    ssize_t length;
+    bool zero_copy = false;
+
+    switch (context->request) {
+      case Request::Receive:
+      case Request::ReceiveFrom:
+        length = recvmsg(descriptor_, &message, context->flags);
+        break;
+
+      case Request::Send:
+      case Request::SendTo:
+        zero_copy = !copy && zero_copy_threshold_ > 0 &&
+                    context->iov_len - context->transferred >=
+                        zero_copy_threshold_ &&
+                    EnableZeroCopy();
+        length = sendmsg(descriptor_, &message,
+                         context->flags | MSG_NOSIGNAL |
+                             (zero_copy ? MSG_ZEROCOPY : 0));
+        break;
+
+      default:
+        assert(false);
+        return E_NOTIMPL;
+    }
+
+    if (length == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return E_PENDING;
+
+      if (errno == ENOBUFS && zero_copy) {
+        copy = true;
+        continue;
+      }
+
+      return HRESULT_FROM_ERRNO(errno);
+    }
+
+    if (zero_copy) {
+      if (context->zero_copy_sends == 0)
+        context->zero_copy_first = zero_copy_next_;
+
+      ++context->zero_copy_sends;
+      ++context->zero_copy_held;
+      ++zero_copy_next_;
+    }
+
+    context->transferred += length;
+
+    if (context->request == Request::Send &&
+        context->transferred < context->iov_len) {
+      if (context->pieces != nullptr) {
+        ConsumePieces(context, length);
+        message.msg_iov = context->pieces;
+        message.msg_iovlen = context->piece_count;
+      } else {
+        remaining.iov_base = static_cast<char*>(remaining.iov_base) + length;
+        remaining.iov_len -= length;
+      }
+      continue;
+    }
+
+    break;
+  }
+
+  if (context->request == Request::Receive ||
+      context->request == Request::ReceiveFrom)
+    context->flags = message.msg_flags;
+
+  if (context->request == Request::ReceiveFrom)
+    context->address_length = message.msg_namelen;
+
+  return S_OK;
+}
+
+// Receives what has arrived of a batch, completing once there is something,
+// or sends as much of one as the socket takes, completing once it is all
+// sent. A failure after some datagrams are done is left for the next call.
+HRESULT AsyncSocket::PerformBatch(Context* context) {
+  bool receive = context->request == Request::ReceiveBatch;
+
+  mmsghdr headers[kMaxBatch];
+  iovec vectors[kMaxBatch];
+  Control controls[kMaxBatch];
+
+  for (;;) {
+    Datagram* datagrams = context->datagrams + context->transferred;
+    int batch =
+        context->datagram_count - static_cast<int>(context->transferred);
+    if (batch > kMaxBatch)
+      batch = kMaxBatch;
+
+    PrepareBatch(datagrams, batch, headers, vectors, controls, receive);
+
+    int result;
+    if (receive)
+      result = recvmmsg(descriptor_, headers, batch, context->flags, nullptr);
+    else
+      result = sendmmsg(descriptor_, headers, batch,
+                        context->flags | MSG_NOSIGNAL);
+
+    if (result == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return receive && context->transferred > 0 ? S_OK : E_PENDING;
+      if (context->transferred > 0)
+        return S_OK;
+
+      return HRESULT_FROM_ERRNO(errno);
+    }
+
+    FinishBatch(datagrams, result, headers, receive);
+    context->transferred += result;
+
+    if (static_cast<int>(context->transferred) == context->datagram_count ||
+        (receive && result < batch))
+      return S_OK;
+  }
+}
+
+// Called with |lock_| held to take the notifications of the zero-copy sends
+// the kernel has let go of.
+void AsyncSocket::ReadErrorQueue() {
+  for (;;) {
+    union {
+      cmsghdr header;
+      char buffer[CMSG_SPACE(sizeof(sock_extended_err) +
+                             sizeof(sockaddr_in6))];
+    } control;
+
+    msghdr message = {};
+    message.msg_control = &control;
+    message.msg_controllen = sizeof(control);
+
+    SOCKET descriptor =
+        draining_ != INVALID_SOCKET ? draining_ : descriptor_;
+    if (recvmsg(descriptor, &message, MSG_ERRQUEUE) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      break;
+    }
+
+    for (auto header = CMSG_FIRSTHDR(&message); header != nullptr;
+         header = CMSG_NXTHDR(&message, header)) {
+      if (!(header->cmsg_level == SOL_IP &&
+            header->cmsg_type == IP_RECVERR) &&
+          !(header->cmsg_level == SOL_IPV6 &&
+            header->cmsg_type == IPV6_RECVERR))
+        continue;
+
+      auto error = reinterpret_cast<sock_extended_err*>(CMSG_DATA(header));
+      if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      // The kernel copied the data after all, which costs more than copying
+      // up front.
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        zero_copy_threshold_ = 0;
+
+      for (auto& context : sends_)
+        Release(context.get(), error->ee_info, error->ee_data);
+      for (auto& context : releasing_)
+        Release(context.get(), error->ee_info, error->ee_data);
+    }
+  }
+}
+
+// Called with |lock_| held to stop waiting for the kernel to let go of the
+// buffers of the sends in |releasing_|, which are moved to |abandoned|. Those
+// it still holds complete with HRESULT_FROM_ERRNO(EBUSY) instead.
+void AsyncSocket::AbandonReleasing(
+    std::list<std::unique_ptr<Context>>* abandoned) {
+  if (draining_ != INVALID_SOCKET) {
+    reactor_->DetachIo(io_);
+    closesocket(draining_);
+    draining_ = INVALID_SOCKET;
+  }
+
+  for (auto& context : releasing_) {
+    if (context->zero_copy_held > 0) {
+      context->zero_copy_held = 0;
+      context->result = HRESULT_FROM_ERRNO(EBUSY);
+    }
+  }
+
+  abandoned->splice(abandoned->end(), releasing_);
+}
+
+void AsyncSocket::OnTimedOut(madoka::concurrent::TimerWheel::Timer* timer) {
+  auto context = static_cast<Context*>(timer);
+  context->socket->OnTimedOut(context);
+}
+
+// Runs on the thread of the timer wheel, so the context is only taken off the
+// pending list here and completed by OnRequested. The context stays alive
+// meanwhile: OnCompleted cancels the timer, which waits for this to return.
+void AsyncSocket::OnTimedOut(Context* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (context->pending != nullptr)
+    Abort(context, HRESULT_FROM_ERRNO(ETIMEDOUT));
+}
+
+size_t AsyncSocket::CancelAll(bool receives) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  size_t count = 0;
+  operations_->ForEach([this, receives, &count](Context* context) {
+    bool receive = context->request == Request::Receive ||
+                   context->request == Request::ReceiveFrom ||
+                   context->request == Request::ReceiveBatch;
+    bool send = context->request == Request::Send ||
+                context->request == Request::SendTo ||
+                context->request == Request::SendBatch;
+    if (receives ? receive : send) {
+      Abort(context, madoka::io::kOperationCancelled);
+      ++count;
+    }
+  });
+
+  return count;
+}
+
+// Called with |lock_| held for a context still in |operations_|. One waiting
+// in a pending list is handed back to OnRequested, which completes it with
+// |result|; one still queued there finds |result| when it comes up.
+void AsyncSocket::Abort(Context* context, HRESULT result) {
+  operations_->Remove(context->operation);
+  context->aborted = result;
+
+  if (context->pending == nullptr)
+    return;
+
+  context->position->release();
+  context->pending->erase(context->position);
+  context->pending = nullptr;
+
+  // A send the kernel still holds the buffer of completes when it lets go.
+  if (context->zero_copy_held > 0) {
+    context->result = result;
+    releasing_.emplace_back(context);
+    return;
+  }
+
+  if (requests_.Push(context))
+    reactor_->SubmitWork(work_);
+}
+
+void AsyncSocket::OnCompleted(std::unique_ptr<Context>&& context,
+                              HRESULT result) {
+  if (context->timeout != kNoTimeout)
+    madoka::concurrent::TimerWheel::GetDefault()->Cancel(context.get());
+
+  // A send cancelled or timed out after part of it went out still says how
+  // much did, since the stream goes on from there.
+  int length = static_cast<int>(context->transferred);
+
+  context->result = result;
+
+  assert(context->listener != nullptr);
+
+  switch (context->request) {
+    case Request::Connect:
+      context->listener->OnConnected(this, result, context->end_point);
+      break;
+
+    case Request::Receive:
+      context->listener->OnReceived(this, result, context->iov_base, length,
+                                    context->flags);
+      break;
+
+    case Request::ReceiveFrom:
+      context->listener->OnReceivedFrom(
+          this, result, context->iov_base, length, context->flags,
+          reinterpret_cast<sockaddr*>(&context->address),
+          context->address_length);
+      break;
+
+    case Request::Send:
+      context->listener->OnSent(this, result, context->iov_base, length);
+      break;
+
+    case Request::SendTo:
+      context->listener->OnSentTo(
+          this, result, context->iov_base, length,
+          reinterpret_cast<sockaddr*>(&context->address),
+          context->address_length);
+      break;
+
+    case Request::ReceiveBatch:
+      context->listener->OnReceivedBatch(this, result, context->datagrams,
+                                         length);
+      break;
+
+    case Request::SendBatch:
+      context->listener->OnSentBatch(this, result, context->datagrams, length);
+      break;
+
+    default:
+      assert(false);
+  }
+}
+
+// Passes the receives and sends completed by one readiness notification on
+// with one call for each run of contexts sharing a listener.
+void AsyncSocket::OnCompleted(std::list<std::unique_ptr<Context>>* contexts) {
+  Completion batch[kMaxCompletions];
+  size_t count = 0;
+  Listener* listener = nullptr;
+
+  for (auto& context : *contexts) {
+    // Connects and batches have callbacks of their own.
+    bool single = context->request == Request::Connect ||
+                  context->request == Request::ReceiveBatch ||
+                  context->request == Request::SendBatch;
+
+    if (count > 0 &&
+        (context->listener != listener || count == kMaxCompletions || single)) {
+      listener->OnBatchCompleted(this, batch, count);
+      count = 0;
+    }
+
+    if (single) {
+      OnCompleted(std::move(context), context->result);
+      continue;
+    }
+
+    if (context->timeout != kNoTimeout)
+      madoka::concurrent::TimerWheel::GetDefault()->Cancel(context.get());
+
+    listener = context->listener;
+
+    auto& completion = batch[count++];
+    completion.result = context->result;
+    completion.buffer = context->iov_base;
+    completion.length = static_cast<int>(context->transferred);
+    completion.flags = context->flags;
+    completion.address = reinterpret_cast<sockaddr*>(&context->address);
+    completion.address_length = context->address_length;
+
+    switch (context->request) {
+      case Request::Receive:
+        completion.type = Completion::Received;
+        break;
+
+      case Request::ReceiveFrom:
+        completion.type = Completion::ReceivedFrom;
+        break;
+
+      case Request::Send:
+        completion.type = Completion::Sent;
+        break;
+
+      default:
+        completion.type = Completion::SentTo;
+        break;
+    }
+  }
+
+  if (count > 0)
+    listener->OnBatchCompleted(this, batch, count);
+}
+
+}  // namespace net
+}  // namespace madoka
@@ -3,13 +3,18 @@
 #include "madoka/net/async_socket.h"
 
 #include <assert.h>
+#include <limits.h>
 
 #include <algorithm>
 #include <memory>
+#include <new>
 #include <utility>
 
 #include "madoka/concurrent/lock_guard.h"
 
+#include "concurrent/object_pool.h"
+#include "io/operation_table.h"
+
 #undef min
 
 namespace madoka {
@@ -21,12 +26,28 @@ enum Request {
 };
 
 LPFN_CONNECTEX ConnectEx = nullptr;
+
+const std::chrono::milliseconds kNoTimeout =
+    (std::chrono::milliseconds::max)();
+
+// Pieces of a vectored operation kept in the context itself; more than that
+// are allocated.
+const int kInlinePieces = 4;
 }  // namespace
 
-struct AsyncSocket::Context : OVERLAPPED, WSABUF {
+struct AsyncSocket::Context
+    : madoka::concurrent::MpscQueueEntry,
+      madoka::concurrent::PooledObject<AsyncSocket::Context>,
+      madoka::concurrent::TimerWheel::Timer,
+      OVERLAPPED,
+      WSABUF {
   Context()
       : OVERLAPPED(),
         WSABUF(),
+        socket(nullptr),
+        timeout(kNoTimeout),
+        operation(madoka::io::kNoOperation),
+        aborted(S_OK),
         request(Request::Invalid),
         result(S_OK),
         end_point(nullptr),
@@ -34,9 +55,19 @@ struct AsyncSocket::Context : OVERLAPPED, WSABUF {
         address(),
         address_length(sizeof(address)),
         listener(nullptr),
-        event(NULL) {
+        event(NULL),
+        pieces(nullptr),
+        piece_count(0) {
   }
 
+  AsyncSocket* socket;
+  std::chrono::milliseconds timeout;
+
+  madoka::io::Operation operation;
+  // Set once the operation has been asked to stop, by its timer or by
+  // cancellation, to what it is to complete with instead of being aborted.
+  HRESULT aborted;
+
   Request request;
   HRESULT result;
   const addrinfo* end_point;
@@ -45,17 +76,73 @@ struct AsyncSocket::Context : OVERLAPPED, WSABUF {
   int address_length;
   Listener* listener;
   HANDLE event;
+
+  // The pieces of a vectored operation, in |inline_pieces| or |more_pieces|.
+  // The inherited WSABUF then holds the array of the caller and the total
+  // length.
+  WSABUF* pieces;
+  DWORD piece_count;
+  WSABUF inline_pieces[kInlinePieces];
+  std::unique_ptr<WSABUF[]> more_pieces;
 };
 
-PTP_CALLBACK_ENVIRON AsyncSocket::environment_ = nullptr;
+namespace {
+
+HRESULT SetPieces(AsyncSocket::Context* context, const WSABUF* buffers,
+                  int count) {
+  if (buffers == nullptr || count <= 0)
+    return E_INVALIDARG;
+
+  ULONG length = 0;
+  for (int i = 0; i < count; ++i) {
+    if (buffers[i].buf == nullptr && buffers[i].len != 0 ||
+        buffers[i].len > INT_MAX - length)
+      return E_INVALIDARG;
+
+    length += buffers[i].len;
+  }
+
+  if (count <= kInlinePieces) {
+    context->pieces = context->inline_pieces;
+  } else {
+    context->more_pieces.reset(new (std::nothrow) WSABUF[count]);
+    if (context->more_pieces == nullptr)
+      return E_OUTOFMEMORY;
+
+    context->pieces = context->more_pieces.get();
+  }
+
+  std::copy(buffers, buffers + count, context->pieces);
+  context->piece_count = count;
+  context->buf = reinterpret_cast<char*>(const_cast<WSABUF*>(buffers));
+  context->len = length;
+
+  return S_OK;
+}
+
+}  // namespace
+
+PTP_CALLBACK_ENVIRON AsyncSocket::default_environment_ = nullptr;
 
-AsyncSocket::AsyncSocket()
-    : work_(CreateThreadpoolWork(OnRequested, this, environment_)),
+AsyncSocket::AsyncSocket() : AsyncSocket(nullptr) {
+}
+
+AsyncSocket::AsyncSocket(int family, int type, int protocol) : AsyncSocket() {
+  Create(family, type, protocol);
+}
+
+AsyncSocket::AsyncSocket(madoka::concurrent::Executor executor)
+    : operations_(std::make_unique<madoka::io::OperationTable<Context>>()),
+      environment_(executor != nullptr ? executor : default_environment_),
+      work_(CreateThreadpoolWork(OnRequested, this, environment_)),
       cancel_connect_(false),
       io_(nullptr) {
+  lock_.SetName("madoka::net::AsyncSocket");
 }
 
-AsyncSocket::AsyncSocket(int family, int type, int protocol) : AsyncSocket() {
+AsyncSocket::AsyncSocket(int family, int type, int protocol,
+                         madoka::concurrent::Executor executor)
+    : AsyncSocket(executor) {
   Create(family, type, protocol);
 }
 
@@ -95,15 +182,23 @@ void AsyncSocket::Close() {
 }
 
 PTP_CALLBACK_ENVIRON AsyncSocket::GetCallbackEnvironment() {
-  return environment_;
+  return default_environment_;
 }
 
 void AsyncSocket::SetCallbackEnvironment(PTP_CALLBACK_ENVIRON environment) {
-  environment_ = environment;
+  default_environment_ = environment;
 }
 
-void AsyncSocket::ConnectAsync(const addrinfo* end_point, Listener* listener) {
+madoka::io::Operation AsyncSocket::ConnectAsync(const addrinfo* end_point,
+                                                Listener* listener) {
+  return ConnectAsync(end_point, listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncSocket::ConnectAsync(
+    const addrinfo* end_point, Listener* listener,
+    std::chrono::milliseconds timeout) {
   HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
 
   do {
     if (end_point == nullptr || listener == nullptr) {
@@ -118,11 +213,14 @@ void AsyncSocket::ConnectAsync(const addrinfo* end_point, Listener* listener) {
       break;
     }
 
-    result = RequestAsync(std::move(context));
+    context->timeout = timeout;
+    result = RequestAsync(std::move(context), &operation);
   } while (false);
 
   if (FAILED(result))
     listener->OnConnected(this, result, end_point);
+
+  return operation;
 }
 
 AsyncSocket::Context* AsyncSocket::BeginConnect(const addrinfo* end_point,
@@ -155,9 +253,16 @@ HRESULT AsyncSocket::EndConnect(Context* context) {
   return result;
 }
 
-void AsyncSocket::ReceiveAsync(void* buffer, int length, int flags,
-                               Listener* listener) {
+madoka::io::Operation AsyncSocket::ReceiveAsync(void* buffer, int length,
+                                                int flags, Listener* listener) {
+  return ReceiveAsync(buffer, length, flags, listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncSocket::ReceiveAsync(
+    void* buffer, int length, int flags, Listener* listener,
+    std::chrono::milliseconds timeout) {
   HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
 
   do {
     if (buffer == nullptr && length != 0 || listener == nullptr) {
@@ -173,11 +278,14 @@ void AsyncSocket::ReceiveAsync(void* buffer, int length, int flags,
       break;
     }
 
-    result = RequestAsync(std::move(context));
+    context->timeout = timeout;
+    result = RequestAsync(std::move(context), &operation);
   } while (false);
 
   if (FAILED(result))
     listener->OnReceived(this, result, buffer, 0, 0);
+
+  return operation;
 }
 
 AsyncSocket::Context* AsyncSocket::BeginReceive(void* buffer, int length,
@@ -194,6 +302,20 @@ AsyncSocket::Context* AsyncSocket::BeginReceive(void* buffer, int length,
   return BeginRequest(std::move(context));
 }
 
+AsyncSocket::Context* AsyncSocket::BeginReceiveVector(const Buffer* buffers,
+                                                      int count, int flags,
+                                                      HANDLE event) {
+  if (event == NULL)
+    return nullptr;
+
+  auto context = CreateContext(Request::Receive, nullptr, nullptr, 0, flags,
+                               nullptr, 0, nullptr, event);
+  if (context == nullptr || FAILED(SetPieces(context.get(), buffers, count)))
+    return nullptr;
+
+  return BeginRequest(std::move(context));
+}
+
 int AsyncSocket::EndReceive(Context* context, HRESULT* result) {
   if (context == nullptr || context->request != Request::Receive) {
     *result = E_INVALIDARG;
@@ -214,9 +336,17 @@ int AsyncSocket::EndReceive(Context* context, HRESULT* result) {
   return length;
 }
 
-void AsyncSocket::ReceiveFromAsync(void* buffer, int length, int flags,
-                                   Listener* listener) {
+madoka::io::Operation AsyncSocket::ReceiveFromAsync(void* buffer, int length,
+                                                    int flags,
+                                                    Listener* listener) {
+  return ReceiveFromAsync(buffer, length, flags, listener, kNoTimeout);
+}
+
+madoka::io::Operation AsyncSocket::ReceiveFromAsync(
+    void* buffer, int length, int flags, Listener* listener,
+    std::chrono::milliseconds timeout) {
   HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
 
   do {
     if (buffer == nullptr && length != 0 || listener == nullptr) {
@@ -232,11 +362,14 @@ void AsyncSocket::ReceiveFromAsync(void* buffer, int length, int flags,
       break;
     }
 
-    result = RequestAsync(std::move(context));
+    context->timeout = timeout;
+    result = RequestAsync(std::move(context), &operation);
   } while (false);
 
   if (FAILED(result))
     listener->OnReceivedFrom(this, result, buffer, 0, 0, nullptr, 0);
+
+  return operation;
 }
 
 AsyncSocket::Context* AsyncSocket::BeginReceiveFrom(void* buffer, int length,
@@ -277,9 +410,10 @@ int AsyncSocket::EndReceiveFrom(Context* context, void* address, int* length) {
   return received;
 }
 
-void AsyncSocket::SendAsync(const void* buffer, int length, int flags,
-                            Listener* listener) {
+madoka::io::Operation AsyncSocket::SendAsync(const void* buffer, int length,
+                                             int flags, Listener* listener) {
   HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
 
   do {
     if (buffer == nullptr && length != 0 || listener == nullptr) {
@@ -295,11 +429,13 @@ void AsyncSocket::SendAsync(const void* buffer, int length, int flags,
       break;
     }
 
-    result = RequestAsync(std::move(context));
+    result = RequestAsync(std::move(context), &operation);
   } while (false);
 
   if (FAILED(result))
     listener->OnSent(this, result, const_cast<void*>(buffer), 0);
+
+  return operation;
 }
 
 AsyncSocket::Context* AsyncSocket::BeginSend(const void* buffer, int length,
@@ -316,6 +452,20 @@ AsyncSocket::Context* AsyncSocket::BeginSend(const void* buffer, int length,
   return BeginRequest(std::move(context));
 }
 
+AsyncSocket::Context* AsyncSocket::BeginSendVector(const Buffer* buffers,
+                                                   int count, int flags,
+                                                   HANDLE event) {
+  if (event == NULL)
+    return nullptr;
+
+  auto context = CreateContext(Request::Send, nullptr, nullptr, 0, flags,
+                               nullptr, 0, nullptr, event);
+  if (context == nullptr || FAILED(SetPieces(context.get(), buffers, count)))
+    return nullptr;
+
+  return BeginRequest(std::move(context));
+}
+
 int AsyncSocket::EndSend(Context* context, HRESULT* result) {
   if (context == nullptr || context->request != Request::Send)
     return -1;
@@ -334,10 +484,12 @@ int AsyncSocket::EndSend(Context* context, HRESULT* result) {
   return length;
 }
 
-void AsyncSocket::SendToAsync(const void* buffer, int length, int flags,
-                              const void* address, int address_length,
-                              Listener* listener) {
+madoka::io::Operation AsyncSocket::SendToAsync(const void* buffer, int length,
+                                               int flags, const void* address,
+                                               int address_length,
+                                               Listener* listener) {
   HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
 
   do {
     if (buffer == nullptr && length != 0 || address == nullptr ||
@@ -354,12 +506,14 @@ void AsyncSocket::SendToAsync(const void* buffer, int length, int flags,
       break;
     }
 
-    result = RequestAsync(std::move(context));
+    result = RequestAsync(std::move(context), &operation);
   } while (false);
 
   if (FAILED(result))
     listener->OnSentTo(this, result, const_cast<void*>(buffer), 0,
                        static_cast<const sockaddr*>(address), address_length);
+
+  return operation;
 }
 
 AsyncSocket::Context* AsyncSocket::BeginSendTo(
@@ -396,12 +550,97 @@ int AsyncSocket::EndSendTo(Context* context, HRESULT* result) {
   return length;
 }
 
+madoka::io::Operation AsyncSocket::ReceiveVectorAsync(const Buffer* buffers,
+                                                      int count, int flags,
+                                                      Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if (listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::Receive, nullptr, nullptr, 0, flags,
+                                 nullptr, 0, listener, NULL);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    result = SetPieces(context.get(), buffers, count);
+    if (FAILED(result))
+      break;
+
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnReceived(this, result, const_cast<Buffer*>(buffers), 0, 0);
+
+  return operation;
+}
+
+madoka::io::Operation AsyncSocket::SendVectorAsync(const Buffer* buffers,
+                                                   int count, int flags,
+                                                   Listener* listener) {
+  HRESULT result = S_OK;
+  madoka::io::Operation operation = madoka::io::kNoOperation;
+
+  do {
+    if (listener == nullptr) {
+      result = E_INVALIDARG;
+      break;
+    }
+
+    auto context = CreateContext(Request::Send, nullptr, nullptr, 0, flags,
+                                 nullptr, 0, listener, NULL);
+    if (context == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    result = SetPieces(context.get(), buffers, count);
+    if (FAILED(result))
+      break;
+
+    result = RequestAsync(std::move(context), &operation);
+  } while (false);
+
+  if (FAILED(result))
+    listener->OnSent(this, result, const_cast<Buffer*>(buffers), 0);
+
+  return operation;
+}
+
+bool AsyncSocket::Cancel(madoka::io::Operation operation) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  auto context = operations_->Find(operation);
+  if (context == nullptr)
+    return false;
+
+  Abort(context, madoka::io::kOperationCancelled);
+
+  return true;
+}
+
+size_t AsyncSocket::CancelReceives() {
+  return CancelAll(true);
+}
+
+size_t AsyncSocket::CancelSends() {
+  return CancelAll(false);
+}
+
 std::unique_ptr<AsyncSocket::Context> AsyncSocket::CreateContext(
     int request, const addrinfo* end_point, void* buffer, int length,
     DWORD flags, const void* address, int address_length, Listener* listener,
     HANDLE event) {
   auto context = std::make_unique<Context>();
   if (context != nullptr) {
+    context->callback = OnTimedOut;
     context->request = static_cast<Request>(request);
     context->end_point = end_point;
     context->buf = static_cast<char*>(buffer);
@@ -421,17 +660,20 @@ std::unique_ptr<AsyncSocket::Context> AsyncSocket::CreateContext(
   return std::move(context);
 }
 
-HRESULT AsyncSocket::RequestAsync(std::unique_ptr<Context>&& context) {
+HRESULT AsyncSocket::RequestAsync(std::unique_ptr<Context>&& context,
+                                  madoka::io::Operation* operation) {
   if (context == nullptr)
     return E_INVALIDARG;
-
-  madoka::concurrent::LockGuard guard(&lock_);
-
   if (work_ == nullptr)
     return E_HANDLE;
 
-  requests_.push_back(std::move(context));
-  if (requests_.size() == 1)
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    context->operation = operations_->Add(context.get());
+    *operation = context->operation;
+  }
+
+  if (requests_.Push(context.release()))
     SubmitThreadpoolWork(work_);
 
   return S_OK;
@@ -441,17 +683,18 @@ AsyncSocket::Context* AsyncSocket::BeginRequest(
     std::unique_ptr<Context>&& context) {
   if (context == nullptr || context->event == NULL)
     return nullptr;
-
-  madoka::concurrent::LockGuard guard(&lock_);
-
   if (work_ == nullptr)
     return nullptr;
 
   ResetEvent(context->event);
 
-  auto pointer = context.get();
-  requests_.push_back(std::move(context));
-  if (requests_.size() == 1)
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    context->operation = operations_->Add(context.get());
+  }
+
+  auto pointer = context.release();
+  if (requests_.Push(pointer))
     SubmitThreadpoolWork(work_);
 
   return pointer;
@@ -467,12 +710,17 @@ void AsyncSocket::OnRequested(PTP_WORK work) {
 
   lock_.Lock();
 
-  auto context = std::move(requests_.front());
-  requests_.pop_front();
-  if (!requests_.empty())
+  bool more;
+  std::unique_ptr<Context> context(requests_.Pop(&more));
+  if (more)
     SubmitThreadpoolWork(work);
 
   do {
+    if (FAILED(context->aborted)) {
+      result = context->aborted;
+      break;
+    }
+
     if (context->request == Request::Connect) {
       if (connected_) {
         result = __HRESULT_FROM_WIN32(WSAEISCONN);
@@ -533,9 +781,23 @@ void AsyncSocket::OnRequested(PTP_WORK work) {
       }
     }
 
+    // Armed before the operation is started, which may complete right away.
+    if (context->timeout != kNoTimeout) {
+      context->socket = this;
+      madoka::concurrent::TimerWheel::GetDefault()->Start(context.get(),
+                                                          context->timeout);
+    }
+
     StartThreadpoolIo(io_);
     BOOL succeeded = FALSE;
 
+    WSABUF* buffers = context.get();
+    DWORD count = 1;
+    if (context->pieces != nullptr) {
+      buffers = context->pieces;
+      count = context->piece_count;
+    }
+
     switch (context->request) {
       case Request::Connect:
         succeeded = ConnectEx(descriptor_,
@@ -548,7 +810,7 @@ void AsyncSocket::OnRequested(PTP_WORK work) {
         break;
 
       case Request::Receive:
-        succeeded = WSARecv(descriptor_, context.get(), 1, nullptr,
+        succeeded = WSARecv(descriptor_, buffers, count, nullptr,
                             &context->flags, context.get(), nullptr) == 0;
         break;
 
@@ -561,7 +823,7 @@ void AsyncSocket::OnRequested(PTP_WORK work) {
         break;
 
       case Request::Send:
-        succeeded = WSASend(descriptor_, context.get(), 1, nullptr,
+        succeeded = WSASend(descriptor_, buffers, count, nullptr,
                             context->flags, context.get(), nullptr) == 0;
         break;
 
@@ -604,8 +866,63 @@ void CALLBACK AsyncSocket::OnCompleted(PTP_CALLBACK_INSTANCE /*callback*/,
       __HRESULT_FROM_WIN32(error), bytes);
 }
 
+void AsyncSocket::OnTimedOut(madoka::concurrent::TimerWheel::Timer* timer) {
+  auto context = static_cast<Context*>(timer);
+  context->socket->OnTimedOut(context);
+}
+
+// The context stays alive meanwhile: OnCompleted cancels the timer, which
+// waits for this to return.
+void AsyncSocket::OnTimedOut(Context* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (operations_->Find(context->operation) == context)
+    Abort(context, __HRESULT_FROM_WIN32(WSAETIMEDOUT));
+}
+
+size_t AsyncSocket::CancelAll(bool receives) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  size_t count = 0;
+  operations_->ForEach([this, receives, &count](Context* context) {
+    bool receive = context->request == Request::Receive ||
+                   context->request == Request::ReceiveFrom;
+    bool send = context->request == Request::Send ||
+                context->request == Request::SendTo;
+    if (receives ? receive : send) {
+      Abort(context, madoka::io::kOperationCancelled);
+      ++count;
+    }
+  });
+
+  return count;
+}
+
+// Called with |lock_| held for a context still in |operations_|. An operation
+// in flight then completes as aborted, which OnCompleted reports as |result|;
+// one still queued finds |result| in OnRequested.
+void AsyncSocket::Abort(Context* context, HRESULT result) {
+  operations_->Remove(context->operation);
+  context->aborted = result;
+
+  if (IsValid())
+    CancelIoEx(reinterpret_cast<HANDLE>(descriptor_), context);
+}
+
 void AsyncSocket::OnCompleted(std::unique_ptr<Context>&& context,
                               HRESULT result, int length) {
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    operations_->Remove(context->operation);
+  }
+
+  if (context->timeout != kNoTimeout)
+    madoka::concurrent::TimerWheel::GetDefault()->Cancel(context.get());
+
+  if (FAILED(context->aborted) &&
+      result == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED))
+    result = context->aborted;
+
   if (SUCCEEDED(result)) {
     if (context->request == Request::Connect) {
       if (SetOption(SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0))
@@ -0,0 +1,10 @@
+// Copyright (c) 2016 dacci.org
+
+// Nothing in the library includes the awaitables, which are header-only, so
+// they are compiled here to keep them building cleanly.
+
+#include "madoka/io/awaitable.h"
+#include "madoka/net/awaitable.h"
+
+template class madoka::net::AcceptAwaiter<madoka::net::AsyncSocket>;
+template class madoka::net::AcceptAwaiter<madoka::net::SocketStream>;
@@ -0,0 +1,329 @@
+// Copyright (c) 2016 dacci.org
+
+#include "net/reactor_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "madoka/concurrent/lock_guard.h"
+
+namespace madoka {
+namespace net {
+
+namespace {
+
+const int kMaxEvents = 64;
+
+thread_local ReactorTask* current_task = nullptr;
+
+}  // namespace
+
+Reactor::Reactor(madoka::concurrent::ThreadPool* pool)
+    : pool_(pool),
+      epoll_(epoll_create1(EPOLL_CLOEXEC)),
+      wakeup_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      stopping_(false) {
+  lock_.SetName("madoka::net::Reactor");
+
+  if (epoll_ != -1 && wakeup_ != -1) {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, wakeup_, &event) != 0) {
+      close(epoll_);
+      epoll_ = -1;
+    }
+  }
+
+  if (epoll_ == -1 || wakeup_ == -1) {
+    if (epoll_ != -1) {
+      close(epoll_);
+      epoll_ = -1;
+    }
+
+    if (wakeup_ != -1) {
+      close(wakeup_);
+      wakeup_ = -1;
+    }
+  } else {
+    poller_ = std::thread(&Reactor::Poll, this);
+  }
+}
+
+Reactor::~Reactor() {
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    stopping_ = true;
+  }
+
+  if (wakeup_ != -1) {
+    uint64_t value = 1;
+    write(wakeup_, &value, sizeof(value));
+  }
+
+  if (poller_.joinable())
+    poller_.join();
+
+  for (auto io : retired_)
+    Release(io);
+
+  if (epoll_ != -1)
+    close(epoll_);
+
+  if (wakeup_ != -1)
+    close(wakeup_);
+}
+
+Reactor* Reactor::GetDefault() {
+  // Never destroyed, sockets may well outlive the static destructors.
+  static Reactor* reactor =
+      new Reactor(madoka::concurrent::ThreadPool::GetDefault());
+  return reactor;
+}
+
+ReactorWork* Reactor::CreateWork(WorkCallback callback, void* instance,
+                                 madoka::concurrent::ThreadPool* pool) {
+  auto work = new ReactorWork();
+  work->run = RunWork;
+  work->reactor = this;
+  work->pool = pool != nullptr ? pool : pool_;
+  work->callback = callback;
+  work->instance = instance;
+  work->submitted = 0;
+  work->running = 0;
+  work->closed = false;
+
+  return work;
+}
+
+void Reactor::SubmitWork(ReactorWork* work) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (work->submitted++ == 0)
+    work->pool->Submit(work);
+}
+
+void Reactor::WaitForWorkCallbacks(ReactorWork* work) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  int self = current_task == work ? 1 : 0;
+  while (work->submitted > 0 || work->running > self)
+    idle_.Sleep(&lock_);
+}
+
+void Reactor::CloseWork(ReactorWork* work) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  work->closed = true;
+
+  if (work->submitted == 0 && work->running == 0)
+    delete work;
+}
+
+ReactorIo* Reactor::CreateIo(IoCallback callback, void* instance,
+                             madoka::concurrent::ThreadPool* pool) {
+  auto io = new ReactorIo();
+  io->run = RunIo;
+  io->reactor = this;
+  io->pool = pool != nullptr ? pool : pool_;
+  io->callback = callback;
+  io->instance = instance;
+  io->descriptor = -1;
+  io->events = 0;
+  io->references = 1;
+  io->running = 0;
+  io->queued = false;
+  io->closed = false;
+
+  return io;
+}
+
+bool Reactor::AttachIo(ReactorIo* io, int descriptor) {
+  if (io->descriptor == descriptor)
+    return true;
+
+  if (!IsValid()) {
+    errno = EBADF;
+    return false;
+  }
+
+  DetachIo(io);
+
+  int flags = fcntl(descriptor, F_GETFL);
+  if (flags == -1)
+    return false;
+
+  if ((flags & O_NONBLOCK) == 0 &&
+      fcntl(descriptor, F_SETFL, flags | O_NONBLOCK) == -1)
+    return false;
+
+  epoll_event event = {};
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = io;
+
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, descriptor, &event) != 0)
+    return false;
+
+  io->descriptor = descriptor;
+
+  return true;
+}
+
+void Reactor::DetachIo(ReactorIo* io) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (io->descriptor == -1)
+    return;
+
+  epoll_ctl(epoll_, EPOLL_CTL_DEL, io->descriptor, nullptr);
+  io->descriptor = -1;
+}
+
+void Reactor::CloseIo(ReactorIo* io) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  DetachIo(io);
+  io->closed = true;
+
+  int self = current_task == io ? 1 : 0;
+  while (io->running > self)
+    idle_.Sleep(&lock_);
+
+  // The poller may still hold |io| in the batch it is dispatching, so the
+  // registration reference is dropped by the poller itself before it waits
+  // for the next batch.
+  retired_.push_back(io);
+
+  uint64_t value = 1;
+  write(wakeup_, &value, sizeof(value));
+}
+
+void Reactor::RunWork(ReactorTask* task) {
+  auto work = static_cast<ReactorWork*>(task);
+  auto reactor = work->reactor;
+
+  {
+    madoka::concurrent::LockGuard guard(&reactor->lock_);
+
+    if (--work->submitted > 0)
+      work->pool->Submit(work);
+
+    if (work->closed) {
+      if (work->submitted == 0 && work->running == 0)
+        delete work;
+
+      return;
+    }
+
+    ++work->running;
+  }
+
+  current_task = work;
+  work->callback(work->instance, work);
+  current_task = nullptr;
+
+  madoka::concurrent::LockGuard guard(&reactor->lock_);
+
+  --work->running;
+  reactor->idle_.WakeAll();
+
+  if (work->closed && work->submitted == 0 && work->running == 0)
+    delete work;
+}
+
+void Reactor::RunIo(ReactorTask* task) {
+  auto io = static_cast<ReactorIo*>(task);
+  auto reactor = io->reactor;
+  uint32_t events;
+
+  {
+    madoka::concurrent::LockGuard guard(&reactor->lock_);
+
+    events = io->events;
+    io->events = 0;
+    io->queued = false;
+
+    if (io->closed) {
+      reactor->Release(io);
+      return;
+    }
+
+    ++io->running;
+  }
+
+  current_task = io;
+  io->callback(io->instance, events);
+  current_task = nullptr;
+
+  madoka::concurrent::LockGuard guard(&reactor->lock_);
+
+  --io->running;
+  if (io->closed)
+    reactor->idle_.WakeAll();
+
+  reactor->Release(io);
+}
+
+void Reactor::Release(ReactorIo* io) {
+  if (--io->references == 0)
+    delete io;
+}
+
+void Reactor::Poll() {
+  epoll_event events[kMaxEvents];
+  std::vector<ReactorIo*> retired;
+
+  for (;;) {
+    {
+      madoka::concurrent::LockGuard guard(&lock_);
+
+      if (stopping_)
+        break;
+
+      retired.swap(retired_);
+      for (auto io : retired)
+        Release(io);
+    }
+
+    retired.clear();
+
+    int count = epoll_wait(epoll_, events, kMaxEvents, -1);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+
+      break;
+    }
+
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    for (int i = 0; i < count; ++i) {
+      auto io = static_cast<ReactorIo*>(events[i].data.ptr);
+      if (io == nullptr) {
+        uint64_t value;
+        read(wakeup_, &value, sizeof(value));
+        continue;
+      }
+
+      if (io->closed)
+        continue;
+
+      io->events |= events[i].events;
+
+      if (!io->queued) {
+        io->queued = true;
+        ++io->references;
+        io->pool->Submit(io);
+      }
+    }
+  }
+}
+
+}  // namespace net
+}  // namespace madoka
@@ -0,0 +1,113 @@
+// Copyright (c) 2016 dacci.org
+
+#ifndef NET_REACTOR_POSIX_H_
+#define NET_REACTOR_POSIX_H_
+
+#include <stdint.h>
+
+#include <madoka/common.h>
+#include <madoka/concurrent/condition_variable.h>
+#include <madoka/concurrent/critical_section.h>
+#include <madoka/concurrent/thread_pool.h>
+
+#include <thread>
+#include <vector>
+
+namespace madoka {
+namespace net {
+
+typedef madoka::concurrent::ThreadPool::Task ReactorTask;
+struct ReactorWork;
+struct ReactorIo;
+
+// An epoll instance whose events, like submitted work, are dispatched to a
+// ThreadPool. The interface mirrors the work and I/O objects of the Win32
+// thread pool so the POSIX implementations can keep the shape of their
+// Windows counterparts.
+class Reactor {
+ public:
+  typedef void (*WorkCallback)(void* instance, ReactorWork* work);
+  typedef void (*IoCallback)(void* instance, uint32_t events);
+
+  // Callbacks of work and I/O objects created without a pool of their own run
+  // on |pool|.
+  explicit Reactor(madoka::concurrent::ThreadPool* pool);
+  ~Reactor();
+
+  static Reactor* GetDefault();
+
+  // Callbacks of the object run on |pool|, or on the pool of the reactor if
+  // it is nullptr.
+  ReactorWork* CreateWork(WorkCallback callback, void* instance,
+                          madoka::concurrent::ThreadPool* pool);
+  void SubmitWork(ReactorWork* work);
+  void WaitForWorkCallbacks(ReactorWork* work);
+  void CloseWork(ReactorWork* work);
+
+  ReactorIo* CreateIo(IoCallback callback, void* instance,
+                      madoka::concurrent::ThreadPool* pool);
+  // Switches |descriptor| to non-blocking mode and registers it edge-triggered
+  // for both directions. The callback receives the EPOLL* bits accumulated
+  // since its last invocation. Attaching and detaching must be serialized by
+  // the owner of |io|.
+  bool AttachIo(ReactorIo* io, int descriptor);
+  // Must be called before the attached descriptor is closed. Events already
+  // collected may still be delivered afterwards.
+  void DetachIo(ReactorIo* io);
+  // Detaches |io|, waits for the running callbacks except the calling one and
+  // releases it.
+  void CloseIo(ReactorIo* io);
+
+  bool IsValid() const {
+    return epoll_ != -1;
+  }
+
+ private:
+  static void RunWork(ReactorTask* task);
+  static void RunIo(ReactorTask* task);
+
+  void Release(ReactorIo* io);
+
+  void Poll();
+
+  madoka::concurrent::ThreadPool* const pool_;
+  int epoll_;
+  int wakeup_;
+  bool stopping_;
+
+  madoka::concurrent::CriticalSection lock_;
+  madoka::concurrent::ConditionVariable idle_;
+  std::vector<ReactorIo*> retired_;
+
+  std::thread poller_;
+
+  MADOKA_DISALLOW_COPY_AND_ASSIGN(Reactor);
+};
+
+struct ReactorWork : ReactorTask {
+  Reactor* reactor;
+  madoka::concurrent::ThreadPool* pool;
+  Reactor::WorkCallback callback;
+  void* instance;
+  int submitted;
+  int running;
+  bool closed;
+};
+
+struct ReactorIo : ReactorTask {
+  Reactor* reactor;
+  madoka::concurrent::ThreadPool* pool;
+  Reactor::IoCallback callback;
+  void* instance;
+  int descriptor;
+  uint32_t events;
+  int references;
+  int running;
+  bool queued;
+  bool closed;
+};
+
+}  // namespace net
+}  // namespace madoka
+
+#endif  // NET_REACTOR_POSIX_H_
@@ -0,0 +1,101 @@
+// Copyright (c) 2016 dacci.org
+
+#include "madoka/net/sharded_server_socket.h"
+
+#include <linux/filter.h>
+#include <sys/socket.h>
+
+namespace madoka {
+namespace net {
+
+ShardedServerSocket::ShardedServerSocket() {
+}
+
+ShardedServerSocket::~ShardedServerSocket() {
+  Close();
+}
+
+HRESULT ShardedServerSocket::Open(
+    const addrinfo* end_point, int backlog,
+    const madoka::concurrent::Executor* executors, size_t count) {
+  Close();
+
+  if (end_point == nullptr || executors == nullptr || count == 0)
+    return E_INVALIDARG;
+
+  // The shards after the first bind to where it did, which tells the port
+  // when |end_point| leaves it to the system.
+  sockaddr_storage address;
+  int address_length = sizeof(address);
+
+  for (size_t i = 0; i < count; ++i) {
+    auto shard = std::make_unique<AsyncServerSocket>(
+        end_point->ai_family, end_point->ai_socktype, end_point->ai_protocol,
+        executors[i]);
+    if (shard == nullptr) {
+      Close();
+      return E_OUTOFMEMORY;
+    }
+
+    bool succeeded = shard->IsValid() &&
+                     shard->SetOption(SOL_SOCKET, SO_REUSEPORT, 1);
+    if (succeeded) {
+      if (i == 0)
+        succeeded = shard->Bind(end_point->ai_addr, end_point->ai_addrlen) &&
+                    shard->GetLocalEndPoint(&address, &address_length);
+      else
+        succeeded = shard->Bind(&address, address_length);
+    }
+
+    if (!succeeded || !shard->Listen(backlog)) {
+      HRESULT result = HRESULT_FROM_ERRNO(errno);
+      Close();
+      return result;
+    }
+
+    shards_.push_back(std::move(shard));
+  }
+
+  return S_OK;
+}
+
+HRESULT ShardedServerSocket::SteerByCpu() {
+  if (shards_.empty())
+    return HRESULT_FROM_ERRNO(ENOTSOCK);
+
+  // The shards joined the group of the port in order, so the index of the
+  // socket the program returns is that of the shard.
+  sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+             static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)),
+    BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(shards_.size())),
+    BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+
+  sock_fprog program = {};
+  program.len = sizeof(code) / sizeof(code[0]);
+  program.filter = code;
+
+  if (shards_.front()->SetOption(SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                                 program))
+    return S_OK;
+
+  // Without the program, the kernel still prefers a shard that says which
+  // CPU it serves, as long as there is one for each.
+  HRESULT result = HRESULT_FROM_ERRNO(errno);
+
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (!shards_[i]->SetOption(SOL_SOCKET, SO_INCOMING_CPU,
+                               static_cast<int>(i)))
+      return result;
+  }
+
+  return S_OK;
+}
+
+void ShardedServerSocket::Close() {
+  shards_.clear();
+}
+
+}  // namespace net
+}  // namespace madoka
@@ -0,0 +1,997 @@
+// Copyright (c) 2016 dacci.org
+
+#include "madoka/net/socket_stream.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "madoka/concurrent/lock_guard.h"
+
+#include "concurrent/object_pool.h"
+#include "io/abstract_stream_impl.h"
+
+namespace {
+
+enum SocketRequest {
+  Connect = 1,
+  Receive,
+  ReceiveFrom,
+  Send,
+  SendTo,
+  Transmit,
+};
+
+// What the pipe of the transmissions is asked to hold; it works with less.
+const int kPipeSize = 1 << 20;
+
+}  // namespace
+
+namespace madoka {
+namespace net {
+
+struct SocketStream::AsyncContext
+    : AbstractStream::AsyncContext,
+      madoka::concurrent::PooledObject<SocketStream::AsyncContext> {
+  const addrinfo* end_point;
+  sockaddr_storage address;
+  int address_length;
+  int flags;
+  msghdr message;
+  iovec vector;
+  uint64_t transferred;
+  HRESULT result;
+
+  // A transmission splices |file| into the pipe of the stream and on into
+  // the socket, with |piped| bytes in the pipe.
+  int file;
+  uint64_t offset;
+  uint32_t piped;
+};
+
+SocketStream::SocketStream() : writing_(nullptr), pipe_{-1, -1} {
+}
+
+SocketStream::SocketStream(madoka::concurrent::Executor executor)
+    : AbstractStream(executor), writing_(nullptr), pipe_{-1, -1} {
+}
+
+SocketStream::~SocketStream() {
+  Reset();
+
+  // The completions of the requests cancelled above call back into this
+  // object, so they have to be drained before the destructor returns.
+  AbstractStream::Reset();
+
+  ClosePipe();
+}
+
+void SocketStream::Close() {
+  std::deque<AsyncContext*> aborted;
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+    aborted.swap(writes_);
+  }
+
+  for (auto context : aborted)
+    OnCompleted(context, E_ABORT, 0);
+
+  CancelRequests();
+  Shutdown(SD_BOTH);
+  AbstractSocket::Close();
+}
+
+void SocketStream::ConnectAsync(const addrinfo* end_point, Listener* listener) {
+  ConnectAsync(end_point, listener, madoka::io::kNoTimeout);
+}
+
+void SocketStream::ConnectAsync(const addrinfo* end_point, Listener* listener,
+                                std::chrono::milliseconds timeout) {
+  ConnectAsync(end_point, listener, timeout, nullptr);
+}
+
+void SocketStream::ConnectAsync(const addrinfo* end_point, Listener* listener,
+                                ContextStorage* storage) {
+  ConnectAsync(end_point, listener, madoka::io::kNoTimeout, storage);
+}
+
+SocketStream::AsyncContext* SocketStream::BeginConnect(
+    const addrinfo* end_point) {
+  if (end_point == nullptr)
+    return nullptr;
+  if (connected())
+    return nullptr;
+
+  auto context = CreateContext<AsyncContext>(SocketRequest::Connect, nullptr, 0,
+                                             nullptr);
+  if (context == nullptr)
+    return nullptr;
+
+  context->end_point = end_point;
+
+  auto pointer = context.get();
+  HRESULT result = DispatchRequest(std::move(context));
+  if (FAILED(result))
+    return nullptr;
+
+  return pointer;
+}
+
+HRESULT SocketStream::EndConnect(AsyncContext* context,
+                                 const addrinfo** end_point) {
+  if (context == nullptr || end_point == nullptr)
+    return E_INVALIDARG;
+  if (context->stream != this || context->type != SocketRequest::Connect)
+    return E_HANDLE;
+
+  WaitForCompletion(context);
+
+  HRESULT result = context->result;
+  if (SUCCEEDED(result)) {
+    connected_ = true;
+    *end_point = context->end_point;
+  }
+
+  EndRequest(context);
+
+  if (FAILED(result))
+    Close();
+
+  return result;
+}
+
+HRESULT SocketStream::EndConnect(AsyncContext* context) {
+  const addrinfo* end_point = nullptr;
+  return EndConnect(context, &end_point);
+}
+
+void SocketStream::ReceiveAsync(void* buffer, uint64_t length, int flags,
+                                Listener* listener) {
+  ReceiveAsync(buffer, length, flags, listener, madoka::io::kNoTimeout);
+}
+
+void SocketStream::ReceiveAsync(void* buffer, uint64_t length, int flags,
+                                Listener* listener,
+                                std::chrono::milliseconds timeout) {
+  CommunicateAsync(SocketRequest::Receive, buffer, length, flags, nullptr, 0,
+                   nullptr, listener, timeout, nullptr);
+}
+
+void SocketStream::ReceiveAsync(void* buffer, uint64_t length, int flags,
+                                Listener* listener, ContextStorage* storage) {
+  CommunicateAsync(SocketRequest::Receive, buffer, length, flags, nullptr, 0,
+                   nullptr, listener, madoka::io::kNoTimeout, storage);
+}
+
+SocketStream::AsyncContext* SocketStream::BeginReceive(void* buffer,
+                                                       uint32_t length,
+                                                       int flags) {
+  return BeginCommunicate(SocketRequest::Receive, buffer, length, flags,
+                          nullptr, 0);
+}
+
+HRESULT SocketStream::EndReceive(AsyncContext* context, uint32_t* length,
+                                 int* flags) {
+  if (context == nullptr || length == nullptr)
+    return E_INVALIDARG;
+  if (context->stream != this || context->type != SocketRequest::Receive)
+    return E_HANDLE;
+
+  WaitForCompletion(context);
+
+  HRESULT result = context->result;
+  *length = context->transferred;
+
+  if (SUCCEEDED(result) && flags != nullptr)
+    *flags = context->flags;
+
+  EndRequest(context);
+
+  return result;
+}
+
+void SocketStream::ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                                    Listener* listener) {
+  ReceiveFromAsync(buffer, length, flags, listener, madoka::io::kNoTimeout);
+}
+
+void SocketStream::ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                                    Listener* listener,
+                                    std::chrono::milliseconds timeout) {
+  CommunicateAsync(SocketRequest::ReceiveFrom, buffer, length, flags, nullptr,
+                   0, nullptr, listener, timeout, nullptr);
+}
+
+void SocketStream::ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                                    Listener* listener,
+                                    ContextStorage* storage) {
+  CommunicateAsync(SocketRequest::ReceiveFrom, buffer, length, flags, nullptr,
+                   0, nullptr, listener, madoka::io::kNoTimeout, storage);
+}
+
+SocketStream::AsyncContext* SocketStream::BeginReceiveFrom(void* buffer,
+                                                           uint32_t length,
+                                                           int flags) {
+  return BeginCommunicate(SocketRequest::ReceiveFrom, buffer, length, flags,
+                          nullptr, 0);
+}
+
+HRESULT SocketStream::EndReceiveFrom(AsyncContext* context, uint32_t* length,
+                                     int* flags, void* address,
+                                     int* address_length) {
+  if (context == nullptr || length == nullptr)
+    return E_INVALIDARG;
+  if (context->stream != this || context->type != SocketRequest::ReceiveFrom)
+    return E_HANDLE;
+
+  WaitForCompletion(context);
+
+  HRESULT result = context->result;
+  *length = context->transferred;
+
+  if (SUCCEEDED(result)) {
+    if (flags != nullptr)
+      *flags = context->flags;
+
+    if (address != nullptr && address_length != nullptr) {
+      memmove(address, &context->address,
+              std::min(*address_length, context->address_length));
+      *address_length = context->address_length;
+    }
+  }
+
+  EndRequest(context);
+
+  return result;
+}
+
+void SocketStream::SendAsync(const void* buffer, uint64_t length, int flags,
+                             Listener* listener) {
+  SendAsync(buffer, length, flags, listener, nullptr);
+}
+
+void SocketStream::SendAsync(const void* buffer, uint64_t length, int flags,
+                             Listener* listener, ContextStorage* storage) {
+  CommunicateAsync(SocketRequest::Send, const_cast<void*>(buffer), length,
+                   flags, nullptr, 0, nullptr, listener,
+                   madoka::io::kNoTimeout, storage);
+}
+
+SocketStream::AsyncContext* SocketStream::BeginSend(const void* buffer,
+                                                    uint32_t length,
+                                                    int flags) {
+  return BeginCommunicate(SocketRequest::Send, const_cast<void*>(buffer),
+                          length, flags, nullptr, 0);
+}
+
+HRESULT SocketStream::EndSend(AsyncContext* context, uint32_t* length) {
+  if (context == nullptr || length == nullptr)
+    return E_INVALIDARG;
+  if (context->stream != this || context->type != SocketRequest::Send)
+    return E_HANDLE;
+
+  WaitForCompletion(context);
+
+  HRESULT result = context->result;
+  *length = context->transferred;
+
+  EndRequest(context);
+
+  return result;
+}
+
+void SocketStream::SendToAsync(const void* buffer, uint64_t length, int flags,
+                               void* to, int to_length, Listener* listener) {
+  SendToAsync(buffer, length, flags, to, to_length, listener, nullptr);
+}
+
+void SocketStream::SendToAsync(const void* buffer, uint64_t length, int flags,
+                               void* to, int to_length, Listener* listener,
+                               ContextStorage* storage) {
+  if (to != nullptr)
+    CommunicateAsync(SocketRequest::SendTo, const_cast<void*>(buffer), length,
+                     flags, to, to_length, nullptr, listener,
+                     madoka::io::kNoTimeout, storage);
+  else
+    listener->OnSentTo(this, E_INVALIDARG, const_cast<void*>(buffer), 0,
+                       static_cast<sockaddr*>(to), to_length);
+}
+
+SocketStream::AsyncContext* SocketStream::BeginSendTo(const void* buffer,
+                                                      uint32_t length,
+                                                      int flags, void* to,
+                                                      int to_length) {
+  if (to == nullptr)
+    return nullptr;
+
+  return BeginCommunicate(SocketRequest::SendTo, const_cast<void*>(buffer),
+                          length, flags, to, to_length);
+}
+
+HRESULT SocketStream::EndSendTo(AsyncContext* context, uint32_t* length) {
+  if (context == nullptr || length == nullptr)
+    return E_INVALIDARG;
+  if (context->stream != this || context->type != SocketRequest::SendTo)
+    return E_HANDLE;
+
+  WaitForCompletion(context);
+
+  HRESULT result = context->result;
+  *length = context->transferred;
+
+  EndRequest(context);
+
+  return result;
+}
+
+void SocketStream::TransmitFileAsync(int file, uint64_t offset,
+                                     uint64_t length, Listener* listener) {
+  HRESULT result = S_OK;
+
+  if (file < 0 || listener == nullptr)
+    result = E_INVALIDARG;
+  else if (!IsValid())
+    result = HRESULT_FROM_ERRNO(ENOTSOCK);
+  else if (!connected())
+    result = HRESULT_FROM_ERRNO(ENOTCONN);
+
+  if (SUCCEEDED(result)) {
+    auto context = CreateContext<AsyncContext>(SocketRequest::Transmit,
+                                               nullptr, length, nullptr);
+    if (context != nullptr) {
+      context->listener = listener;
+      context->file = file;
+      context->offset = offset;
+      result = DispatchRequest(std::move(context));
+    } else {
+      result = E_OUTOFMEMORY;
+    }
+  }
+
+  if (FAILED(result) && listener != nullptr)
+    listener->OnSent(this, result, nullptr, 0);
+}
+
+bool SocketStream::Cancel(AsyncContext* context) {
+  return AbstractStream::Cancel(context);
+}
+
+HRESULT SocketStream::Read(void* buffer, uint64_t* length) {
+  if (length == nullptr)
+    return E_INVALIDARG;
+  if (!IsValid())
+    return HRESULT_FROM_ERRNO(ENOTSOCK);
+
+  int length32;
+  if (*length > INT32_MAX)
+    length32 = INT32_MAX;
+  else
+    length32 = *length;
+
+  *length = 0;
+
+  length32 = Receive(buffer, length32, 0);
+  if (length32 == SOCKET_ERROR)
+    return HRESULT_FROM_LAST_ERROR();
+
+  *length = length32;
+
+  return S_OK;
+}
+
+void SocketStream::ReadAsync(void* buffer, uint64_t length,
+                             AbstractStream::Listener* listener) {
+  CommunicateAsync(GeneralRequest::Read, buffer, length, 0, nullptr, 0,
+                   listener, nullptr, madoka::io::kNoTimeout, nullptr);
+}
+
+HRESULT SocketStream::Write(const void* buffer, uint64_t* length) {
+  if (length == nullptr)
+    return E_INVALIDARG;
+  if (!IsValid())
+    return HRESULT_FROM_ERRNO(ENOTSOCK);
+
+  int length32;
+  if (*length > INT32_MAX)
+    length32 = INT32_MAX;
+  else
+    length32 = *length;
+
+  *length = 0;
+
+  length32 = Send(buffer, length32, MSG_NOSIGNAL);
+  if (length32 == SOCKET_ERROR)
+    return HRESULT_FROM_LAST_ERROR();
+
+  *length = length32;
+
+  return S_OK;
+}
+
+void SocketStream::WriteAsync(const void* buffer, uint64_t length,
+                              AbstractStream::Listener* listener) {
+  CommunicateAsync(GeneralRequest::Write, const_cast<void*>(buffer), length, 0,
+                   nullptr, 0, listener, nullptr, madoka::io::kNoTimeout,
+                   nullptr);
+}
+
+void SocketStream::Reset() {
+  Close();
+}
+
+void SocketStream::ConnectAsync(const addrinfo* end_point, Listener* listener,
+                                std::chrono::milliseconds timeout,
+                                ContextStorage* storage) {
+  HRESULT result = S_OK;
+
+  if (end_point == nullptr || listener == nullptr)
+    result = E_INVALIDARG;
+  else if (connected())
+    result = HRESULT_FROM_ERRNO(EISCONN);
+
+  if (SUCCEEDED(result)) {
+    auto context = CreateContext<AsyncContext>(SocketRequest::Connect, nullptr,
+                                               0, nullptr, storage);
+    if (context != nullptr) {
+      context->listener = listener;
+      context->end_point = end_point;
+      result = DispatchRequest(std::move(context), timeout);
+    } else {
+      result = E_OUTOFMEMORY;
+    }
+  }
+
+  if (FAILED(result))
+    listener->OnConnected(this, result, end_point);
+}
+
+HRESULT SocketStream::ConnectAsync(AsyncContext* context) {
+  Reset();
+
+  if (!Create(context->end_point))
+    return HRESULT_FROM_LAST_ERROR();
+
+  // Like the other requests, submitted with the lock held so that a timeout
+  // either finds it submitted or is noticed here.
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (context->cancelled)
+    return context->CancelResult();
+
+  io_uring_sqe entry = {};
+  entry.opcode = IORING_OP_CONNECT;
+  entry.fd = descriptor_;
+  entry.addr = reinterpret_cast<uintptr_t>(context->end_point->ai_addr);
+  entry.off = context->end_point->ai_addrlen;
+
+  return port_->Submit(&entry, context);
+}
+
+// Starts, or continues after a short send, the transfer described by
+// |context|. A single submission moves at most INT32_MAX bytes since that is
+// all a completion can report.
+HRESULT SocketStream::CommunicateAsync(AsyncContext* context) {
+  uint64_t remaining = context->length - context->transferred;
+
+  context->vector.iov_base =
+      static_cast<char*>(context->buffer) + context->transferred;
+  context->vector.iov_len = std::min<uint64_t>(remaining, INT32_MAX);
+
+  memset(&context->message, 0, sizeof(context->message));
+  context->message.msg_iov = &context->vector;
+  context->message.msg_iovlen = 1;
+
+  io_uring_sqe entry = {};
+  entry.fd = descriptor_;
+  entry.addr = reinterpret_cast<uintptr_t>(&context->message);
+  entry.len = 1;
+
+  switch (context->type) {
+    case SocketRequest::ReceiveFrom:
+      context->message.msg_name = &context->address;
+      context->message.msg_namelen = sizeof(context->address);
+      // fall through
+
+    case SocketRequest::Receive:
+    case GeneralRequest::Read:
+      entry.opcode = IORING_OP_RECVMSG;
+      entry.msg_flags = context->flags;
+      break;
+
+    case SocketRequest::SendTo:
+      context->message.msg_name = &context->address;
+      context->message.msg_namelen = context->address_length;
+      // fall through
+
+    case SocketRequest::Send:
+    case GeneralRequest::Write:
+      entry.opcode = IORING_OP_SENDMSG;
+      entry.msg_flags = context->flags | MSG_NOSIGNAL;
+      break;
+
+    default:
+      assert(false);
+      return E_NOTIMPL;
+  }
+
+  return port_->Submit(&entry, context);
+}
+
+// Starts the next step of the transmission described by |context|. io_uring
+// has no sendfile, so the file goes through a pipe: a splice fills it from
+// the file, and as many as it takes drain it into the socket. Splicing into
+// a socket whose peer has gone away raises SIGPIPE, as sendfile does, but
+// io_uring runs splices on workers of its own that block every signal. So
+// the signal stays with the worker, and the splice fails with EPIPE like a
+// send with MSG_NOSIGNAL would.
+HRESULT SocketStream::TransmitAsync(AsyncContext* context) {
+  if (pipe_[0] == -1) {
+    if (pipe2(pipe_, O_CLOEXEC) != 0)
+      return HRESULT_FROM_LAST_ERROR();
+
+    // A larger pipe takes fewer round trips through the ring.
+    fcntl(pipe_[1], F_SETPIPE_SZ, kPipeSize);
+  }
+
+  io_uring_sqe entry = {};
+  entry.opcode = IORING_OP_SPLICE;
+  entry.splice_flags = SPLICE_F_MOVE;
+
+  if (context->piped == 0) {
+    entry.fd = pipe_[1];
+    entry.off = static_cast<uint64_t>(-1);
+    entry.splice_fd_in = context->file;
+    entry.splice_off_in = context->offset + context->transferred;
+    entry.len =
+        std::min<uint64_t>(context->length - context->transferred, INT32_MAX);
+  } else {
+    entry.fd = descriptor_;
+    entry.off = static_cast<uint64_t>(-1);
+    entry.splice_fd_in = pipe_[0];
+    entry.splice_off_in = static_cast<uint64_t>(-1);
+    entry.len = context->piped;
+  }
+
+  return port_->Submit(&entry, context);
+}
+
+void SocketStream::ClosePipe() {
+  for (int& descriptor : pipe_) {
+    if (descriptor != -1) {
+      close(descriptor);
+      descriptor = -1;
+    }
+  }
+}
+
+// Called with |lock_| held to start |context|, or to queue it if another
+// write is in flight.
+HRESULT SocketStream::WriteAsync(AsyncContext* context) {
+  if (writing_ != nullptr) {
+    writes_.push_back(context);
+    return S_OK;
+  }
+
+  writing_ = context;
+
+  if (context->type == SocketRequest::Transmit)
+    return TransmitAsync(context);
+  else
+    return CommunicateAsync(context);
+}
+
+// Called once |context| is done for good, to start the write queued behind
+// it if it was the one in flight.
+void SocketStream::WriteNext(AsyncContext* context) {
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (writing_ != context)
+    return;
+
+  writing_ = nullptr;
+
+  while (!writes_.empty()) {
+    auto next = writes_.front();
+    writes_.pop_front();
+
+    HRESULT result;
+    if (next->cancelled)
+      result = next->CancelResult();
+    else
+      result = WriteAsync(next);
+
+    if (SUCCEEDED(result))
+      break;
+
+    writing_ = nullptr;
+    OnCompleted(next, result, 0);
+  }
+}
+
+void SocketStream::CommunicateAsync(
+    int type, void* buffer, uint64_t length, int flags, void* address,
+    int address_length, Stream::Listener* listener, Listener* socket_listener,
+    std::chrono::milliseconds timeout, ContextStorage* storage) {
+  HRESULT result = S_OK;
+
+  if ((address != nullptr &&
+       (address_length <= 0 ||
+        address_length > static_cast<int>(sizeof(sockaddr_storage)))) ||
+      (listener == nullptr && socket_listener == nullptr))
+    result = E_INVALIDARG;
+  else if (!IsValid())
+    result = HRESULT_FROM_ERRNO(ENOTSOCK);
+
+  if (SUCCEEDED(result)) {
+    switch (type) {
+      case SocketRequest::Receive:
+      case SocketRequest::Send:
+      case GeneralRequest::Read:
+      case GeneralRequest::Write:
+        if (!connected())
+          result = HRESULT_FROM_ERRNO(ENOTCONN);
+        break;
+
+      case SocketRequest::ReceiveFrom:
+      case SocketRequest::SendTo:
+        if (!bound())
+          result = HRESULT_FROM_ERRNO(EINVAL);
+        else if (connected())
+          result = HRESULT_FROM_ERRNO(EISCONN);
+        break;
+    }
+  }
+
+  if (SUCCEEDED(result)) {
+    auto context = CreateContext<AsyncContext>(type, buffer, length, nullptr,
+                                               storage);
+    if (context != nullptr) {
+      if (socket_listener != nullptr)
+        context->listener = socket_listener;
+      else
+        context->listener = listener;
+
+      context->flags = flags;
+
+      if (address != nullptr) {
+        memmove(&context->address, address, address_length);
+        context->address_length = address_length;
+      } else {
+        context->address_length = sizeof(context->address);
+      }
+
+      result = DispatchRequest(std::move(context), timeout);
+    } else {
+      result = E_OUTOFMEMORY;
+    }
+  }
+
+  if (SUCCEEDED(result))
+    return;
+
+  switch (type) {
+    case SocketRequest::Receive:
+      socket_listener->OnReceived(this, result, buffer, 0, 0);
+      break;
+
+    case SocketRequest::ReceiveFrom:
+      socket_listener->OnReceivedFrom(this, result, buffer, 0, 0, nullptr, 0);
+      break;
+
+    case SocketRequest::Send:
+      socket_listener->OnSent(this, result, buffer, 0);
+      break;
+
+    case SocketRequest::SendTo:
+      socket_listener->OnSentTo(
+          this, result, buffer, 0, static_cast<sockaddr*>(address),
+          address_length);
+      break;
+
+    case GeneralRequest::Read:
+      listener->OnRead(this, result, buffer, 0);
+      break;
+
+    case GeneralRequest::Write:
+      listener->OnWritten(this, result, const_cast<void*>(buffer), 0);
+      break;
+
+    default:
+      assert(false);
+  }
+}
+
+SocketStream::AsyncContext* SocketStream::BeginCommunicate(
+    int type, void* buffer, uint32_t length, int flags, void* address,
+    int address_length) {
+  if (address != nullptr &&
+      (address_length <= 0 ||
+       address_length > static_cast<int>(sizeof(sockaddr_storage))))
+    return nullptr;
+  if (!IsValid())
+    return nullptr;
+
+  switch (type) {
+    case SocketRequest::Receive:
+    case SocketRequest::Send:
+      if (!connected())
+        return nullptr;
+      break;
+
+    case SocketRequest::ReceiveFrom:
+    case SocketRequest::SendTo:
+      if (!bound() || connected())
+        return nullptr;
+      break;
+  }
+
+  auto context = CreateContext<AsyncContext>(type, buffer, length, nullptr);
+  if (context == nullptr)
+    return nullptr;
+
+  context->flags = flags;
+
+  if (address != nullptr) {
+    memmove(&context->address, address, address_length);
+    context->address_length = address_length;
+  } else {
+    context->address_length = sizeof(context->address);
+  }
+
+  auto pointer = context.get();
+  HRESULT result = DispatchRequest(std::move(context));
+  if (FAILED(result))
+    return nullptr;
+
+  return pointer;
+}
+
+void SocketStream::OnRequested(AbstractStream::AsyncContext* abstract_context) {
+  auto context = static_cast<AsyncContext*>(abstract_context);
+  context->callback = OnCompleted;
+
+  HRESULT result;
+  if (context->type == SocketRequest::Connect) {
+    result = ConnectAsync(context);
+  } else {
+    // Submitted with the lock held, so that cancelling the request either
+    // finds it submitted or is noticed here.
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    if (context->cancelled)
+      result = context->CancelResult();
+    else if (IsWrite(context->type))
+      result = WriteAsync(context);
+    else
+      result = CommunicateAsync(context);
+  }
+
+  if (FAILED(result)) {
+    if (context->type == SocketRequest::Connect)
+      Reset();
+
+    OnCompleted(context, result, 0);
+  }
+}
+
+bool SocketStream::IsRead(int type) const {
+  return type == SocketRequest::Receive ||
+         type == SocketRequest::ReceiveFrom ||
+         AbstractStream::IsRead(type);
+}
+
+bool SocketStream::IsWrite(int type) const {
+  return type == SocketRequest::Send || type == SocketRequest::SendTo ||
+         type == SocketRequest::Transmit || AbstractStream::IsWrite(type);
+}
+
+// A write still waiting for its turn is not known to the completion port, so
+// it is taken out of the queue and completed here.
+void SocketStream::CancelRequest(
+    AbstractStream::AsyncContext* abstract_context) {
+  auto context = static_cast<AsyncContext*>(abstract_context);
+
+  auto position = std::find(writes_.begin(), writes_.end(), context);
+  if (position == writes_.end()) {
+    AbstractStream::CancelRequest(context);
+    return;
+  }
+
+  writes_.erase(position);
+  OnCompleted(context, context->CancelResult(), 0);
+}
+
+void SocketStream::OnCompleted(madoka::io::CompletionPacket* packet,
+                               int result) {
+  auto context = static_cast<AsyncContext*>(packet);
+  auto stream = static_cast<SocketStream*>(context->stream);
+
+  if (result < 0) {
+    HRESULT error = HRESULT_FROM_ERRNO(-result);
+
+    // Closing the stream cancels its requests as well, which is reported as
+    // aborted like AsyncSocket does.
+    if (result == -ECANCELED) {
+      madoka::concurrent::LockGuard guard(&stream->lock_);
+      error = context->cancelled ? context->CancelResult() : E_ABORT;
+    }
+
+    stream->OnCompleted(context, error, context->transferred);
+    return;
+  }
+
+  if (context->type == SocketRequest::Transmit) {
+    if (context->piped == 0) {
+      context->piped = result;
+    } else {
+      context->piped -= result;
+      context->transferred += result;
+    }
+
+    // Done once the pipe is empty and the whole length sent, or the file has
+    // ended.
+    if (result > 0 &&
+        (context->piped > 0 || context->transferred < context->length)) {
+      HRESULT next;
+      {
+        madoka::concurrent::LockGuard guard(&stream->lock_);
+
+        if (context->cancelled)
+          next = context->CancelResult();
+        else
+          next = stream->TransmitAsync(context);
+      }
+
+      if (FAILED(next))
+        stream->OnCompleted(context, next, context->transferred);
+
+      return;
+    }
+
+    stream->OnCompleted(context, S_OK, context->transferred);
+    return;
+  }
+
+  context->transferred += result;
+
+  switch (context->type) {
+    case SocketRequest::Send:
+    case GeneralRequest::Write:
+      // Stream sockets may accept less than asked for; keep going until the
+      // whole buffer is sent, as overlapped sends do on Windows.
+      if (result > 0 && context->transferred < context->length) {
+        HRESULT next;
+        {
+          madoka::concurrent::LockGuard guard(&stream->lock_);
+
+          if (context->cancelled)
+            next = context->CancelResult();
+          else
+            next = stream->CommunicateAsync(context);
+        }
+
+        if (FAILED(next))
+          stream->OnCompleted(context, next, context->transferred);
+
+        return;
+      }
+      break;
+
+    case SocketRequest::Receive:
+    case SocketRequest::ReceiveFrom:
+      context->flags = context->message.msg_flags;
+      context->address_length = context->message.msg_namelen;
+      break;
+  }
+
+  stream->OnCompleted(context, S_OK, context->transferred);
+}
+
+void SocketStream::OnCompleted(AsyncContext* context, HRESULT result,
+                               uint64_t length) {
+  // What a transmission leaves in the pipe would go out with the next one.
+  if (context->type == SocketRequest::Transmit && context->piped > 0) {
+    madoka::concurrent::LockGuard guard(&lock_);
+    ClosePipe();
+  }
+
+  if (IsWrite(context->type))
+    WriteNext(context);
+
+  if (context->listener == nullptr) {
+    context->result = result;
+    context->transferred = length;
+    SetCompleted(context);
+    return;
+  }
+
+  context->result = result;
+  context->transferred = length;
+  Notify(context, OnNotified);
+}
+
+void SocketStream::OnNotified(AbstractStream::AsyncContext* abstract_context) {
+  auto context = static_cast<AsyncContext*>(abstract_context);
+  static_cast<SocketStream*>(context->stream)->OnNotified(context);
+}
+
+void SocketStream::OnNotified(AsyncContext* context) {
+  {
+    madoka::concurrent::LockGuard guard(&lock_);
+
+    if (!IsValidRequest(context))
+      return;
+  }
+
+  auto listener = static_cast<Listener*>(context->listener);
+  HRESULT result = context->result;
+  uint64_t length = context->transferred;
+
+  // The listener may reuse the storage of a context it provided, so such a
+  // context is ended first; the stream is kept until the listener returns.
+  bool owned = context->owned;
+  if (!owned)
+    EndRequestBeforeCallback(context);
+
+  switch (context->type) {
+    case SocketRequest::Connect:
+      if (SUCCEEDED(result))
+        connected_ = true;
+
+      if (!connected())
+        Close();
+
+      listener->OnConnected(this, result, context->end_point);
+      break;
+
+    case SocketRequest::Receive:
+      listener->OnReceived(this, result, context->buffer,
+                           length, context->flags);
+      break;
+
+    case SocketRequest::ReceiveFrom:
+      listener->OnReceivedFrom(
+          this, result, context->buffer, length, context->flags,
+          reinterpret_cast<sockaddr*>(&context->address),
+          context->address_length);
+      break;
+
+    case SocketRequest::Send:
+      listener->OnSent(this, result, context->buffer, length);
+      break;
+
+    case SocketRequest::SendTo:
+      listener->OnSentTo(this, result, context->buffer, length,
+                         reinterpret_cast<sockaddr*>(&context->address),
+                         context->address_length);
+      break;
+
+    case SocketRequest::Transmit:
+      listener->OnSent(this, result, nullptr, length);
+      break;
+
+    case GeneralRequest::Read:
+      static_cast<Stream::Listener*>(context->listener)->OnRead(
+          this, result, context->buffer, length);
+      break;
+
+    case GeneralRequest::Write:
+      static_cast<Stream::Listener*>(context->listener)->OnWritten(
+          this, result, context->buffer, length);
+      break;
+
+    default:
+      assert(false);
+  }
+
+  if (owned)
+    EndRequest(context);
+  else
+    EndCallback();
+}
+
+}  // namespace net
+}  // namespace madoka
@@ -4,10 +4,12 @@
 
 #include <assert.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "madoka/concurrent/lock_guard.h"
 
+#include "concurrent/object_pool.h"
 #include "io/abstract_stream_impl.h"
 
 namespace {
@@ -18,8 +20,12 @@ enum SocketRequest {
   ReceiveFrom,
   Send,
   SendTo,
+  Transmit,
 };
 
+// The most TransmitFile sends with one call.
+const uint64_t kMaxTransmit = INT32_MAX - 1;
+
 std::vector<WSABUF> CreateBuffers(void* start, uint64_t length) {
   const uint64_t kDivisor = UINT32_MAX + 1ULL;
   DWORD count = length / kDivisor;
@@ -46,23 +52,35 @@ std::vector<WSABUF> CreateBuffers(void* start, uint64_t length) {
 }
 
 LPFN_CONNECTEX ConnectEx = nullptr;
+LPFN_TRANSMITFILE TransmitFileFunction = nullptr;
 
 }  // namespace
 
 namespace madoka {
 namespace net {
 
-struct SocketStream::AsyncContext : AbstractStream::AsyncContext, OVERLAPPED {
+struct SocketStream::AsyncContext
+    : AbstractStream::AsyncContext,
+      madoka::concurrent::PooledObject<SocketStream::AsyncContext>,
+      OVERLAPPED {
   const addrinfo* end_point;
   const ADDRINFOW* end_pointw;
   sockaddr_storage address;
   int address_length;
   DWORD flags;
+  // A transmission sends |file| from |offset| on, |transferred| bytes so far.
+  HANDLE file;
+  uint64_t offset;
+  uint64_t transferred;
 };
 
 SocketStream::SocketStream() : io_(nullptr) {
 }
 
+SocketStream::SocketStream(madoka::concurrent::Executor executor)
+    : AbstractStream(executor), io_(nullptr) {
+}
+
 SocketStream::~SocketStream() {
   Reset();
 }
@@ -73,7 +91,17 @@ void SocketStream::Close() {
 }
 
 void SocketStream::ConnectAsync(const addrinfo* end_point, Listener* listener) {
-  ConnectAsync(end_point, nullptr, listener);
+  ConnectAsync(end_point, nullptr, listener, madoka::io::kNoTimeout, nullptr);
+}
+
+void SocketStream::ConnectAsync(const addrinfo* end_point, Listener* listener,
+                                std::chrono::milliseconds timeout) {
+  ConnectAsync(end_point, nullptr, listener, timeout, nullptr);
+}
+
+void SocketStream::ConnectAsync(const addrinfo* end_point, Listener* listener,
+                                ContextStorage* storage) {
+  ConnectAsync(end_point, nullptr, listener, madoka::io::kNoTimeout, storage);
 }
 
 SocketStream::AsyncContext* SocketStream::BeginConnect(
@@ -89,19 +117,15 @@ HRESULT SocketStream::EndConnect(AsyncContext* context,
       context->end_point == nullptr)
     return E_HANDLE;
 
-  HRESULT result = S_OK;
-  DWORD length, flags;
-
-  if (WaitForSingleObject(context->hEvent, INFINITE) == WAIT_OBJECT_0 &&
-      WSAGetOverlappedResult(descriptor_, context, &length, TRUE, &flags)) {
+  DWORD length;
+  HRESULT result = WaitForResult(context, &length);
+  if (SUCCEEDED(result)) {
     if (SetOption(SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0))
       connected_ = true;
     else
       result = HRESULT_FROM_LAST_ERROR();
 
     *end_point = context->end_point;
-  } else {
-    result = HRESULT_FROM_LAST_ERROR();
   }
 
   EndRequest(context);
@@ -114,7 +138,12 @@ HRESULT SocketStream::EndConnect(AsyncContext* context,
 
 void SocketStream::ConnectAsync(const ADDRINFOW* end_point,
                                 Listener* listener) {
-  ConnectAsync(nullptr, end_point, listener);
+  ConnectAsync(nullptr, end_point, listener, madoka::io::kNoTimeout, nullptr);
+}
+
+void SocketStream::ConnectAsync(const ADDRINFOW* end_point, Listener* listener,
+                                std::chrono::milliseconds timeout) {
+  ConnectAsync(nullptr, end_point, listener, timeout, nullptr);
 }
 
 SocketStream::AsyncContext* SocketStream::BeginConnect(
@@ -130,15 +159,11 @@ HRESULT SocketStream::EndConnect(AsyncContext* context,
       context->end_pointw == nullptr)
     return E_HANDLE;
 
-  HRESULT result = S_OK;
-  DWORD length, flags;
-
-  if (WaitForSingleObject(context->hEvent, INFINITE) == WAIT_OBJECT_0 &&
-      WSAGetOverlappedResult(descriptor_, context, &length, TRUE, &flags)) {
+  DWORD length;
+  HRESULT result = WaitForResult(context, &length);
+  if (SUCCEEDED(result)) {
     *end_point = context->end_pointw;
     connected_ = true;
-  } else {
-    result = HRESULT_FROM_LAST_ERROR();
   }
 
   EndRequest(context);
@@ -158,8 +183,20 @@ HRESULT SocketStream::EndConnect(AsyncContext* context) {
 
 void SocketStream::ReceiveAsync(void* buffer, uint64_t length, int flags,
                                 Listener* listener) {
+  ReceiveAsync(buffer, length, flags, listener, madoka::io::kNoTimeout);
+}
+
+void SocketStream::ReceiveAsync(void* buffer, uint64_t length, int flags,
+                                Listener* listener,
+                                std::chrono::milliseconds timeout) {
   CommunicateAsync(SocketRequest::Receive, buffer, length, flags, nullptr, 0,
-                   nullptr, listener);
+                   nullptr, listener, timeout, nullptr);
+}
+
+void SocketStream::ReceiveAsync(void* buffer, uint64_t length, int flags,
+                                Listener* listener, ContextStorage* storage) {
+  CommunicateAsync(SocketRequest::Receive, buffer, length, flags, nullptr, 0,
+                   nullptr, listener, madoka::io::kNoTimeout, storage);
 }
 
 SocketStream::AsyncContext* SocketStream::BeginReceive(
@@ -177,32 +214,44 @@ HRESULT SocketStream::EndReceive(AsyncContext* context, DWORD* length,
 
   *length = 0;
 
-  HRESULT result = S_OK;
-
-  if (WaitForSingleObject(context->hEvent, INFINITE) == WAIT_OBJECT_0 &&
-      WSAGetOverlappedResult(descriptor_, context, length, TRUE,
-                             &context->flags)) {
-    if (flags != nullptr)
-      *flags = context->flags;
-  } else {
-    result = HRESULT_FROM_LAST_ERROR();
-  }
+  HRESULT result = WaitForResult(context, length);
+  if (SUCCEEDED(result) && flags != nullptr)
+    *flags = context->flags;
 
   EndRequest(context);
 
-  return S_OK;
+  return result;
 }
 
 void SocketStream::ReceiveFromAsync(void* buffer, uint64_t length, int flags,
                                     Listener* listener) {
+  ReceiveFromAsync(buffer, length, flags, listener, madoka::io::kNoTimeout);
+}
+
+void SocketStream::ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                                    Listener* listener,
+                                    std::chrono::milliseconds timeout) {
+  CommunicateAsync(SocketRequest::ReceiveFrom, buffer, length, flags, nullptr,
+                   0, nullptr, listener, timeout, nullptr);
+}
+
+void SocketStream::ReceiveFromAsync(void* buffer, uint64_t length, int flags,
+                                    Listener* listener,
+                                    ContextStorage* storage) {
   CommunicateAsync(SocketRequest::ReceiveFrom, buffer, length, flags, nullptr,
-                   0, nullptr, listener);
+                   0, nullptr, listener, madoka::io::kNoTimeout, storage);
 }
 
 void SocketStream::SendAsync(const void* buffer, uint64_t length, int flags,
                              Listener* listener) {
+  SendAsync(buffer, length, flags, listener, nullptr);
+}
+
+void SocketStream::SendAsync(const void* buffer, uint64_t length, int flags,
+                             Listener* listener, ContextStorage* storage) {
   CommunicateAsync(SocketRequest::Send, const_cast<void*>(buffer), length,
-                   flags, nullptr, 0, nullptr, listener);
+                   flags, nullptr, 0, nullptr, listener,
+                   madoka::io::kNoTimeout, storage);
 }
 
 SocketStream::AsyncContext* SocketStream::BeginReceiveFrom(
@@ -221,11 +270,8 @@ HRESULT SocketStream::EndReceiveFrom(AsyncContext* context, DWORD* length,
 
   *length = 0;
 
-  HRESULT result = S_OK;
-
-  if (WaitForSingleObject(context->hEvent, INFINITE) == WAIT_OBJECT_0 &&
-      WSAGetOverlappedResult(descriptor_, context, length, TRUE,
-                             &context->flags)) {
+  HRESULT result = WaitForResult(context, length);
+  if (SUCCEEDED(result)) {
     if (flags != nullptr)
       *flags = context->flags;
 
@@ -234,8 +280,6 @@ HRESULT SocketStream::EndReceiveFrom(AsyncContext* context, DWORD* length,
                 context->address_length);
       *address_length = context->address_length;
     }
-  } else {
-    result = HRESULT_FROM_LAST_ERROR();
   }
 
   EndRequest(context);
@@ -257,12 +301,7 @@ HRESULT SocketStream::EndSend(AsyncContext* context, DWORD* length) {
 
   *length = 0;
 
-  HRESULT result = S_OK;
-
-  if (WaitForSingleObject(context->hEvent, INFINITE) != WAIT_OBJECT_0 ||
-      !WSAGetOverlappedResult(descriptor_, context, length, TRUE,
-                              &context->flags))
-    result = HRESULT_FROM_LAST_ERROR();
+  HRESULT result = WaitForResult(context, length);
 
   EndRequest(context);
 
@@ -271,9 +310,16 @@ HRESULT SocketStream::EndSend(AsyncContext* context, DWORD* length) {
 
 void SocketStream::SendToAsync(const void* buffer, uint64_t length, int flags,
                                void* to, int to_length, Listener* listener) {
+  SendToAsync(buffer, length, flags, to, to_length, listener, nullptr);
+}
+
+void SocketStream::SendToAsync(const void* buffer, uint64_t length, int flags,
+                               void* to, int to_length, Listener* listener,
+                               ContextStorage* storage) {
   if (to != nullptr)
     CommunicateAsync(SocketRequest::SendTo, const_cast<void*>(buffer), length,
-                     flags, to, to_length, nullptr, listener);
+                     flags, to, to_length, nullptr, listener,
+                     madoka::io::kNoTimeout, storage);
   else
     listener->OnSentTo(this, E_INVALIDARG, const_cast<void*>(buffer), 0,
                        static_cast<sockaddr*>(to), to_length);
@@ -297,18 +343,51 @@ HRESULT SocketStream::EndSendTo(AsyncContext* context, DWORD* length) {
 
   *length = 0;
 
-  HRESULT result = S_OK;
-
-  if (WaitForSingleObject(context->hEvent, INFINITE) != WAIT_OBJECT_0 ||
-      !WSAGetOverlappedResult(descriptor_, context, length, TRUE,
-                              &context->flags))
-    result = HRESULT_FROM_LAST_ERROR();
+  HRESULT result = WaitForResult(context, length);
 
   EndRequest(context);
 
   return result;
 }
 
+void SocketStream::TransmitFileAsync(HANDLE file, uint64_t offset,
+                                     uint64_t length, Listener* listener) {
+  HRESULT result = S_OK;
+
+  if (file == NULL || file == INVALID_HANDLE_VALUE || listener == nullptr)
+    result = E_INVALIDARG;
+  else if (!IsValid())
+    result = __HRESULT_FROM_WIN32(WSAENOTSOCK);
+  else if (!connected())
+    result = __HRESULT_FROM_WIN32(WSAENOTCONN);
+
+  // TransmitFile would take zero for the whole file.
+  if (SUCCEEDED(result) && length == 0) {
+    listener->OnSent(this, S_OK, nullptr, 0);
+    return;
+  }
+
+  if (SUCCEEDED(result)) {
+    auto context = CreateContext<AsyncContext>(SocketRequest::Transmit,
+                                               nullptr, length, nullptr);
+    if (context != nullptr) {
+      context->listener = listener;
+      context->file = file;
+      context->offset = offset;
+      result = DispatchRequest(std::move(context));
+    } else {
+      result = E_OUTOFMEMORY;
+    }
+  }
+
+  if (FAILED(result) && listener != nullptr)
+    listener->OnSent(this, result, nullptr, 0);
+}
+
+bool SocketStream::Cancel(AsyncContext* context) {
+  return AbstractStream::Cancel(context);
+}
+
 HRESULT SocketStream::Read(void* buffer, uint64_t* length) {
   if (length == nullptr)
     return E_INVALIDARG;
@@ -335,7 +414,7 @@ HRESULT SocketStream::Read(void* buffer, uint64_t* length) {
 void SocketStream::ReadAsync(void* buffer, uint64_t length,
                              AbstractStream::Listener* listener) {
   CommunicateAsync(GeneralRequest::Read, buffer, length, 0, nullptr, 0,
-                   listener, nullptr);
+                   listener, nullptr, madoka::io::kNoTimeout, nullptr);
 }
 
 HRESULT SocketStream::Write(const void* buffer, uint64_t* length) {
@@ -364,7 +443,8 @@ HRESULT SocketStream::Write(const void* buffer, uint64_t* length) {
 void SocketStream::WriteAsync(const void* buffer, uint64_t length,
                               AbstractStream::Listener* listener) {
   CommunicateAsync(GeneralRequest::Write, const_cast<void*>(buffer), length, 0,
-                   nullptr, 0, listener, nullptr);
+                   nullptr, 0, listener, nullptr, madoka::io::kNoTimeout,
+                   nullptr);
 }
 
 void SocketStream::Reset() {
@@ -385,7 +465,9 @@ void SocketStream::Reset() {
 
 void SocketStream::ConnectAsync(const addrinfo* end_point,
                                 const ADDRINFOW* end_pointw,
-                                Listener* listener) {
+                                Listener* listener,
+                                std::chrono::milliseconds timeout,
+                                ContextStorage* storage) {
   HRESULT result = S_OK;
 
   if (end_point == nullptr && end_pointw == nullptr || listener == nullptr)
@@ -395,12 +477,12 @@ void SocketStream::ConnectAsync(const addrinfo* end_point,
 
   if (SUCCEEDED(result)) {
     auto context = CreateContext<AsyncContext>(SocketRequest::Connect, nullptr,
-                                               0, nullptr);
+                                               0, nullptr, storage);
     if (context != nullptr) {
       context->listener = listener;
       context->end_point = end_point;
       context->end_pointw = end_pointw;
-      result = DispatchRequest(std::move(context));
+      result = DispatchRequest(std::move(context), timeout);
     } else {
       result = E_OUTOFMEMORY;
     }
@@ -416,12 +498,12 @@ void SocketStream::ConnectAsync(const addrinfo* end_point,
 
 SocketStream::AsyncContext* SocketStream::BeginConnect(
     const addrinfo* end_point, const ADDRINFOW* end_pointw, HANDLE event) {
-  if (end_point == nullptr && end_pointw == nullptr || event == NULL)
+  if (end_point == nullptr && end_pointw == nullptr)
     return nullptr;
   if (connected())
     return nullptr;
 
-  if (!ResetEvent(event))
+  if (event != NULL && !ResetEvent(event))
     return nullptr;
 
   auto context = CreateContext<AsyncContext>(SocketRequest::Connect, nullptr, 0,
@@ -479,19 +561,29 @@ BOOL SocketStream::ConnectAsync(AsyncContext* context) {
     return FALSE;
 
   io_ = CreateThreadpoolIo(reinterpret_cast<HANDLE>(descriptor_),
-                           OnCompleted, this, nullptr);
+                           OnCompleted, this, executor_);
   if (io_ == nullptr)
     return FALSE;
 
   StartThreadpoolIo(io_);
 
+  // Like the other requests, started with the lock held so that a timeout
+  // either finds it started or is noticed here.
+  madoka::concurrent::LockGuard guard(&lock_);
+
+  if (context->cancelled) {
+    WSASetLastError(WSA_OPERATION_ABORTED);
+    return FALSE;
+  }
+
   return ConnectEx(descriptor_, address, address_length, nullptr, 0, nullptr,
                    context);
 }
 
 void SocketStream::CommunicateAsync(
     int type, void* buffer, uint64_t length, int flags, void* address,
-    int address_length, Stream::Listener* listener, Listener* socket_listener) {
+    int address_length, Stream::Listener* listener, Listener* socket_listener,
+    std::chrono::milliseconds timeout, ContextStorage* storage) {
   HRESULT result = S_OK;
 
   if (address != nullptr &&
@@ -522,7 +614,8 @@ void SocketStream::CommunicateAsync(
   }
 
   if (SUCCEEDED(result)) {
-    auto context = CreateContext<AsyncContext>(type, buffer, length, nullptr);
+    auto context = CreateContext<AsyncContext>(type, buffer, length, nullptr,
+                                               storage);
     if (context != nullptr) {
       if (socket_listener != nullptr)
         context->listener = socket_listener;
@@ -539,7 +632,7 @@ void SocketStream::CommunicateAsync(
         context->address_length = sizeof(context->address);
       }
 
-      result = DispatchRequest(std::move(context));
+      result = DispatchRequest(std::move(context), timeout);
     } else {
       result = E_OUTOFMEMORY;
     }
@@ -580,19 +673,43 @@ void SocketStream::CommunicateAsync(
   }
 }
 
+// Sends the next part of the file of |context|, which TransmitFile reads from
+// the offset in the OVERLAPPED.
+BOOL SocketStream::TransmitAsync(AsyncContext* context) {
+  if (TransmitFileFunction == nullptr) {
+    GUID guid = WSAID_TRANSMITFILE;
+    DWORD size = 0;
+    int result = WSAIoctl(descriptor_, SIO_GET_EXTENSION_FUNCTION_POINTER,
+                          &guid, sizeof(guid), &TransmitFileFunction,
+                          sizeof(TransmitFileFunction), &size, nullptr,
+                          nullptr);
+    if (result != 0)
+      return FALSE;
+  }
+
+  uint64_t offset = context->offset + context->transferred;
+  context->Offset = static_cast<DWORD>(offset);
+  context->OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+  DWORD length = static_cast<DWORD>(
+      std::min(context->length - context->transferred, kMaxTransmit));
+
+  return TransmitFileFunction(descriptor_, context->file, length, 0, context,
+                              nullptr, 0);
+}
+
 SocketStream::AsyncContext* SocketStream::BeginCommunicate(
     int type, void* buffer, DWORD length, int flags, void* address,
     int address_length, HANDLE event) {
   if (address != nullptr &&
-      (address_length <= 0 || address_length > _SS_MAXSIZE) ||
-      event == NULL)
+      (address_length <= 0 || address_length > _SS_MAXSIZE))
     return nullptr;
   if (!connected())
     return nullptr;
   if (!IsValid())
     return nullptr;
 
-  if (!ResetEvent(event))
+  if (event != NULL && !ResetEvent(event))
     return nullptr;
 
   auto context = CreateContext<AsyncContext>(type, buffer, length, nullptr);
@@ -616,19 +733,46 @@ SocketStream::AsyncContext* SocketStream::BeginCommunicate(
   return pointer;
 }
 
+HRESULT SocketStream::WaitForResult(AsyncContext* context, DWORD* length) {
+  if (context->hEvent == NULL) {
+    WaitForCompletion(context);
+    if (FAILED(context->result))
+      return context->result;
+  } else if (WaitForSingleObject(context->hEvent, INFINITE) != WAIT_OBJECT_0) {
+    return HRESULT_FROM_LAST_ERROR();
+  }
+
+  // Done by now; without an event there would be nothing to wait on anyway.
+  if (!WSAGetOverlappedResult(descriptor_, context, length, FALSE,
+                              &context->flags)) {
+    if (WSAGetLastError() == WSA_OPERATION_ABORTED && context->cancelled)
+      return context->CancelResult();
+
+    return HRESULT_FROM_LAST_ERROR();
+  }
+
+  return S_OK;
+}
+
 void SocketStream::OnRequested(AbstractStream::AsyncContext* abstract_context) {
   auto context = static_cast<AsyncContext*>(abstract_context);
   HRESULT result = S_OK;
 
-  if (context->type != SocketRequest::Connect) {
-    madoka::concurrent::LockGuard guard(&lock_);
+  // Reads and writes are started with the lock held, so that cancelling one
+  // either finds it started or is noticed here.
+  bool locked = context->type != SocketRequest::Connect;
+  if (locked) {
+    lock_.Lock();
 
     if (io_ == nullptr) {
       io_ = CreateThreadpoolIo(reinterpret_cast<HANDLE>(descriptor_),
-                               OnCompleted, this, nullptr);
+                               OnCompleted, this, executor_);
       if (io_ == nullptr)
         result = HRESULT_FROM_LAST_ERROR();
     }
+
+    if (SUCCEEDED(result) && context->cancelled)
+      result = context->CancelResult();
   }
 
   if (SUCCEEDED(result)) {
@@ -672,6 +816,10 @@ void SocketStream::OnRequested(AbstractStream::AsyncContext* abstract_context) {
         break;
       }
 
+      case SocketRequest::Transmit:
+        succeeded = TransmitAsync(context);
+        break;
+
       case SocketRequest::SendTo: {
         auto buffers = CreateBuffers(context->buffer, context->length);
         succeeded = WSASendTo(descriptor_,
@@ -704,10 +852,31 @@ void SocketStream::OnRequested(AbstractStream::AsyncContext* abstract_context) {
     }
   }
 
+  if (locked)
+    lock_.Unlock();
+
   if (FAILED(result))
     OnCompleted(context, result, 0);
 }
 
+bool SocketStream::IsRead(int type) const {
+  return type == SocketRequest::Receive ||
+         type == SocketRequest::ReceiveFrom ||
+         AbstractStream::IsRead(type);
+}
+
+bool SocketStream::IsWrite(int type) const {
+  return type == SocketRequest::Send || type == SocketRequest::SendTo ||
+         type == SocketRequest::Transmit || AbstractStream::IsWrite(type);
+}
+
+void SocketStream::CancelRequest(
+    AbstractStream::AsyncContext* abstract_context) {
+  if (IsValid())
+    CancelIoEx(reinterpret_cast<HANDLE>(descriptor_),
+               static_cast<AsyncContext*>(abstract_context));
+}
+
 void CALLBACK SocketStream::OnCompleted(PTP_CALLBACK_INSTANCE /*callback*/,
                                         void* instance, void* overlapped,
                                         ULONG error, ULONG_PTR length,
@@ -723,12 +892,61 @@ void SocketStream::OnCompleted(AsyncContext* context, HRESULT result,
   {
     madoka::concurrent::LockGuard guard(&lock_);
 
-    if (!IsValidRequest(context) || context->listener == nullptr)
+    if (!IsValidRequest(context))
       return;
+
+    if (context->cancelled &&
+        result == HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED))
+      result = context->CancelResult();
+
+    // A transmission longer than TransmitFile takes at once goes on from
+    // where the last part ended, until nothing is left or the file ends.
+    if (context->type == SocketRequest::Transmit) {
+      context->transferred += length;
+
+      if (SUCCEEDED(result) && length > 0 &&
+          context->transferred < context->length) {
+        if (context->cancelled) {
+          result = context->CancelResult();
+        } else {
+          StartThreadpoolIo(io_);
+
+          if (TransmitAsync(context))
+            return;
+
+          int error = WSAGetLastError();
+          if (error == WSA_IO_PENDING)
+            return;
+
+          CancelThreadpoolIo(io_);
+          result = __HRESULT_FROM_WIN32(error);
+        }
+      }
+
+      length = static_cast<ULONG_PTR>(context->transferred);
+    }
+
+    if (context->listener == nullptr) {
+      if (context->hEvent != NULL)
+        return;
+
+      context->result = result;
+    }
+  }
+
+  if (context->listener == nullptr) {
+    SetCompleted(context);
+    return;
   }
 
   auto listener = static_cast<Listener*>(context->listener);
 
+  // The listener may reuse the storage of a context it provided, so such a
+  // context is ended first; the stream is kept until the listener returns.
+  bool owned = context->owned;
+  if (!owned)
+    EndRequestBeforeCallback(context);
+
   switch (context->type) {
     case SocketRequest::Connect:
       if (SUCCEEDED(result)) {
@@ -769,6 +987,10 @@ void SocketStream::OnCompleted(AsyncContext* context, HRESULT result,
                          context->address_length);
       break;
 
+    case SocketRequest::Transmit:
+      listener->OnSent(this, result, nullptr, length);
+      break;
+
     case GeneralRequest::Read:
       static_cast<Stream::Listener*>(context->listener)->OnRead(
           this, result, context->buffer, length);
@@ -783,7 +1005,10 @@ void SocketStream::OnCompleted(AsyncContext* context, HRESULT result,
       assert(false);
   }
 
-  EndRequest(context);
+  if (owned)
+    EndRequest(context);
+  else
+    EndCallback();
 }
 
 }  // namespace net